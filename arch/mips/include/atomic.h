@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _MIPS_ATOMIC_H_
+#define _MIPS_ATOMIC_H_
+
+/*
+ * Atomic operations, using LL/SC. See <atomic.h>.
+ *
+ * If the SC fails because someone else stored to the word after our
+ * LL, we go around and try again; unlike a spinlock acquire, the
+ * caller can't usefully do anything with a spurious failure.
+ */
+
+unsigned atomic_cas(volatile unsigned *p, unsigned old, unsigned new);
+unsigned atomic_swap(volatile unsigned *p, unsigned new);
+unsigned atomic_add(volatile unsigned *p, unsigned delta);
+void *atomic_cas_ptr(void *volatile *p, void *old, void *new);
+void *atomic_swap_ptr(void *volatile *p, void *new);
+
+////////////////////////////////////////////////////////////
+
+ATOMIC_INLINE
+unsigned
+atomic_cas(volatile unsigned *p, unsigned old, unsigned new)
+{
+	unsigned x, y;
+
+	/*
+	 * Load the existing value into X. If it isn't OLD, give up.
+	 * Otherwise try to store NEW with Y; after the SC, Y is 1 if
+	 * the store succeeded and 0 if we need to retry.
+	 */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		".set noreorder;"	/* we fill our own delay slots */
+		"1: ll %0, 0(%2);"	/*   x = *p */
+		"bne %0, %3, 2f;"	/*   if (x != old) done */
+		"move %1, %4;"		/*   y = new (delay slot) */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   if (!y) retry */
+		"nop;"			/*   (delay slot) */
+		"2:"
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y)
+		: "r" (p), "r" (old), "r" (new)
+		: "memory");
+	return x;
+}
+
+ATOMIC_INLINE
+unsigned
+atomic_swap(volatile unsigned *p, unsigned new)
+{
+	unsigned x, y;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		".set noreorder;"	/* we fill our own delay slots */
+		"1: ll %0, 0(%2);"	/*   x = *p */
+		"move %1, %3;"		/*   y = new */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   if (!y) retry */
+		"nop;"			/*   (delay slot) */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y)
+		: "r" (p), "r" (new)
+		: "memory");
+	return x;
+}
+
+ATOMIC_INLINE
+unsigned
+atomic_add(volatile unsigned *p, unsigned delta)
+{
+	unsigned x, y;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		".set noreorder;"	/* we fill our own delay slots */
+		"1: ll %0, 0(%2);"	/*   x = *p */
+		"addu %1, %0, %3;"	/*   y = x + delta */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   if (!y) retry */
+		"nop;"			/*   (delay slot) */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y)
+		: "r" (p), "r" (delta)
+		: "memory");
+	return x;
+}
+
+ATOMIC_INLINE
+void *
+atomic_cas_ptr(void *volatile *p, void *old, void *new)
+{
+	return (void *)atomic_cas((volatile unsigned *)p,
+				  (unsigned)old, (unsigned)new);
+}
+
+ATOMIC_INLINE
+void *
+atomic_swap_ptr(void *volatile *p, void *new)
+{
+	return (void *)atomic_swap((volatile unsigned *)p, (unsigned)new);
+}
+
+
+#endif /* _MIPS_ATOMIC_H_ */
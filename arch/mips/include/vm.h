@@ -123,6 +123,7 @@ struct tlbshootdown {
 	 */
 	struct addrspace *ts_addrspace;
 	vaddr_t ts_vaddr;
+	struct semaphore *ts_done;	/* V()ed once the entry is gone */
 };
 
 #define TLBSHOOTDOWN_MAX 16
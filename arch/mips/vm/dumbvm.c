@@ -29,14 +29,25 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
+#include <kern/sfs.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
 #include <proc.h>
+#include <thread.h>
 #include <current.h>
+#include <cpu.h>
+#include <atomic.h>
+#include <bitmap.h>
+#include <synch.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <uw-vmstats.h>
 #include "opt-A3.h"
 
 /*
@@ -48,9 +59,42 @@
 #define DUMBVM_STACKPAGES    12
 
 #if OPT_A3
+/*
+ * Physical pages are handed out by a binary buddy allocator. Pages
+ * are numbered from lo; a block of order k is 2^k pages starting at a
+ * page number that is a multiple of 2^k, and its buddy is the block
+ * whose page number differs only in bit k. Free blocks of each order
+ * sit on a doubly linked list threaded through the coremap entries
+ * of their first pages, so finding, splitting and coalescing blocks
+ * is O(log n) rather than a scan of all of memory.
+ *
+ * Allocations need not be a power of two: we take the smallest block
+ * that fits and give back the unused tail straight away. The first
+ * coremap entry of an allocation records its length for
+ * free_kpages.
+ *
+ * For user pages the coremap entry also counts the address spaces
+ * sharing the page, for copy-on-write (see as_copy), and, if only one
+ * of them has it, records which one and where, so swap_evict can
+ * take the page back.
+ *
+ * Everything here is protected by stealmem_lock.
+ */
+
+#define BUDDY_ORDERS	16	/* largest block is 2^15 pages */
+#define BUDDY_NONE	(-1)
+
 struct Coremap{
-	bool inuse;
-	bool contiguous;
+	int next;		/* free list links, if free */
+	int prev;
+	unsigned npages;	/* length of allocation, if allocated */
+	unsigned char order;	/* order of block, if free */
+	bool free;		/* first page of a free block */
+	volatile unsigned refcount;	/* address spaces using it */
+	struct addrspace *owner;	/* sole user, if it can be paged out */
+	paddr_t *slot;		/* owner's page table entry for it */
+	vaddr_t vaddr;		/* where owner has it mapped */
+	bool referenced;	/* used since the clock hand last passed */
 };
 struct PageTable{
 	int pindex;
@@ -59,166 +103,1493 @@ paddr_t lo, hi;
 size_t pgNum, newPgNum;
 struct Coremap* coremap;
 bool coremap_exit = false;
+
+static int freelist[BUDDY_ORDERS];
+static unsigned nfree[BUDDY_ORDERS];
+
+/* Copy-on-write counters (see as_cowfault) */
+static volatile unsigned cow_shared;	/* Pages shared by as_copy */
+static volatile unsigned cow_copied;	/* Copied on a write */
+static volatile unsigned cow_kept;	/* Written after the others left */
+
+/* Clock hand for page replacement (see swap_evict) */
+static size_t clock_hand;
+
+#define CLOCK_SCAN	32	/* coremap entries per stealmem_lock hold */
+#define EVICT_BATCH	8	/* pages per swap_evict; <= TLBSHOOTDOWN_MAX */
+#define EVICT_TRIES	4	/* swap_evict calls per allocation */
+
+static unsigned swap_evict(void);
 #endif
 /*
- * Wrap rma_stealmem in a spinlock.
+ * Wrap rma_stealmem and the coremap in a spinlock.
  */
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
+#if OPT_A3
+static
+void
+buddy_push(int index, unsigned order)
+{
+	coremap[index].order = order;
+	coremap[index].free = true;
+	coremap[index].prev = BUDDY_NONE;
+	coremap[index].next = freelist[order];
+	if (freelist[order] != BUDDY_NONE) {
+		coremap[freelist[order]].prev = index;
+	}
+	freelist[order] = index;
+	nfree[order]++;
+}
+
+static
+void
+buddy_remove(int index)
+{
+	unsigned order = coremap[index].order;
+
+	KASSERT(coremap[index].free);
+	if (coremap[index].prev == BUDDY_NONE) {
+		freelist[order] = coremap[index].next;
+	}
+	else {
+		coremap[coremap[index].prev].next = coremap[index].next;
+	}
+	if (coremap[index].next != BUDDY_NONE) {
+		coremap[coremap[index].next].prev = coremap[index].prev;
+	}
+	coremap[index].free = false;
+	nfree[order]--;
+}
+
+/*
+ * Free one aligned block, merging it with its buddy for as long as
+ * the buddy is free and whole.
+ */
+static
+void
+buddy_freeblock(int index, unsigned order)
+{
+	int buddy;
+
+	while (order < BUDDY_ORDERS - 1) {
+		buddy = index ^ (1 << order);
+		if ((size_t)buddy + (1 << order) > newPgNum ||
+		    !coremap[buddy].free || coremap[buddy].order != order) {
+			break;
+		}
+		buddy_remove(buddy);
+		if (buddy < index) {
+			index = buddy;
+		}
+		order++;
+	}
+	buddy_push(index, order);
+}
+
+/*
+ * Free an arbitrary run of pages by splitting it into the largest
+ * aligned blocks it contains.
+ */
+static
+void
+buddy_freerange(size_t start, size_t end)
+{
+	unsigned order;
+
+	while (start < end) {
+		order = 0;
+		while (order < BUDDY_ORDERS - 1 &&
+		       (start & (((size_t)2 << order) - 1)) == 0 &&
+		       start + ((size_t)2 << order) <= end) {
+			order++;
+		}
+		buddy_freeblock((int)start, order);
+		start += (size_t)1 << order;
+	}
+}
+
+static
+paddr_t
+buddy_alloc(unsigned long npages)
+{
+	unsigned order, j;
+	int index;
+
+	KASSERT(npages > 0);
+	order = 0;
+	while (order < BUDDY_ORDERS && (1UL << order) < npages) {
+		order++;
+	}
+	for (j = order; j < BUDDY_ORDERS; j++) {
+		if (freelist[j] != BUDDY_NONE) {
+			break;
+		}
+	}
+	if (j >= BUDDY_ORDERS) {
+		return 0;
+	}
+
+	index = freelist[j];
+	buddy_remove(index);
+	/* Split down to the order we want, freeing the upper halves. */
+	while (j > order) {
+		j--;
+		buddy_push(index + (1 << j), j);
+	}
+	/* Give back what we don't need of the last block. */
+	buddy_freerange(index + npages, index + (1UL << order));
+
+	coremap[index].npages = npages;
+	return lo + index * PAGE_SIZE;
+}
+
+/*
+ * Free an allocation made by buddy_alloc.
+ */
+static
+void
+buddy_free(paddr_t paddr)
+{
+	size_t index, npages;
+
+	index = (paddr - lo) / PAGE_SIZE;
+	KASSERT(index < newPgNum);
+	npages = coremap[index].npages;
+	KASSERT(npages > 0);
+	coremap[index].npages = 0;
+	buddy_freerange(index, index + npages);
+}
+
+/*
+ * Take up to npages single pages from the buddy allocator, with one
+ * trip through stealmem_lock. Returns how many it got.
+ */
+static
+unsigned
+buddy_take(paddr_t *pages, unsigned npages)
+{
+	unsigned got;
+
+	spinlock_acquire(&stealmem_lock);
+	for (got = 0; got < npages; got++) {
+		pages[got] = buddy_alloc(1);
+		if (pages[got] == 0) {
+			break;
+		}
+	}
+	spinlock_release(&stealmem_lock);
+	return got;
+}
+
+/*
+ * Per-cpu page magazines.
+ *
+ * Most allocations are single pages, so each cpu keeps a magazine of
+ * up to PAGEMAG_SIZE free pages in its struct cpu, and only takes
+ * stealmem_lock to move PAGEMAG_BATCH pages at a time between the
+ * magazine and the buddy allocator. To the buddy allocator, pages in
+ * a magazine are still allocated; pagemag_reclaim gives them all
+ * back when it runs short.
+ *
+ * Lock order: the magazine lock, then stealmem_lock.
+ */
+
+#define PAGEMAG_BATCH	(PAGEMAG_SIZE / 2)
+
+static
+paddr_t
+pagemag_get(void)
+{
+	struct cpu *c;
+	paddr_t paddr;
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_pagemag_lock);
+	if (c->c_pagemag_count == 0) {
+		c->c_pagemag_count = buddy_take(c->c_pagemag,
+						PAGEMAG_BATCH);
+	}
+	paddr = 0;
+	if (c->c_pagemag_count > 0) {
+		paddr = c->c_pagemag[--c->c_pagemag_count];
+	}
+	spinlock_release(&c->c_pagemag_lock);
+	return paddr;
+}
+
+/*
+ * Put single pages in the current cpu's magazine. If they don't all
+ * fit, first give a batch from the magazine back to the buddy
+ * allocator, so the next few frees won't have to, and then whatever
+ * still doesn't fit.
+ */
+static
+void
+pagemag_put(const paddr_t *pages, unsigned npages)
+{
+	struct cpu *c;
+	unsigned i;
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_pagemag_lock);
+	i = 0;
+	if (c->c_pagemag_count + npages > PAGEMAG_SIZE) {
+		spinlock_acquire(&stealmem_lock);
+		while (c->c_pagemag_count > PAGEMAG_SIZE - PAGEMAG_BATCH) {
+			buddy_free(c->c_pagemag[--c->c_pagemag_count]);
+		}
+		while (npages - i > PAGEMAG_SIZE - c->c_pagemag_count) {
+			buddy_free(pages[i++]);
+		}
+		spinlock_release(&stealmem_lock);
+	}
+	while (i < npages) {
+		c->c_pagemag[c->c_pagemag_count++] = pages[i++];
+	}
+	spinlock_release(&c->c_pagemag_lock);
+}
+
+/*
+ * Empty every cpu's magazine back into the buddy allocator, so its
+ * pages can coalesce again. Called when we run out of memory.
+ */
+static
+void
+pagemag_reclaim(void)
+{
+	struct cpu *c;
+	unsigned i;
+
+	for (i = 0; i < cpu_count(); i++) {
+		c = cpu_get(i);
+		spinlock_acquire(&c->c_pagemag_lock);
+		spinlock_acquire(&stealmem_lock);
+		while (c->c_pagemag_count > 0) {
+			buddy_free(c->c_pagemag[--c->c_pagemag_count]);
+		}
+		spinlock_release(&stealmem_lock);
+		spinlock_release(&c->c_pagemag_lock);
+	}
+}
+
+/*
+ * Swap. When we run out of memory, swap_evict picks a user page and
+ * writes it to a slot on the swap disk, and the page table entry
+ * that pointed at the page records the slot instead until vm_fault
+ * reads the page back in. So a page table entry is 0 if the page
+ * hasn't been touched yet, the page's physical address if it's in
+ * memory, or the slot number times PAGE_SIZE with PTE_SWAPPED set if
+ * it's on disk.
+ *
+ * Fork shares swapped pages just like pages in memory, so each slot
+ * counts the page table entries pointing at it. The slot bitmap and
+ * counts are protected by swap_maplock.
+ *
+ * There's no swap until vm_swapon is given a disk to use.
+ */
+
+#define PTE_SWAPPED		0x1
+#define PTE_ISSWAPPED(pte)	(((pte) & PTE_SWAPPED) != 0)
+#define PTE_SWAPSLOT(pte)	((unsigned)((pte) / PAGE_SIZE))
+#define PTE_MKSWAP(slot)	((paddr_t)(slot) * PAGE_SIZE | PTE_SWAPPED)
+
+static struct vnode *swap_vnode;	/* NULL if there's no swap */
+static struct bitmap *swap_map;		/* Slots in use */
+static unsigned *swap_refs;		/* Entries using each slot */
+static unsigned swap_nslots;
+static unsigned swap_used;
+static struct spinlock swap_maplock = SPINLOCK_INITIALIZER;
+
+/* Serializes evictions (see swap_evict) and vm_swapon */
+static struct lock swap_lock = LOCK_INITIALIZER("swap");
+
+static
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	spinlock_acquire(&swap_maplock);
+	result = bitmap_alloc(swap_map, slot);
+	if (result == 0) {
+		swap_refs[*slot] = 1;
+		swap_used++;
+	}
+	spinlock_release(&swap_maplock);
+	return result;
+}
+
+static
+void
+swap_ref(unsigned slot)
+{
+	spinlock_acquire(&swap_maplock);
+	KASSERT(swap_refs[slot] > 0);
+	swap_refs[slot]++;
+	spinlock_release(&swap_maplock);
+}
+
+static
+void
+swap_unref(unsigned slot)
+{
+	spinlock_acquire(&swap_maplock);
+	KASSERT(swap_refs[slot] > 0);
+	if (--swap_refs[slot] == 0) {
+		bitmap_unmark(swap_map, slot);
+		swap_used--;
+	}
+	spinlock_release(&swap_maplock);
+}
+
+/*
+ * Read or write the page at PADDR from or to swap slot SLOT.
+ */
+static
+int
+swap_io(paddr_t paddr, unsigned slot, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &u);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &u);
+	}
+	if (result == 0 && u.uio_resid != 0) {
+		result = EIO;
+	}
+	return result;
+}
+#endif
+
 void
 vm_bootstrap(void)
 {
 #if OPT_A3
-	/* spinlock_acquire(&stealmem_lock); */
 	ram_getsize(&lo,&hi);
 	coremap = (struct Coremap*) PADDR_TO_KVADDR(lo);
 	size_t psize = hi - lo;
 	pgNum = psize / PAGE_SIZE;
 	lo += pgNum * sizeof(struct Coremap);
 	lo = ROUNDUP(lo, PAGE_SIZE);
-	for(size_t i = 0; i < pgNum; i++) {
-		coremap[i].inuse = false;
-		coremap[i].contiguous = false;
+	newPgNum = (hi - lo) / PAGE_SIZE;
+
+	for(size_t i = 0; i < newPgNum; i++) {
+		coremap[i].npages = 0;
+		coremap[i].free = false;
+		coremap[i].owner = NULL;
+		coremap[i].referenced = false;
+	}
+	for (unsigned k = 0; k < BUDDY_ORDERS; k++) {
+		freelist[k] = BUDDY_NONE;
+		nfree[k] = 0;
 	}
+	buddy_freerange(0, newPgNum);
 	coremap_exit = true;
-	newPgNum = (hi - lo) / PAGE_SIZE;
-	
+	vmstats_init();
+
 	DEBUG(DB_KMALLOC, "total coremap %ld pages\n", (long int)pgNum);
 	DEBUG(DB_KMALLOC, "total %ld pages\n", (long int)newPgNum);
-	/* spinlock_release(&stealmem_lock); */
-	
 #endif
 	
 	/* Do nothing. */
 }
 
+/*
+ * Start swapping to the disk DEVNAME (eg, "lhd1"). This overwrites
+ * whatever is on it, so we refuse a disk that's mounted or that has
+ * an SFS superblock, and claim it so it can't be mounted later.
+ */
+int
+vm_swapon(const char *devname)
+{
+#if OPT_A3
+	struct vnode *v;
+	struct stat st;
+	struct sfs_super *sb;
+	struct iovec iov;
+	struct uio u;
+	struct bitmap *map;
+	unsigned *refs;
+	unsigned nslots;
+	int result;
+
+	lock_acquire(&swap_lock);
+	if (swap_vnode != NULL) {
+		lock_release(&swap_lock);
+		return EBUSY;
+	}
+
+	result = vfs_claimdev(devname, &v);
+	if (result) {
+		lock_release(&swap_lock);
+		return result;
+	}
+
+	map = NULL;
+	refs = NULL;
+	sb = kmalloc(SFS_BLOCKSIZE);
+	if (sb == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	uio_kinit(&iov, &u, sb, SFS_BLOCKSIZE,
+		  (off_t)SFS_SB_LOCATION * SFS_BLOCKSIZE, UIO_READ);
+	result = VOP_READ(v, &u);
+	if (result == 0 && sb->sp_magic == SFS_MAGIC) {
+		kprintf("swap: %s has an SFS filesystem on it\n", devname);
+		result = EEXIST;
+	}
+	kfree(sb);
+	if (result) {
+		goto fail;
+	}
+
+	result = VOP_STAT(v, &st);
+	if (result) {
+		goto fail;
+	}
+	nslots = st.st_size / PAGE_SIZE;
+	if (nslots == 0) {
+		result = ENOSPC;
+		goto fail;
+	}
+	map = bitmap_create(nslots);
+	refs = kmalloc(nslots * sizeof(unsigned));
+	if (map == NULL || refs == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+
+	swap_map = map;
+	swap_refs = refs;
+	swap_nslots = nslots;
+	swap_used = 0;
+	swap_vnode = v;
+	lock_release(&swap_lock);
+
+	kprintf("swap: %u pages on %s\n", nslots, devname);
+	return 0;
+
+ fail:
+	if (map != NULL) {
+		bitmap_destroy(map);
+	}
+	kfree(refs);
+	VOP_DECREF(v);
+	vfs_releasedev(devname);
+	lock_release(&swap_lock);
+	return result;
+#else
+	(void)devname;
+	return ENOSYS;
+#endif
+}
+
 static
 paddr_t
 getppages(unsigned long npages)
 {
+	paddr_t addr;
+
 #if OPT_A3
-	if(!coremap_exit){
-		paddr_t addr;
+	if (coremap_exit && npages == 1) {
+		return pagemag_get();
+	}
+#endif
 
-		spinlock_acquire(&stealmem_lock);
+	spinlock_acquire(&stealmem_lock);
 
+#if OPT_A3
+	if (coremap_exit) {
+		addr = buddy_alloc(npages);
+		DEBUG(DB_KMALLOC, "allocate %lu pages at 0x%x\n",
+		      npages, addr);
+	}
+	else {
 		addr = ram_stealmem(npages);
+	}
+#else
+	addr = ram_stealmem(npages);
+#endif
+	
+	spinlock_release(&stealmem_lock);
+	return addr;
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t 
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+#if OPT_A3
+	int tries;
+#endif
+	pa = getppages(npages);
+	if (pa==0) {
+		/*
+		 * Out of memory; give back cached thread stacks and
+		 * the pages in the cpus' magazines, and retry.
+		 */
+		thread_cache_reclaim();
+#if OPT_A3
+		pagemag_reclaim();
+#endif
+		pa = getppages(npages);
+#if OPT_A3
+		/*
+		 * Then page out user pages, a batch at a time, in case
+		 * they don't free a large enough block.
+		 */
+		for (tries = 0; pa == 0 &&
+		     tries < EVICT_TRIES + npages / EVICT_BATCH &&
+		     swap_evict() > 0; tries++) {
+			pa = getppages(npages);
+		}
+#endif
+		if (pa==0) {
+			return 0;
+		}
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void 
+free_kpages(vaddr_t addr)
+{
+#if OPT_A3
+	paddr_t paddr = KVADDR_TO_PADDR(addr);
+	size_t index;
+
+	if (!coremap_exit || paddr < lo) {
+		/* Stolen before the coremap existed; leak it. */
+		return;
+	}
+	index = (paddr - lo) / PAGE_SIZE;
+	KASSERT(index < newPgNum);
+
+	/* We own the allocation, so its length can't change under us. */
+	if (coremap[index].npages == 1) {
+		pagemag_put(&paddr, 1);
+		return;
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	buddy_free(paddr);
+	spinlock_release(&stealmem_lock);
+	DEBUG(DB_KMALLOC, "free pages at 0x%x\n", paddr);
+
+#else
+	/* nothing - leak the memory. */
+
+	(void)addr;
+#endif
+}
+
+#if OPT_A3
+/*
+ * Get npages single pages, all or none, taking as many as we can
+ * from the current cpu's magazine and the rest from the buddy
+ * allocator in one go.
+ */
+static
+int
+getppages_bulk(unsigned npages, paddr_t *pages)
+{
+	struct cpu *c;
+	unsigned got, tries;
+
+	KASSERT(coremap_exit);
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_pagemag_lock);
+	for (got = 0; got < npages && c->c_pagemag_count > 0; got++) {
+		pages[got] = c->c_pagemag[--c->c_pagemag_count];
+	}
+	spinlock_release(&c->c_pagemag_lock);
+
+	if (got < npages) {
+		got += buddy_take(pages + got, npages - got);
+	}
+	if (got < npages) {
+		thread_cache_reclaim();
+		pagemag_reclaim();
+		got += buddy_take(pages + got, npages - got);
+	}
+	for (tries = 0; got < npages &&
+	     tries < EVICT_TRIES + npages / EVICT_BATCH &&
+	     swap_evict() > 0; tries++) {
+		got += buddy_take(pages + got, npages - got);
+	}
+	if (got < npages) {
+		pagemag_put(pages, got);
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+freeppages_bulk(unsigned npages, const paddr_t *pages)
+{
+	pagemag_put(pages, npages);
+}
+#endif
+
+/*
+ * Allocate/free npages single kernel-space virtual pages at once.
+ * This is cheaper than calling alloc_kpages(1) npages times.
+ */
+int
+alloc_kpages_bulk(unsigned npages, vaddr_t *pages)
+{
+	unsigned i;
+
+#if OPT_A3
+	int result;
+
+	result = getppages_bulk(npages, pages);
+	if (result) {
+		return result;
+	}
+	for (i = 0; i < npages; i++) {
+		pages[i] = PADDR_TO_KVADDR(pages[i]);
+	}
+#else
+	for (i = 0; i < npages; i++) {
+		pages[i] = alloc_kpages(1);
+		if (pages[i] == 0) {
+			free_kpages_bulk(i, pages);
+			return ENOMEM;
+		}
+	}
+#endif
+	return 0;
+}
+
+void
+free_kpages_bulk(unsigned npages, const vaddr_t *pages)
+{
+#if OPT_A3
+	paddr_t buf[PAGEMAG_SIZE];
+	unsigned i, n;
+
+	/* Convert in chunks, so we needn't write on the caller's array. */
+	while (npages > 0) {
+		n = npages < PAGEMAG_SIZE ? npages : PAGEMAG_SIZE;
+		for (i = 0; i < n; i++) {
+			buf[i] = KVADDR_TO_PADDR(pages[i]);
+		}
+		freeppages_bulk(n, buf);
+		pages += n;
+		npages -= n;
+	}
+#else
+	unsigned i;
+
+	for (i = 0; i < npages; i++) {
+		free_kpages(pages[i]);
+	}
+#endif
+}
+
+/*
+ * Print free block counts by order, so fragmentation shows up as
+ * free pages that are only available in small blocks.
+ */
+void
+vm_printstats(void)
+{
+#if OPT_A3
+	unsigned counts[BUDDY_ORDERS];
+	unsigned k, freepages, largest, magpages;
+	struct cpu *c;
+
+	if (!coremap_exit) {
+		kprintf("Coremap not set up yet.\n");
+		return;
+	}
+
+	spinlock_acquire(&stealmem_lock);
+	for (k = 0; k < BUDDY_ORDERS; k++) {
+		counts[k] = nfree[k];
+	}
+	spinlock_release(&stealmem_lock);
+
+	magpages = 0;
+	for (k = 0; k < cpu_count(); k++) {
+		c = cpu_get(k);
+		spinlock_acquire(&c->c_pagemag_lock);
+		magpages += c->c_pagemag_count;
+		spinlock_release(&c->c_pagemag_lock);
+	}
+
+	kprintf("order   pages  free blocks  free pages\n");
+	freepages = largest = 0;
+	for (k = 0; k < BUDDY_ORDERS; k++) {
+		if (counts[k] == 0) {
+			continue;
+		}
+		kprintf("%5u %7u %12u %11u\n", k, 1U << k, counts[k],
+			counts[k] << k);
+		freepages += counts[k] << k;
+		largest = k;
+	}
+	kprintf("%u of %u pages free", freepages, (unsigned)newPgNum);
+	if (freepages > 0) {
+		kprintf(", largest block %u pages", 1U << largest);
+	}
+	kprintf("\n%u more free in per-cpu magazines\n", magpages);
+	kprintf("Copy-on-write: %u pages shared, %u copied, "
+		"%u kept without copying\n", cow_shared, cow_copied,
+		cow_kept);
+	if (swap_vnode != NULL) {
+		spinlock_acquire(&swap_maplock);
+		k = swap_used;
+		spinlock_release(&swap_maplock);
+		kprintf("Swap: %u of %u pages in use\n", k, swap_nslots);
+	}
+	else {
+		kprintf("No swap\n");
+	}
+	vmstats_print();
+#else
+	kprintf("dumbvm: no page allocator stats without a coremap\n");
+#endif
+}
+
+/*
+ * Report how many pages of memory there are, how many pages of swap
+ * there are (0 if there's none), and how many of those are in use.
+ */
+void
+vm_meminfo(unsigned *rampages, unsigned *swappages, unsigned *swapused)
+{
+#if OPT_A3
+	*rampages = coremap_exit ? newPgNum : 0;
+	*swappages = 0;
+	*swapused = 0;
+	if (swap_vnode != NULL) {
+		spinlock_acquire(&swap_maplock);
+		*swappages = swap_nslots;
+		*swapused = swap_used;
+		spinlock_release(&swap_maplock);
+	}
+#else
+	*rampages = 0;
+	*swappages = 0;
+	*swapused = 0;
+#endif
+}
+
+#if OPT_A3
+/*
+ * Copy-on-write. as_copy doesn't copy any pages: the child gets its
+ * own arrays of the parent's pages, and each page's coremap refcount
+ * counts the address spaces sharing it. Shared pages are mapped
+ * read-only, so the first write to one takes a VM_FAULT_READONLY and
+ * as_cowfault gives the writer its own copy, or, if everyone else
+ * has already copied it or gone away, just lets it write. Whoever
+ * drops the last reference frees the page.
+ *
+ * Refcounts are changed with atomic_add, so sharers needn't take any
+ * common lock. A page with refcount 1 is only reachable through one
+ * address space, and only that process can share it again, so a
+ * refcount of 1 can't go up behind our back.
+ */
+
+static
+struct Coremap *
+page_coremap(paddr_t paddr)
+{
+	size_t index = (paddr - lo) / PAGE_SIZE;
+
+	KASSERT(index < newPgNum);
+	return &coremap[index];
+}
+
+static
+volatile unsigned *
+page_refcount(paddr_t paddr)
+{
+	return &page_coremap(paddr)->refcount;
+}
+
+/*
+ * Record that the page at PADDR is AS's alone, mapped at VADDR
+ * through *SLOT, so swap_evict may take it; or, if AS is NULL, that
+ * it can't be taken.
+ */
+static
+void
+page_setowner(paddr_t paddr, struct addrspace *as, paddr_t *slot,
+	      vaddr_t vaddr)
+{
+	struct Coremap *cm = page_coremap(paddr);
+
+	spinlock_acquire(&stealmem_lock);
+	cm->owner = as;
+	cm->slot = slot;
+	cm->vaddr = vaddr;
+	cm->referenced = true;
+	spinlock_release(&stealmem_lock);
+}
+
+/*
+ * Drop a reference to a page; returns true if it was the last.
+ */
+static
+bool
+page_unref(paddr_t paddr)
+{
+	return atomic_add(page_refcount(paddr), (unsigned)-1) == 1;
+}
+
+/*
+ * Give the current address space its own copy of the shared page in
+ * *slot, so it can write it.
+ */
+static
+int
+as_cowfault(paddr_t *slot)
+{
+	paddr_t old = *slot;
+	vaddr_t new;
+
+	if (*page_refcount(old) == 1) {
+		/* Nobody else has it any more; it's ours. */
+		atomic_add(&cow_kept, 1);
+		return 0;
+	}
+
+	new = alloc_kpages(1);
+	if (new == 0) {
+		return ENOMEM;
+	}
+	memmove((void *)new, (const void *)PADDR_TO_KVADDR(old), PAGE_SIZE);
+	*page_refcount(KVADDR_TO_PADDR(new)) = 1;
+	*slot = KVADDR_TO_PADDR(new);
+	atomic_add(&cow_copied, 1);
+
+	if (page_unref(old)) {
+		/* Everyone else let go while we were copying. */
+		free_kpages(PADDR_TO_KVADDR(old));
+	}
+	return 0;
+}
+
+/*
+ * Share an array of pages with another address space. Pages that are
+ * shared can't be paged out; pages already out in swap stay there,
+ * and each sharer reads in its own copy.
+ */
+static
+paddr_t *
+as_sharepages(const paddr_t *pages, size_t npages)
+{
+	paddr_t *copy;
+
+	copy = kmalloc(npages * sizeof(paddr_t));
+	if (copy == NULL) {
+		return NULL;
+	}
+	for(size_t i = 0; i < npages; ++i){
+		copy[i] = pages[i];
+		if (pages[i] == 0) {
+			continue;
+		}
+		if (PTE_ISSWAPPED(pages[i])) {
+			swap_ref(PTE_SWAPSLOT(pages[i]));
+			continue;
+		}
+		page_setowner(pages[i], NULL, NULL, 0);
+		atomic_add(page_refcount(pages[i]), 1);
+		atomic_add(&cow_shared, 1);
+	}
+	return copy;
+}
+
+/*
+ * Get an array of npages zeroed pages for a region of AS starting at
+ * VBASE, or NULL if we're out of memory.
+ */
+static
+paddr_t *
+as_getpages(struct addrspace *as, vaddr_t vbase, size_t npages)
+{
+	paddr_t *pages;
+
+	pages = kmalloc(npages * sizeof(paddr_t));
+	if (pages == NULL) {
+		return NULL;
+	}
+	if (getppages_bulk(npages, pages)) {
+		kfree(pages);
+		return NULL;
+	}
+	for(size_t i = 0; i < npages; ++i){
+		bzero((void *)PADDR_TO_KVADDR(pages[i]), PAGE_SIZE);
+		*page_refcount(pages[i]) = 1;
+		page_setowner(pages[i], as, &pages[i], vbase + i * PAGE_SIZE);
+	}
+	return pages;
+}
+
+/*
+ * Drop a region's pages, freeing the ones nobody else shares.
+ */
+static
+void
+as_freepages(paddr_t *pages, size_t npages)
+{
+	size_t nlast = 0;
+
+	if (pages == NULL) {
+		return;
+	}
+	for(size_t i = 0; i < npages; ++i){
+		if (pages[i] == 0) {
+			continue;
+		}
+		if (PTE_ISSWAPPED(pages[i])) {
+			swap_unref(PTE_SWAPSLOT(pages[i]));
+		}
+		else if (page_unref(pages[i])) {
+			pages[nlast++] = pages[i];
+		}
+	}
+	spinlock_acquire(&stealmem_lock);
+	for(size_t i = 0; i < nlast; ++i){
+		page_coremap(pages[i])->owner = NULL;
+	}
+	spinlock_release(&stealmem_lock);
+	freeppages_bulk(nlast, pages);
+	kfree(pages);
+}
+
+/*
+ * Demand paging. load_elf doesn't load the text and data regions;
+ * as_prepare_load just gives them arrays of 0 (no page yet), and
+ * as_define_file records where each one's contents are in the
+ * executable, keeping a reference to its vnode. The first fault on
+ * a page of either region comes here, to read the page's share of
+ * the file into a new page, zeroing whatever the file doesn't cover.
+ */
+
+/*
+ * Get an array of npages empty slots for a region that will be paged
+ * in on demand, or NULL if we're out of memory.
+ */
+static
+paddr_t *
+as_newregion(size_t npages)
+{
+	paddr_t *pages;
+
+	pages = kmalloc(npages * sizeof(paddr_t));
+	if (pages == NULL) {
+		return NULL;
+	}
+	for(size_t i = 0; i < npages; ++i){
+		pages[i] = 0;
+	}
+	return pages;
+}
+
+/*
+ * Fill *slot with the page at VADDR in region REGION (1 or 2).
+ */
+static
+int
+as_pagein(struct addrspace *as, int region, vaddr_t vaddr, paddr_t *slot)
+{
+	struct iovec iov;
+	struct uio u;
+	vaddr_t segvaddr, start, end, page;
+	off_t offset;
+	size_t filesz;
+	int result;
+
+	if (region == 1) {
+		segvaddr = as->as_segvaddr1;
+		offset = as->as_offset1;
+		filesz = as->as_filesz1;
+	}
+	else {
+		segvaddr = as->as_segvaddr2;
+		offset = as->as_offset2;
+		filesz = as->as_filesz2;
+	}
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return ENOMEM;
+	}
+	bzero((void *)page, PAGE_SIZE);
+
+	/* The part of this page that comes from the file, if any */
+	start = vaddr > segvaddr ? vaddr : segvaddr;
+	end = segvaddr + filesz;
+	if (end > vaddr + PAGE_SIZE) {
+		end = vaddr + PAGE_SIZE;
+	}
+
+	if (as->as_vnode != NULL && start < end) {
+		uio_kinit(&iov, &u, (void *)(page + (start - vaddr)),
+			  end - start, offset + (start - segvaddr), UIO_READ);
+		result = VOP_READ(as->as_vnode, &u);
+		if (result == 0 && u.uio_resid != 0) {
+			kprintf("ELF: short read on segment - "
+				"file truncated?\n");
+			result = ENOEXEC;
+		}
+		if (result) {
+			free_kpages(page);
+			return result;
+		}
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		vmstats_inc(VMSTAT_ELF_FILE_READ);
+	}
+	else {
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+	}
+
+	*page_refcount(KVADDR_TO_PADDR(page)) = 1;
+	*slot = KVADDR_TO_PADDR(page);
+	return 0;
+}
+
+/*
+ * Read the page *slot refers to back in from swap.
+ */
+static
+int
+as_swapin(paddr_t *slot)
+{
+	unsigned swapslot = PTE_SWAPSLOT(*slot);
+	vaddr_t page;
+	int result;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return ENOMEM;
+	}
+	result = swap_io(KVADDR_TO_PADDR(page), swapslot, UIO_READ);
+	if (result) {
+		free_kpages(page);
+		return result;
+	}
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	vmstats_inc(VMSTAT_SWAP_FILE_READ);
+	swap_unref(swapslot);
+
+	*page_refcount(KVADDR_TO_PADDR(page)) = 1;
+	*slot = KVADDR_TO_PADDR(page);
+	return 0;
+}
+
+/*
+ * Knock VADDR out of this cpu's TLB. Call at splhigh.
+ */
+static
+void
+tlb_unmap(vaddr_t vaddr)
+{
+	int i;
+
+	i = tlb_probe(vaddr, 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+}
+
+/*
+ * Make sure no cpu has a TLB entry for any of the NTS mappings in TS,
+ * and wait until they've all done it. TLB entries don't say which
+ * address space they belong to, so the other cpus just drop whatever
+ * they have at each address; at worst that costs someone a TLB
+ * reload.
+ */
+static
+void
+vm_shootdown(struct tlbshootdown *ts, unsigned nts)
+{
+	struct semaphore done;
+	struct cpu *c;
+	unsigned i, j, n;
+	int spl;
+
+	KASSERT(nts <= TLBSHOOTDOWN_MAX);
+	sem_init(&done, "shootdown", 0);
+
+	n = 0;
+	spl = splhigh();
+	for (j = 0; j < nts; j++) {
+		ts[j].ts_done = &done;
+		tlb_unmap(ts[j].ts_vaddr);
+	}
+	for (i = 0; i < cpu_count(); i++) {
+		c = cpu_get(i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		for (j = 0; j < nts; j++) {
+			ipi_tlbshootdown(c, &ts[j]);
+			n++;
+		}
+	}
+	splx(spl);
+
+	while (n-- > 0) {
+		P(&done);
+	}
+	sem_cleanup(&done);
+}
+
+/*
+ * Page replacement, by the clock algorithm. The hand sweeps the
+ * coremap, passing over pages we can't take: kernel pages, free
+ * pages, and pages shared copy-on-write, which would have to be
+ * taken from all their sharers at once. vm_fault marks a page
+ * referenced each time it loads it into the TLB; the hand clears
+ * the mark and moves on, so a page is only taken if it hasn't been
+ * used since the hand last went by.
+ *
+ * The hand takes up to EVICT_BATCH pages per call, so the TLB
+ * shootdowns and the free are paid for once per batch. It holds
+ * stealmem_lock, with interrupts off, for at most CLOCK_SCAN entries
+ * at a time, and gives up after going round twice.
+ *
+ * Taking a page needs its owner's as_lock, so the owner can't fault
+ * on it meanwhile. We may already hold our own, so we only try to
+ * get anyone else's and skip their pages if they're busy. Evictions
+ * are serialized by swap_lock; as a result each cpu has at most one
+ * batch of TLB shootdowns queued at a time, so the queues never
+ * overflow.
+ *
+ * Text is never written, so instead of going to swap it's just
+ * dropped, and read from the executable again if it's needed.
+ *
+ * Returns the number of pages freed; 0 if there's nothing we can
+ * page out.
+ */
+
+struct swapvictim {
+	struct addrspace *as;
+	paddr_t paddr;
+	paddr_t *slot;		/* as's page table entry for it */
+	bool locked;		/* we took as_lock for it */
+	bool evicted;		/* it's out; free the page */
+};
+
+static
+unsigned
+swap_evict(void)
+{
+	struct swapvictim victims[EVICT_BATCH], *sv;
+	struct tlbshootdown ts[EVICT_BATCH];
+	struct Coremap *cm;
+	struct addrspace *as;
+	vaddr_t vaddr;
+	paddr_t pte;
+	unsigned swapslot, nv, nfreed, i;
+	size_t n, scanned;
+	int result;
+
+	COMPILE_ASSERT(EVICT_BATCH <= TLBSHOOTDOWN_MAX);
+
+	/* We have to sleep, and swap I/O mustn't end up back here. */
+	if (swap_vnode == NULL || curthread->t_in_interrupt ||
+	    curthread->t_curspl > 0 || lock_do_i_hold(&swap_lock)) {
+		return 0;
+	}
+	lock_acquire(&swap_lock);
 
-		spinlock_release(&stealmem_lock);
-		return addr;
-	} else {
-		DEBUG(DB_KMALLOC, "allocate %ld pages\n", npages);
+	nv = 0;
+	scanned = 0;
+	while (nv < EVICT_BATCH && scanned < 2 * newPgNum) {
 		spinlock_acquire(&stealmem_lock);
-		unsigned long count = 0;
-		size_t index = 0;
-		for(size_t i = 0; i < newPgNum; i++){
-			if (coremap[i].inuse == false){
-				if(count == 0){
-					index = i;
-				}
-				count++;
-				if (count == npages){
-					break;
-				}
-
-			} else {
-				count = 0;
+		for (n = 0; n < CLOCK_SCAN && nv < EVICT_BATCH &&
+		     scanned < 2 * newPgNum; n++, scanned++) {
+			cm = &coremap[clock_hand];
+			sv = &victims[nv];
+			sv->paddr = lo + clock_hand * PAGE_SIZE;
+			clock_hand = (clock_hand + 1) % newPgNum;
+			if (cm->owner == NULL || cm->refcount != 1) {
+				continue;
 			}
-		}
-		if( index + npages > newPgNum) {
-			spinlock_release(&stealmem_lock);
-			return 0;
-		}
-		for(size_t i = index; i < index + npages; ++i){
-			coremap[i].inuse = true;
-			coremap[i].contiguous = true;
-			if( i == index + npages - 1){
-				coremap[i].contiguous = false;
+			if (cm->referenced) {
+				cm->referenced = false;
+				continue;
+			}
+			as = cm->owner;
+			sv->locked = !lock_do_i_hold(&as->as_lock);
+			if (sv->locked &&
+			    lock_acquire_timed(&as->as_lock, 0) != 0) {
+				continue;
 			}
+			sv->as = as;
+			sv->slot = cm->slot;
+			sv->evicted = false;
+			ts[nv].ts_addrspace = as;
+			ts[nv].ts_vaddr = cm->vaddr;
+			cm->owner = NULL;
+			nv++;
 		}
-		  
-		DEBUG(DB_KMALLOC, "  alloc index is %d ........\n", index);
 		spinlock_release(&stealmem_lock);
-		KASSERT((lo & PAGE_FRAME) == lo);
-		return lo + index * PAGE_SIZE;
-
 	}
 
+	if (nv == 0) {
+		lock_release(&swap_lock);
+		return 0;
+	}
 
-#else
-	paddr_t addr;
-
-	spinlock_acquire(&stealmem_lock);
+	/* Nobody may write the pages while we save them. */
+	vm_shootdown(ts, nv);
 
-	addr = ram_stealmem(npages);
-	
-	spinlock_release(&stealmem_lock);
-	return addr;
-#endif
-}
+	nfreed = 0;
+	for (i = 0; i < nv; i++) {
+		sv = &victims[i];
+		as = sv->as;
+		vaddr = ts[i].ts_vaddr;
+		KASSERT(*sv->slot == sv->paddr);
 
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t 
-alloc_kpages(int npages)
-{
-	paddr_t pa;
-	pa = getppages(npages);
-	if (pa==0) {
-		return 0;
+		if (as->as_vnode != NULL && as->as_loaded &&
+		    vaddr >= as->as_vbase1 &&
+		    vaddr < as->as_vbase1 + as->as_npages1 * PAGE_SIZE) {
+			pte = 0;
+		}
+		else {
+			result = swap_alloc(&swapslot);
+			if (result == 0) {
+				result = swap_io(sv->paddr, swapslot,
+						 UIO_WRITE);
+				if (result) {
+					swap_unref(swapslot);
+				}
+			}
+			if (result) {
+				/* Swap is full, or broken; put it back. */
+				page_setowner(sv->paddr, as, sv->slot, vaddr);
+				continue;
+			}
+			vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+			pte = PTE_MKSWAP(swapslot);
+		}
+		*sv->slot = pte;
+		sv->evicted = true;
+		nfreed++;
 	}
-	return PADDR_TO_KVADDR(pa);
-}
 
-void 
-free_kpages(vaddr_t addr)
-{
-#if OPT_A3
-	if(coremap == NULL){
-		return;
+	for (i = 0; i < nv; i++) {
+		if (victims[i].locked) {
+			lock_release(&victims[i].as->as_lock);
+		}
 	}
+
 	spinlock_acquire(&stealmem_lock);
-	paddr_t kvaddr =  KVADDR_TO_PADDR(addr);
-	int index = (kvaddr - lo) / PAGE_SIZE;
-	DEBUG(DB_KMALLOC, "free is %d pages\n", index);
-	for (size_t i = index; i < newPgNum; ++i){
-		coremap[i].inuse = false;
-		if (!coremap[i].contiguous){
-		DEBUG(DB_KMALLOC, "  free index is %d .......\n", i-index+1);
-			break;
-		}	
-		coremap[i].contiguous = false;
+	for (i = 0; i < nv; i++) {
+		if (victims[i].evicted) {
+			*page_refcount(victims[i].paddr) = 0;
+			buddy_free(victims[i].paddr);
+		}
 	}
 	spinlock_release(&stealmem_lock);
 
-#else
-	/* nothing - leak the memory. */
-
-	(void)addr;
-#endif
+	lock_release(&swap_lock);
+	return nfreed;
 }
+#endif
 
 void
 vm_tlbshootdown_all(void)
 {
+#if OPT_A3
+	int i, spl;
+
+	/* Only swap_evict sends shootdowns, and never this many. */
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
+#else
 	panic("dumbvm tried to do tlb shootdown?!\n");
+#endif
 }
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
+#if OPT_A3
+	int spl;
+
+	spl = splhigh();
+	tlb_unmap(ts->ts_vaddr);
+	splx(spl);
+	V(ts->ts_done);
+#else
 	(void)ts;
 	panic("dumbvm tried to do tlb shootdown?!\n");
+#endif
+}
+
+#if OPT_A3
+/*
+ * Handle a fault on FAULTADDRESS in AS. We hold AS's lock, so
+ * swap_evict can't take the page away while we're loading it.
+ */
+static
+int
+as_fault(struct addrspace *as, int faulttype, vaddr_t faultaddress)
+{
+	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
+	paddr_t paddr, *slot;
+	struct Coremap *cm;
+	uint32_t ehi, elo;
+	bool readonly;
+	int i, region, result, spl;
+
+	KASSERT(lock_do_i_hold(&as->as_lock));
+
+	vbase1 = as->as_vbase1;
+	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
+	vbase2 = as->as_vbase2;
+	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
+	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
+	stacktop = USERSTACK;
+
+	if (faultaddress >= vbase1 && faultaddress < vtop1) {
+		size_t i = (faultaddress - vbase1)/ PAGE_SIZE;
+		slot = &as->as_pbase1[i];
+		region = 1;
+	}
+	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
+		size_t i = (faultaddress - vbase2)/ PAGE_SIZE;
+		slot = &as->as_pbase2[i];
+		region = 2;
+	}
+	else if (faultaddress >= stackbase && faultaddress < stacktop) {
+		size_t i = (faultaddress - stackbase)/ PAGE_SIZE;
+		slot = &as->as_stackpbase[i];
+		region = 0;
+	}
+	else {
+		return EFAULT;
+	}
+
+	/* Text is read-only once it's loaded. */
+	readonly = as->as_loaded && region == 1;
+	if (faulttype == VM_FAULT_READONLY && readonly) {
+		return EFAULT;
+	}
+
+	if (faulttype != VM_FAULT_READONLY) {
+		vmstats_inc(VMSTAT_TLB_FAULT);
+	}
+	/*
+	 * The page may have been paged out since the fault, even if
+	 * it was a write to a read-only page.
+	 */
+	if (*slot == 0) {
+		/* First touch; the stack is never paged in */
+		KASSERT(region != 0);
+		result = as_pagein(as, region, faultaddress, slot);
+	}
+	else if (PTE_ISSWAPPED(*slot)) {
+		result = as_swapin(slot);
+	}
+	else if (faulttype == VM_FAULT_READONLY) {
+		result = as_cowfault(slot);
+	}
+	else {
+		vmstats_inc(VMSTAT_TLB_RELOAD);
+		result = 0;
+	}
+	if (result) {
+		return result;
+	}
+	paddr = *slot;
+
+	/* make sure it's page-aligned */
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	cm = page_coremap(paddr);
+	if (cm->refcount > 1) {
+		/* Shared pages stay read-only until someone writes them. */
+		readonly = true;
+	}
+	else if (cm->owner != as) {
+		/* It's ours alone now, so it can be paged out. */
+		page_setowner(paddr, as, slot, faultaddress);
+	}
+	/* Give it a second chance in swap_evict's clock. */
+	cm->referenced = true;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	/* After a copy-on-write fault, replace the read-only entry. */
+	i = tlb_probe(faultaddress, 0);
+	if (i >= 0) {
+		elo = paddr | TLBLO_VALID;
+		if (!readonly) {
+			elo |= TLBLO_DIRTY;
+		}
+		tlb_write(faultaddress, elo, i);
+		splx(spl);
+		return 0;
+	}
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&ehi, &elo, i);
+		if (elo & TLBLO_VALID) {
+			continue;
+		}
+		ehi = faultaddress;
+		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+		if (readonly) {
+			elo &= ~TLBLO_DIRTY;
+		}
+		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+		vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+		tlb_write(ehi, elo, i);
+		splx(spl);
+		return 0;
+	}
+	ehi = faultaddress;
+	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+	if (readonly) {
+		elo &= ~TLBLO_DIRTY;
+	}
+	vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+	tlb_random(ehi, elo);
+	splx(spl);
+	return 0;
 }
+#endif
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
+#if OPT_A3
+	struct addrspace *as;
+	int result;
+#else
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
 	paddr_t paddr;
 	int i;
 	uint32_t ehi, elo;
 	struct addrspace *as;
 	int spl;
+#endif
 
 	faultaddress &= PAGE_FRAME;
 
@@ -226,10 +1597,11 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
 #if OPT_A3
-		return EFAULT;
+		/* Loaded text, or a page shared copy-on-write */
+		break;
 #else
+		/* We always create pages read-write, so we can't get this */
 		panic("dumbvm: got VM_FAULT_READONLY\n");
 #endif
 	    case VM_FAULT_READ:
@@ -268,38 +1640,17 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
 #if OPT_A3
 	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
+
+	lock_acquire(&as->as_lock);
+	result = as_fault(as, faulttype, faultaddress);
+	lock_release(&as->as_lock);
+	return result;
 #else 
 	KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
 	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
 	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
 	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
-#endif
-
-#if OPT_A3
-	vbase1 = as->as_vbase1;
-	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
-	vbase2 = as->as_vbase2;
-	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
-	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
-	stacktop = USERSTACK;
-
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		size_t i = (faultaddress - vbase1)/ PAGE_SIZE;
-		paddr = as->as_pbase1[i];
-	}
-	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		size_t i = (faultaddress - vbase2)/ PAGE_SIZE;
-		paddr = as->as_pbase2[i];
-	}
-	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-		size_t i = (faultaddress - stackbase)/ PAGE_SIZE;
-		paddr = as->as_stackpbase[i];
-	}
-	else {
-		return EFAULT;
-	}
 
-#else
 	vbase1 = as->as_vbase1;
 	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
 	vbase2 = as->as_vbase2;
@@ -319,7 +1670,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	else {
 		return EFAULT;
 	}
-#endif
 
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
@@ -335,30 +1685,13 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		ehi = faultaddress;
 		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
 		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-
-#if OPT_A3
-		if(as->as_loaded && faultaddress >= vbase1 && faultaddress < vtop1) {
-			elo &= ~TLBLO_DIRTY;	
-		}
-#endif
 		tlb_write(ehi, elo, i);
 		splx(spl);
 		return 0;
 	}
-#if OPT_A3
-	ehi = faultaddress;
-	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-	if(as->as_loaded && faultaddress >= vbase1 && faultaddress < vtop1) {
-		elo &= ~TLBLO_DIRTY;	
-	}
-	tlb_random(ehi, elo);
-#else
+
 	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
-#endif
 	splx(spl);
-#if OPT_A3
-	return 0;
-#else
 	return EFAULT;
 #endif
 }
@@ -391,7 +1724,12 @@ as_create(void)
 	as->as_stackpbase = 0;
 #endif
 #if OPT_A3
+	lock_init(&as->as_lock, "addrspace");
 	as->as_loaded = false;
+	as->as_vnode = NULL;
+	as->as_segvaddr1 = as->as_segvaddr2 = 0;
+	as->as_offset1 = as->as_offset2 = 0;
+	as->as_filesz1 = as->as_filesz2 = 0;
 #endif
 
 	return as;
@@ -401,21 +1739,16 @@ void
 as_destroy(struct addrspace *as)
 {
 #if OPT_A3
-	for(size_t i = 0; i < as->as_npages1; ++i){
-		free_kpages(PADDR_TO_KVADDR(as->as_pbase1[i]));
-	}
-
-	for(size_t i = 0; i < as->as_npages2; ++i){
-		free_kpages(PADDR_TO_KVADDR(as->as_pbase2[i]));
-	}
-
-	for(size_t i = 0; i < DUMBVM_STACKPAGES; ++i){
-		free_kpages(PADDR_TO_KVADDR(as->as_stackpbase[i]));
+	/* Wait for swap_evict, if it's taking one of our pages. */
+	lock_acquire(&as->as_lock);
+	as_freepages(as->as_pbase1, as->as_npages1);
+	as_freepages(as->as_pbase2, as->as_npages2);
+	as_freepages(as->as_stackpbase, DUMBVM_STACKPAGES);
+	lock_release(&as->as_lock);
+	lock_cleanup(&as->as_lock);
+	if (as->as_vnode != NULL) {
+		VOP_DECREF(as->as_vnode);
 	}
-	
-	kfree(as->as_stackpbase);
-	kfree(as->as_pbase2);
-	kfree(as->as_pbase1);
 #else
 	free_kpages(PADDR_TO_KVADDR(as->as_stackpbase));
 	free_kpages(PADDR_TO_KVADDR(as->as_pbase2));
@@ -444,6 +1777,9 @@ as_activate(void)
 	for (i=0; i<NUM_TLB; i++) {
 		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
 	}
+#if OPT_A3
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+#endif
 
 	splx(spl);
 }
@@ -509,41 +1845,22 @@ as_prepare_load(struct addrspace *as)
 	KASSERT(as->as_pbase2 == 0);
 	KASSERT(as->as_stackpbase == 0);
 #if OPT_A3
-	as->as_pbase1 = kmalloc(as->as_npages1 * sizeof(int));
+	/* Text and data are paged in on demand; see as_pagein. */
+	as->as_pbase1 = as_newregion(as->as_npages1);
 	if(as->as_pbase1 == NULL){
 		return ENOMEM;
 	}
-	for(size_t i = 0; i < as->as_npages1; ++i){
-		as->as_pbase1[i] = getppages(1);
-		if (as->as_pbase1[i] == 0) {
-			return ENOMEM;
-		}
-		bzero((void *)PADDR_TO_KVADDR(as->as_pbase1[i]), PAGE_SIZE);
-	}
-	as->as_pbase2 = kmalloc(as->as_npages2 * sizeof(int));
+	as->as_pbase2 = as_newregion(as->as_npages2);
 	if(as->as_pbase2 == NULL){
 		return ENOMEM;
 	}
-	for(size_t i = 0; i < as->as_npages2; ++i){
-		as->as_pbase2[i] = getppages(1);
-		if (as->as_pbase2[i] == 0) {
-			return ENOMEM;
-		}
-		bzero((void *)PADDR_TO_KVADDR(as->as_pbase2[i]), PAGE_SIZE);
-	}
-	as->as_stackpbase = kmalloc(DUMBVM_STACKPAGES * sizeof(int));
+	lock_acquire(&as->as_lock);
+	as->as_stackpbase = as_getpages(as,
+		USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE, DUMBVM_STACKPAGES);
+	lock_release(&as->as_lock);
 	if(as->as_stackpbase == NULL){
 		return ENOMEM;
 	}
-	for(size_t i = 0; i < DUMBVM_STACKPAGES; ++i){
-		as->as_stackpbase[i] = getppages(1);
-		if (as->as_stackpbase[i] == 0) {
-			return ENOMEM;
-		}
-		bzero((void *)PADDR_TO_KVADDR(as->as_stackpbase[i]), PAGE_SIZE);
-	}
-
-
 #else
 	as->as_pbase1 = getppages(as->as_npages1);
 	if (as->as_pbase1 == 0) {
@@ -568,6 +1885,41 @@ as_prepare_load(struct addrspace *as)
 	return 0;
 }
 
+#if OPT_A3
+int
+as_define_file(struct addrspace *as, struct vnode *v, off_t offset,
+	       vaddr_t vaddr, size_t filesize)
+{
+	vaddr_t vbase1, vtop1, vbase2, vtop2;
+
+	vbase1 = as->as_vbase1;
+	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
+	vbase2 = as->as_vbase2;
+	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
+
+	if (vaddr >= vbase1 && vaddr + filesize <= vtop1) {
+		as->as_segvaddr1 = vaddr;
+		as->as_offset1 = offset;
+		as->as_filesz1 = filesize;
+	}
+	else if (vaddr >= vbase2 && vaddr + filesize <= vtop2) {
+		as->as_segvaddr2 = vaddr;
+		as->as_offset2 = offset;
+		as->as_filesz2 = filesize;
+	}
+	else {
+		return ENOEXEC;
+	}
+
+	if (as->as_vnode == NULL) {
+		VOP_INCREF(v);
+		as->as_vnode = v;
+	}
+	KASSERT(as->as_vnode == v);
+	return 0;
+}
+#endif
+
 int
 as_complete_load(struct addrspace *as)
 {
@@ -602,42 +1954,50 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	new->as_vbase2 = old->as_vbase2;
 	new->as_npages2 = old->as_npages2;
 
+#if OPT_A3
+	/* Share the pages; see as_cowfault. */
+	new->as_loaded = old->as_loaded;
+	new->as_segvaddr1 = old->as_segvaddr1;
+	new->as_offset1 = old->as_offset1;
+	new->as_filesz1 = old->as_filesz1;
+	new->as_segvaddr2 = old->as_segvaddr2;
+	new->as_offset2 = old->as_offset2;
+	new->as_filesz2 = old->as_filesz2;
+	if (old->as_vnode != NULL) {
+		VOP_INCREF(old->as_vnode);
+		new->as_vnode = old->as_vnode;
+	}
+	lock_acquire(&old->as_lock);
+	new->as_pbase1 = as_sharepages(old->as_pbase1, old->as_npages1);
+	new->as_pbase2 = as_sharepages(old->as_pbase2, old->as_npages2);
+	new->as_stackpbase = as_sharepages(old->as_stackpbase,
+					   DUMBVM_STACKPAGES);
+
+	/*
+	 * The TLB may still let us write pages that are now shared;
+	 * flush it so we fault on them instead.
+	 */
+	if (old == curproc_getas()) {
+		as_activate();
+	}
+	lock_release(&old->as_lock);
+
+	if (new->as_pbase1 == NULL || new->as_pbase2 == NULL ||
+	    new->as_stackpbase == NULL) {
+		as_destroy(new);
+		return ENOMEM;
+	}
+#else
 	/* (Mis)use as_prepare_load to allocate some physical memory. */
 	if (as_prepare_load(new)) {
 		as_destroy(new);
 		return ENOMEM;
 	}
-#if OPT_A3
-	KASSERT(new->as_pbase1 != NULL);
-	KASSERT(new->as_pbase2 != NULL);
-	KASSERT(new->as_stackpbase != NULL);
-#else
 
 	KASSERT(new->as_pbase1 != 0);
 	KASSERT(new->as_pbase2 != 0);
 	KASSERT(new->as_stackpbase != 0);
-#endif
 
-#if OPT_A3
-	for(size_t i = 0; i < new->as_npages1; ++i){
-		memmove((void *)PADDR_TO_KVADDR(new->as_pbase1[i]),
-				(const void *)PADDR_TO_KVADDR(old->as_pbase1[i]),
-				PAGE_SIZE);
-	}
-
-	for(size_t i = 0; i < new->as_npages2; ++i){
-		memmove((void *)PADDR_TO_KVADDR(new->as_pbase2[i]),
-				(const void *)PADDR_TO_KVADDR(old->as_pbase2[i]),
-				PAGE_SIZE);
-	}
-
-	for(size_t i = 0; i < DUMBVM_STACKPAGES; ++i){
-		memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase[i]),
-				(const void *)PADDR_TO_KVADDR(old->as_stackpbase[i]),
-				PAGE_SIZE);
-	}
-
-#else
 	memmove((void *)PADDR_TO_KVADDR(new->as_pbase1),
 		(const void *)PADDR_TO_KVADDR(old->as_pbase1),
 		old->as_npages1*PAGE_SIZE);
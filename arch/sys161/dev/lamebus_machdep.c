@@ -73,6 +73,23 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Set the on-chip timer for tickless operation. The period is capped
+ * at what fits in c0_compare, which is a bit under three minutes.
+ */
+void
+mainbus_hardclock_set(unsigned nticks)
+{
+	const uint32_t period = CPU_FREQUENCY / HZ;
+
+	if (nticks == 0 || nticks > 0xffffffff / period) {
+		mips_timer_set(0xffffffff);
+	}
+	else {
+		mips_timer_set(nticks * period);
+	}
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
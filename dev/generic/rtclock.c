@@ -68,3 +68,16 @@ gettime(time_t *secs, uint32_t *nsecs)
 	KASSERT(the_clock!=NULL);
 	the_clock->rtc_gettime(the_clock->rtc_devdata, secs, nsecs);
 }
+
+uint64_t
+gettime_ns(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	if (the_clock == NULL) {
+		return 0;
+	}
+	the_clock->rtc_gettime(the_clock->rtc_devdata, &secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
@@ -48,6 +48,28 @@
 
 static bool havetimerclock;
 
+/*
+ * Start or stop the countdown timer used for timerclock. Called by
+ * the clock code, which only needs it while callouts are pending.
+ * Clearing restart-on-expiry lets the current countdown run out once
+ * more; writing the count restarts the countdown from the top.
+ */
+static
+void
+ltimer_setrunning(void *vlt, bool running)
+{
+	struct ltimer_softc *lt = vlt;
+
+	if (running) {
+		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_ROE, 1);
+		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_COUNT,
+				   LT_GRANULARITY);
+	}
+	else {
+		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_ROE, 0);
+	}
+}
+
 /*
  * Setup routine called by autoconf stuff when an ltimer is found.
  */
@@ -88,11 +110,12 @@ config_ltimer(struct ltimer_softc *lt, int ltimerno)
 		havetimerclock = true;
 		lt->lt_timerclock = 1;
 
-		/* Wire it to go off once every 10 ms */
+		/*
+		 * Wire it to go off once every 10 ms, but only while
+		 * the clock code has callouts pending.
+		 */
 		/* KMS: reduced this from 1s to 10ms */
-		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_ROE, 1);
-		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_COUNT,
-				   LT_GRANULARITY);
+		timerclock_attach(ltimer_setrunning, lt);
 	}
 	
 	return 0;
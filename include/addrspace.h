@@ -37,6 +37,9 @@
 
 #include <vm.h>
 #include "opt-A3.h"
+#if OPT_A3
+#include <synch.h>
+#endif
 
 struct vnode;
 
@@ -51,24 +54,43 @@ struct vnode;
 struct addrspace {
   vaddr_t as_vbase1;
 #if OPT_A3
-  int* as_pbase1;
+  paddr_t *as_pbase1;
 #else
   paddr_t as_pbase1;
 #endif
   size_t as_npages1;
   vaddr_t as_vbase2;
 #if OPT_A3
-  int* as_pbase2;
+  paddr_t *as_pbase2;
 #else
   paddr_t as_pbase2;
 #endif
   size_t as_npages2;
 #if OPT_A3
-  int* as_stackpbase;
+  paddr_t *as_stackpbase;
 #else
   paddr_t as_stackpbase;
 #endif
   bool as_loaded;
+#if OPT_A3
+  /*
+   * Where the two regions' contents come from in the executable.
+   * Their pages are read in or zeroed when first touched; until
+   * then their entries in as_pbase1/2 are 0.
+   */
+  struct vnode *as_vnode;
+  vaddr_t as_segvaddr1;		/* Start of the segment in the region */
+  off_t as_offset1;		/* Its offset in the file */
+  size_t as_filesz1;		/* How much of it is in the file */
+  vaddr_t as_segvaddr2;
+  off_t as_offset2;
+  size_t as_filesz2;
+  /*
+   * Held while faulting, or changing the page arrays, so the pages
+   * can't be paged out from under us.
+   */
+  struct lock as_lock;
+#endif
 };
 
 /*
@@ -102,6 +124,12 @@ struct addrspace {
  *    as_complete_load - this is called when loading from an executable
  *                is complete.
  *
+ *    as_define_file - say where in an executable the contents of the
+ *                region at VADDR come from, so that its pages can be
+ *                read in when they are first touched instead of at
+ *                load time. Called between as_prepare_load and
+ *                as_complete_load, in place of loading the segment.
+ *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
@@ -120,6 +148,11 @@ int               as_define_region(struct addrspace *as,
                                    int executable);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
+#if OPT_A3
+int               as_define_file(struct addrspace *as, struct vnode *v,
+                                 off_t offset, vaddr_t vaddr,
+                                 size_t filesize);
+#endif
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
 
@@ -35,11 +35,12 @@
 /*
  * Time-related definitions.
  *
- * hardclock() is called on every CPU HZ times a second, possibly only
- * when the CPU is not idle, for scheduling.
+ * hardclock() is called on every CPU HZ times a second, for
+ * scheduling, except while the CPU is idle or has nothing to switch
+ * to (see "tickless operation" below).
  *
- * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * timerclock() is called on one CPU once every LT_GRANULARITY usec
+ * (a "timer tick") and runs any callouts that have come due.
  *
  * gettime() may be used to fetch the current time of day.
  * getinterval() computes the time from time1 to time2.
@@ -61,17 +62,91 @@ void hardclock_bootstrap(void);
 void hardclock(void);
 void timerclock(void);
 
+/*
+ * Tickless operation. A cpu that is idle, or that has only one
+ * runnable thread, doesn't need a hardclock every period. These are
+ * called by the scheduler with the current cpu's runqueue lock held:
+ *
+ *    hardclock_stop   - stop the hardclock (before idling).
+ *    hardclock_defer  - take the next hardclock NTICKS periods from
+ *                       now; the missed periods are accounted for
+ *                       when it arrives.
+ *    hardclock_resume - go back to one hardclock per period.
+ *
+ * Anyone adding a thread to a cpu whose c_tickperiod isn't 1 must
+ * make sure it resumes, by sending it IPI_UNIDLE.
+ */
+void hardclock_stop(void);
+void hardclock_defer(unsigned nticks);
+void hardclock_resume(void);
+
+/*
+ * Called by the driver of the device that calls timerclock(), to
+ * supply a function that starts (RUNNING true) and stops its periodic
+ * interrupt. The device is only kept running while callouts are
+ * pending.
+ */
+void timerclock_attach(void (*setrunning)(void *data, bool running),
+		       void *data);
+
 void gettime(time_t *seconds, uint32_t *nanoseconds);
 
+/*
+ * gettime_ns() returns the time of day in nanoseconds, or 0 if there
+ * is no clock yet. It's for accounting, which begins before the
+ * clock device is attached.
+ */
+uint64_t gettime_ns(void);
+
 void getinterval(time_t secs1, uint32_t nsecs,
                  time_t secs2, uint32_t nsecs2,
                  time_t *rsecs, uint32_t *rnsecs);
 
+/*
+ * Callouts.
+ *
+ * A callout arranges for a function to be called once, from
+ * timerclock(), a given number of timer ticks in the future. It runs
+ * in interrupt context and so must not sleep.
+ *
+ * The caller provides the storage for struct callout and must keep it
+ * valid until the callout has either fired or been cancelled. The
+ * callout structure itself is not touched again after its function
+ * has been called, so the function may free or reuse it.
+ *
+ *    callout_init     - set up CO to call FUNC(ARG).
+ *    callout_schedule - arrange for CO to fire TICKS (> 0) ticks from
+ *                       now. If already pending, it is rescheduled.
+ *    callout_cancel   - prevent CO from firing. Returns true if it was
+ *                       pending; false means it has already fired (or
+ *                       is firing right now) or was never scheduled.
+ *    callout_pending  - returns true if CO is scheduled and has not
+ *                       yet fired. (For diagnostics and assertions.)
+ *
+ * Pending callouts are kept on a hashed timer wheel, so the cost per
+ * tick is proportional to the number of callouts in one bucket, not
+ * to the total number outstanding.
+ */
+struct callout {
+	struct callout *co_next;	/* Wheel bucket links */
+	struct callout *co_prev;
+	uint32_t co_expires;		/* Absolute tick of expiry */
+	bool co_pending;		/* On the wheel? */
+	void (*co_func)(void *);	/* Function to call */
+	void *co_arg;			/* Argument to pass */
+};
+
+void callout_init(struct callout *co, void (*func)(void *), void *arg);
+void callout_schedule(struct callout *co, unsigned ticks);
+bool callout_cancel(struct callout *co);
+bool callout_pending(struct callout *co);
+
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
  *
- *  this will be more efficient than clocknap() for longer sleeps
+ * Both this and clocknap() sleep on a per-thread callout, so only
+ * the thread whose deadline has passed is awakened.
  */
 void clocksleep(int seconds);
 
@@ -83,5 +158,11 @@ void clocksleep(int seconds);
  */
 void clocknap(int ticks);
 
+/*
+ * clock_nstoticks() converts a timeout in nanoseconds to timer ticks,
+ * rounding up, for the timed waits in synch.h.
+ */
+unsigned clock_nstoticks(uint64_t ns);
+
 
 #endif /* _CLOCK_H_ */
@@ -36,6 +36,48 @@
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
+/*
+ * Number of levels in each cpu's multi-level feedback run queue.
+ * Level 0 is the highest priority; see schedule() in thread.c.
+ */
+#define SCHED_NLEVELS	4
+
+/*
+ * Where a thread being woken up was placed (see thread.c).
+ */
+#define WAKEUP_PREV	0	/* Its previous cpu (cache affinity) */
+#define WAKEUP_IDLE	1	/* Some other, idle, cpu */
+#define WAKEUP_WAKER	2	/* The waker's cpu */
+#define WAKEUP_NPLACES	3
+
+/*
+ * Buckets in the scheduler's latency histograms. Bucket 0 counts
+ * times under 2^11 ns (about 2 usec); each bucket after that covers
+ * twice the time of the one before, and the last takes the rest.
+ */
+#define SCHED_HISTBUCKETS	16
+
+/*
+ * Sleep time by wait channel name, kept per cpu by the waker (see
+ * thread.c). Names are copied in (truncated), because many wait
+ * channels are named by strings that get freed. When a table fills
+ * up, its last slot collects everything else.
+ */
+#define WCHANSTATS_SIZE		32
+#define WCHANSTATS_NAMELEN	16
+
+struct wchanstat {
+	char ws_name[WCHANSTATS_NAMELEN];
+	unsigned ws_count;		/* Number of sleeps */
+	uint64_t ws_time;		/* Total time asleep */
+};
+
+/*
+ * Free physical pages each cpu may keep for itself (see the VM
+ * system).
+ */
+#define PAGEMAG_SIZE	32
+
 /*
  * Per-cpu structure
  *
@@ -60,15 +102,66 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_schedboost;		/* schedule() calls until next boost */
+	unsigned c_wakeups[WAKEUP_NPLACES]; /* Wakeups done, by placement */
+
+	/* Scheduler accounting; times are in nanoseconds. */
+	uint64_t c_busytime;		/* Time running threads */
+	uint64_t c_idletime;		/* Time in cpu_idle */
+	unsigned c_nswitches;		/* Context switches */
+	unsigned c_nmigrations;		/* Threads moved here by this cpu */
+	unsigned c_waithist[SCHED_HISTBUCKETS];	/* Run queue latency */
+	unsigned c_runhist[SCHED_HISTBUCKETS];	/* Time run per switch */
+	unsigned c_sleephist[SCHED_HISTBUCKETS]; /* Time asleep */
+	struct wchanstat c_wchanstats[WCHANSTATS_SIZE]; /* By wchan name */
+
+	/* Contended lock_acquire calls made on this cpu. */
+	unsigned c_lockspins;		/* Got the lock by spinning */
+	unsigned c_lockblocks;		/* Had to sleep for the lock */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
+	 *
+	 * c_isidle and c_runcount may also be read without the lock,
+	 * as hints, by code choosing a cpu to put work on.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* Run queues, by level */
+	unsigned c_runcount;		/* Total threads on c_runqueue[] */
+	unsigned c_tickperiod;		/* Hardclock periods per tick; 0=off */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Accessed by other cpus, without locking (see thread.c).
+	 *
+	 * Threads woken up by other cpus, waiting to be moved onto
+	 * the run queue by this cpu, and how many there are.
+	 */
+	struct thread *volatile c_inbox;
+	volatile unsigned c_inboxcount;
+
+	/*
+	 * Accessed by other cpus (only to reclaim memory).
+	 * Protected by the thread cache lock.
+	 *
+	 * Exited threads with their stacks still attached, ready for
+	 * reuse by thread_create.
+	 */
+	struct threadlist c_threadcache;
+	struct spinlock c_threadcache_lock;
+
+	/*
+	 * Accessed by other cpus (only to reclaim memory).
+	 * Protected by the page magazine lock.
+	 *
+	 * Free pages for single-page allocations on this cpu, so
+	 * they needn't take the VM system's global lock.
+	 */
+	paddr_t c_pagemag[PAGEMAG_SIZE];
+	unsigned c_pagemag_count;
+	struct spinlock c_pagemag_lock;
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -105,6 +198,13 @@ struct cpu {
  * for the cpu.
  */
 struct cpu *cpu_create(unsigned hardware_number);
+
+/*
+ * The number of cpus, and the cpu with a given c_number, for code
+ * outside thread.c that needs to visit every cpu.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned number);
 void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Lock contention statistics, for finding hot locks.
+ *
+ * Compiled in only with "options lockstat"; without it none of this
+ * exists and locks and spinlocks carry no extra fields or code.
+ *
+ * Sleep locks are counted by name, so all locks created with the same
+ * name share one entry. Spinlocks are counted by the address of the
+ * code that called spinlock_acquire, which can be looked up in the
+ * kernel's symbol table.
+ *
+ * Times are in nanoseconds as read by gettime_ns, so they show up as
+ * 0 until the clock device attaches.
+ *
+ * lockstat_name   - Look up (or make) the entry for sleep locks called
+ *                   NAME. Returns NULL if the table is full.
+ * lockstat_site   - The same, for spinlocks acquired at SITE.
+ * lockstat_acquired - Count an acquire, at time NOW, of the lock with
+ *                   entry LS (which may be NULL). If CONTENDED, it
+ *                   started waiting at time START.
+ * lockstat_released - Count a release at time NOW of a lock acquired
+ *                   at time ACQUIRED.
+ * lockstat_print  - Print the TOPN entries with the most wait time.
+ * lockstat_reset  - Zero all the counters.
+ *
+ * None of these use spinlocks, so spinlock_acquire can call them.
+ */
+
+#include "opt-lockstat.h"
+
+#if OPT_LOCKSTAT
+
+struct lockstat;	/* Opaque. */
+
+struct lockstat *lockstat_name(const char *name);
+struct lockstat *lockstat_site(const void *site);
+void lockstat_acquired(struct lockstat *ls, bool contended,
+		       uint64_t start, uint64_t now);
+void lockstat_released(struct lockstat *ls, uint64_t acquired, uint64_t now);
+void lockstat_print(unsigned topn);
+void lockstat_reset(void);
+
+#endif /* OPT_LOCKSTAT */
+
+
+#endif /* _LOCKSTAT_H_ */
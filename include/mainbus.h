@@ -52,6 +52,14 @@ void mainbus_interrupt(struct trapframe *);
 /* XXX this interface is not adequately MI */
 size_t mainbus_ramsize(void);
 
+/*
+ * Program the current cpu's hardclock timer to interrupt once after
+ * NTICKS hardclock periods (1/HZ seconds each) instead of after one.
+ * NTICKS of 0 means as far in the future as the hardware allows. The
+ * interrupt handler returns the timer to one period.
+ */
+void mainbus_hardclock_set(unsigned nticks);
+
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
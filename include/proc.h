@@ -39,6 +39,7 @@
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
 #include <array.h>
+#include <synch.h>
 #include "opt-A2.h"
 struct addrspace;
 struct vnode;
@@ -66,7 +67,7 @@ struct proc {
 #if OPT_A2
     struct array* childlst;
     pid_t pid;
-    struct cv* wait_cv; 
+    struct cv wait_cv;
     bool dead;
     bool parent_dead;
     int exitcode;
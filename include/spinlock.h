@@ -45,24 +45,40 @@
 /* Get the machine-dependent bits. */
 #include <machine/spinlock.h>
 
+#include <lockstat.h>
+
 /*
  * Basic spinlock.
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * These are ticket locks, so they're fair: cpus get the lock in the
+ * order they asked for it. Each one takes a number from lk_ticket and
+ * waits until lk_serving reaches it; releasing the lock bumps
+ * lk_serving. The lock is free when the two are equal.
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
-	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
+	volatile unsigned lk_ticket;	/* Next ticket to hand out. */
+	volatile unsigned lk_serving;	/* Ticket whose turn it is. */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+#if OPT_LOCKSTAT
+	struct lockstat *lk_stat;	/* Stats for the holder's call site */
+	uint64_t lk_acquiretime;	/* When the holder got the lock */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#if OPT_LOCKSTAT
+#define SPINLOCK_INITIALIZER	{ 0, 0, NULL, NULL, 0 }
+#else
+#define SPINLOCK_INITIALIZER	{ 0, 0, NULL }
+#endif
 
 /*
  * Spinlock functions.
@@ -36,22 +36,47 @@
 
 
 #include <spinlock.h>
+#include <wchan.h>
+
+/*
+ * All the objects here can be made three ways: with the _create and
+ * _destroy functions, which allocate one block of memory each; with
+ * the _init and _cleanup functions, on storage provided by the
+ * caller (so they can be embedded in other structures); or
+ * statically, with the _INITIALIZER macros. None of them makes a
+ * copy of the name, which should generally be a string constant.
+ */
 
 /*
  * Dijkstra-style semaphore.
  *
- * The name field is for easier debugging. A copy of the name is made
- * internally.
+ * The name field is for easier debugging.
  */
 struct semaphore {
-        char *sem_name;
-	struct wchan *sem_wchan;
+        const char *sem_name;
+	struct wchan sem_wchan;
 	struct spinlock sem_lock;
-        volatile int sem_count;
+	volatile unsigned sem_count;	/* Count (times 2), and waiters flag */
+	unsigned sem_nwaiters;		/* Threads in P's slow path */
+	bool sem_handoff;
 };
 
+#define SEMAPHORE_INITIALIZER(name, count) \
+	{ name, WCHAN_INITIALIZER(name), SPINLOCK_INITIALIZER, \
+	  (count) * 2, 0, false }
+
 struct semaphore *sem_create(const char *name, int initial_count);
 void sem_destroy(struct semaphore *);
+void sem_init(struct semaphore *, const char *name, int initial_count);
+void sem_cleanup(struct semaphore *);
+
+/*
+ * Handoff mode (off by default). When on, the thread V() wakes is
+ * put on the caller's cpu and runs as soon as the caller next blocks
+ * or yields, instead of going to the back of a run queue. Use this
+ * for request/response pairs that ping-pong through the semaphore.
+ */
+void sem_sethandoff(struct semaphore *, bool handoff);
 
 /*
  * Operations (both atomic):
@@ -62,6 +87,17 @@ void sem_destroy(struct semaphore *);
 void P(struct semaphore *);
 void V(struct semaphore *);
 
+/*
+ * Timed waits. P_timed, lock_acquire_timed and cv_timedwait are like
+ * P, lock_acquire and cv_wait, but give up and return ETIMEDOUT if
+ * they haven't succeeded within TICKS timer ticks (see clocknap; use
+ * clock_nstoticks for a timeout in nanoseconds), and return 0 if they
+ * have. A timeout of 0 never sleeps. cv_timedwait holds the lock
+ * again when it returns, either way. Each has a per-thread callout
+ * that is cancelled on the way out, so nothing is left pending.
+ */
+int P_timed(struct semaphore *, unsigned ticks);
+
 
 /*
  * Simple lock for mutual exclusion.
@@ -69,22 +105,41 @@ void V(struct semaphore *);
  * When the lock is created, no thread should be holding it. Likewise,
  * when the lock is destroyed, no thread should be holding it.
  *
- * The name field is for easier debugging. A copy of the name is
- * (should be) made internally.
+ * The name field is for easier debugging.
+ *
+ * lock_acquire spins for a while if the holder is running on another
+ * cpu, and only sleeps if the holder isn't running or takes too long.
+ * The "ss" menu command shows how often each happens.
  */
 struct lock {
-        char *lk_name;
-        struct thread * curthread;
-        volatile bool held;
+        const char *lk_name;
+	volatile unsigned lk_owner;	/* Holder, and waiters flag */
+	unsigned lk_nwaiters;		/* Threads in the slow path */
         struct spinlock spin;
-        struct wchan *wc;
-
-       // wchan wchan *wc;
-           // add what you need here
-        // (don't forget to mark things volatile as needed)
+        struct wchan wc;
+        bool handoff;
+	struct thread *lk_piwaiters;	/* Waiters, for priority inheritance */
+	struct thread *lk_piholder;	/* Holder we've donated to */
+	struct lock *lk_pinext;		/* Next in lk_piholder's t_piheld */
+#if OPT_LOCKSTAT
+	struct lockstat *lk_stat;	/* Stats for locks with this name */
+	uint64_t lk_acquiretime;	/* When the holder got the lock */
+#endif
 };
 
+#if OPT_LOCKSTAT
+#define LOCK_INITIALIZER(name) \
+	{ name, 0, 0, SPINLOCK_INITIALIZER, WCHAN_INITIALIZER(name), \
+	  false, NULL, NULL, NULL, NULL, 0 }
+#else
+#define LOCK_INITIALIZER(name) \
+	{ name, 0, 0, SPINLOCK_INITIALIZER, WCHAN_INITIALIZER(name), \
+	  false, NULL, NULL, NULL }
+#endif
+
 struct lock *lock_create(const char *name);
+void lock_init(struct lock *, const char *name);
+void lock_cleanup(struct lock *);
 void lock_acquire(struct lock *);
 
 /*
@@ -95,12 +150,24 @@ void lock_acquire(struct lock *);
  *                   this.
  *    lock_do_i_hold - Return true if the current thread holds the lock; 
  *                   false otherwise.
- *
- * These operations must be atomic. You get to write them.
  */
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
+int lock_acquire_timed(struct lock *, unsigned ticks);
+
+/*
+ * Handoff mode (off by default): like sem_sethandoff, for the thread
+ * woken by lock_release.
+ */
+void lock_sethandoff(struct lock *, bool handoff);
+
+/*
+ * For the thread system: recompute thread T's effective priority
+ * after its base priority changes, including what waiters for locks
+ * it holds have donated to it. See thread_setpriority.
+ */
+void lock_pi_recompute(struct thread *t);
 
 
 /*
@@ -113,19 +180,20 @@ void lock_destroy(struct lock *);
  * These CVs are expected to support Mesa semantics, that is, no
  * guarantees are made about scheduling.
  *
- * The name field is for easier debugging. A copy of the name is
- * (should be) made internally.
+ * The name field is for easier debugging.
  */
 
 struct cv {
-        char *cv_name;
-        struct wchan *cv_wc;
-        // add what you need here
-        // (don't forget to mark things volatile as needed)
+        const char *cv_name;
+        struct wchan cv_wc;
 };
 
+#define CV_INITIALIZER(name)	{ name, WCHAN_INITIALIZER(name) }
+
 struct cv *cv_create(const char *name);
 void cv_destroy(struct cv *);
+void cv_init(struct cv *, const char *name);
+void cv_cleanup(struct cv *);
 
 /*
  * Operations:
@@ -138,11 +206,141 @@ void cv_destroy(struct cv *);
  * in. Note that under normal circumstances the same lock should be used
  * on all operations with any particular CV.
  *
- * These operations must be atomic. You get to write them.
+ * Woken threads are not actually run until the lock is released:
+ * cv_signal and cv_broadcast move them onto the lock's wait queue,
+ * and lock_release then wakes them one at a time.
  */
 void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
+int cv_timedwait(struct cv *cv, struct lock *lock, unsigned ticks);
+
+
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers can hold the lock at once, or one writer. It
+ * prefers writers: once a writer is waiting, new readers wait behind
+ * it, so a steady stream of readers can't starve writers out.
+ *
+ * The name field is for easier debugging.
+ */
+struct rwlock {
+	const char *rw_name;
+	struct spinlock rw_lock;
+	struct wchan rw_readwchan;	/* Readers waiting */
+	struct wchan rw_writewchan;	/* Writers waiting */
+	unsigned rw_readers;		/* Readers holding the lock */
+	unsigned rw_waitingwriters;	/* Writers waiting for it */
+	struct thread *rw_writer;	/* Writer holding the lock */
+};
+
+#define RWLOCK_INITIALIZER(name) \
+	{ name, SPINLOCK_INITIALIZER, WCHAN_INITIALIZER(name), \
+	  WCHAN_INITIALIZER(name), 0, 0, NULL }
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+void rwlock_init(struct rwlock *, const char *name);
+void rwlock_cleanup(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock shared, waiting while a
+ *                           writer holds it or is waiting for it.
+ *    rwlock_acquire_write - Get the lock exclusively.
+ *    rwlock_release       - Give up the lock, whichever way it's held.
+ *    rwlock_downgrade     - Turn the current thread's write hold into
+ *                           a read hold, without letting any other
+ *                           writer in between.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
+
+
+/*
+ * Barrier.
+ *
+ * Threads calling barrier_wait block until COUNT of them (the count
+ * the barrier was set up with) have arrived, and are then let go all
+ * at once, with one batched wakeup. The barrier is then ready for the
+ * next round. barrier_wait returns true in exactly one thread each
+ * round (the last to arrive), which can be used to elect a thread to
+ * do some serial work between rounds.
+ */
+struct barrier {
+	const char *b_name;
+	struct spinlock b_lock;
+	struct wchan b_wchan;
+	unsigned b_count;		/* Threads per round */
+	unsigned b_arrived;		/* Threads here this round */
+	unsigned b_generation;		/* Rounds completed */
+};
+
+#define BARRIER_INITIALIZER(name, count) \
+	{ name, SPINLOCK_INITIALIZER, WCHAN_INITIALIZER(name), count, 0, 0 }
+
+struct barrier *barrier_create(const char *name, unsigned count);
+void barrier_destroy(struct barrier *);
+void barrier_init(struct barrier *, const char *name, unsigned count);
+void barrier_cleanup(struct barrier *);
+bool barrier_wait(struct barrier *);
+
+
+/*
+ * Countdown latch.
+ *
+ * A latch is the usual way to wait for N threads to finish:
+ * latch_wait blocks until the count reaches zero, and each of the
+ * threads calls latch_countdown once. Whoever takes the count to zero
+ * wakes all the waiters together. latch_reset sets a new count so the
+ * latch can be used again; nobody may be waiting on it at the time.
+ */
+struct latch {
+	const char *lt_name;
+	struct spinlock lt_lock;
+	struct wchan lt_wchan;
+	unsigned lt_count;		/* Countdowns still to come */
+};
+
+#define LATCH_INITIALIZER(name, count) \
+	{ name, SPINLOCK_INITIALIZER, WCHAN_INITIALIZER(name), count }
+
+struct latch *latch_create(const char *name, unsigned count);
+void latch_destroy(struct latch *);
+void latch_init(struct latch *, const char *name, unsigned count);
+void latch_cleanup(struct latch *);
+void latch_countdown(struct latch *);
+void latch_wait(struct latch *);
+void latch_reset(struct latch *, unsigned count);
+
+
+/*
+ * Completion.
+ *
+ * A one-shot event: completion_wait blocks until someone calls
+ * completion_signal, and once it has been signalled returns at once,
+ * until completion_reset. completion_signal wakes every waiter.
+ */
+struct completion {
+	const char *cm_name;
+	struct spinlock cm_lock;
+	struct wchan cm_wchan;
+	bool cm_done;			/* Signalled yet? */
+};
+
+#define COMPLETION_INITIALIZER(name) \
+	{ name, SPINLOCK_INITIALIZER, WCHAN_INITIALIZER(name), false }
+
+struct completion *completion_create(const char *name);
+void completion_destroy(struct completion *);
+void completion_init(struct completion *, const char *name);
+void completion_cleanup(struct completion *);
+void completion_signal(struct completion *);
+void completion_wait(struct completion *);
+void completion_reset(struct completion *);
 
 
 #endif /* _SYNCH_H_ */
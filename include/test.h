@@ -57,9 +57,19 @@ int queuetest(int, char **);
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int threadforkbench(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int synchbench(int, char **);
+int rwtest(int, char **);
+int rwbench(int, char **);
+int pitest(int, char **);
+int spinbench(int, char **);
+int timedtest(int, char **);
+int barriertest(int, char **);
+int joinbench(int, char **);
+int handofftest(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
@@ -79,6 +89,9 @@ int printfile(int, char **);
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int pagetest(int, char **);
+int pagebench(int, char **);
+int swaptest(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
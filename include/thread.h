@@ -41,6 +41,7 @@
 #include <threadlist.h>
 
 struct cpu;
+struct lock;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -56,6 +57,14 @@ struct cpu;
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
 
+/*
+ * Thread priorities. Higher numbers run first. New threads get their
+ * creator's base priority; the first threads get PRI_DEFAULT.
+ */
+#define PRI_MIN		0
+#define PRI_DEFAULT	8
+#define PRI_MAX		15
+
 /* States a thread can be in. */
 typedef enum {
 	S_RUN,		/* running */
@@ -83,6 +92,46 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	struct wchan *t_wchan;		/* Wait channel, if sleeping */
+
+	/*
+	 * Scheduler fields. These are protected by the runqueue lock
+	 * of t_cpu while the thread is on a run queue, and belong to
+	 * the thread itself while it is running or asleep.
+	 */
+	unsigned t_level;		/* Run queue level (0 is highest) */
+	unsigned t_quantum_used;	/* Hardclocks used at this level */
+	struct thread *t_yieldto;	/* Run this next if it's queued here */
+	struct thread *t_inboxnext;	/* Link in a cpu's wakeup inbox */
+	unsigned t_priority;		/* Base priority */
+	unsigned t_epriority;		/* Effective priority, with donations */
+
+	/*
+	 * Priority inheritance. These are protected by the priority
+	 * inheritance lock in synch.c.
+	 */
+	struct lock *t_blockedon;	/* Lock we're waiting for */
+	struct thread *t_piwaitnext;	/* Next waiter for the same lock */
+	struct lock *t_piheld;		/* Locks we hold that have waiters */
+
+	/*
+	 * Set (with the lock's wait channel locked) when cv_signal or
+	 * cv_broadcast moves us from the cv to the lock; see synch.c.
+	 */
+	bool t_cvmorphed;
+
+	/*
+	 * Accounting, in nanoseconds. t_stamp is the time the thread
+	 * last started running, became runnable, or went to sleep.
+	 * Like the scheduler fields, these are protected by whoever
+	 * currently owns the thread.
+	 */
+	uint64_t t_stamp;
+	uint64_t t_runtime;		/* Time spent running */
+	uint64_t t_waittime;		/* Time runnable but not running */
+	uint64_t t_sleeptime;		/* Time asleep */
+	unsigned t_nswitches;		/* Times switched out */
+	unsigned t_nmigrations;		/* Times moved to another cpu */
 
 	/*
 	 * Interrupt state fields.
@@ -157,14 +206,58 @@ void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Yield the cpu, like thread_yield, but if thread T is waiting on
+ * this cpu's run queue, switch directly to it, unless a thread of
+ * higher priority is waiting too. T is only a hint; it is not
+ * dereferenced unless it's found there, so it's harmless if T has
+ * already run, moved to another cpu, or exited.
+ */
+void thread_yield_to(struct thread *t);
+
+/*
+ * Return true if thread T is currently running on another cpu. This
+ * is only a hint; it can change at any time. The caller must make
+ * sure T doesn't exit while it looks.
+ */
+bool thread_oncpu(struct thread *t);
+
+/*
+ * Set the current thread's base priority (PRI_MIN to PRI_MAX), and
+ * get its effective priority, which may be higher while threads of
+ * higher priority are waiting for locks it holds.
+ */
+void thread_setpriority(unsigned pri);
+unsigned thread_getpriority(void);
+
+/*
+ * Charge NTICKS hardclocks to the current thread, and preempt it if
+ * it has used up its quantum or a higher-priority thread is waiting.
+ * If nothing else is runnable, defer the next hardclock instead.
+ * Called from the timer interrupt.
+ */
+void thread_timeslice(unsigned nticks);
+
+/*
+ * Free threads (and their stacks) kept for reuse by thread_fork,
+ * keeping only a few per cpu. Called when memory is short.
+ */
+void thread_cache_reclaim(void);
+
+/*
+ * Print scheduler statistics for each cpu.
+ */
+void thread_printstats(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Potentially pull ready threads over from busier CPUs. Called from
+ * the timer interrupt. (Idle CPUs also do this on their own, from the
+ * idle loop.)
  */
 void thread_consider_migration(void);
 
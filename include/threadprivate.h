@@ -55,6 +55,9 @@ struct switchframe;	/* from <machine/switchframe.h> */
 void thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 		    void *data1, unsigned long data2);
 
+/* Change a thread's effective priority (for priority inheritance). */
+void thread_repriority(struct thread *t, unsigned epri);
+
 /* Initialize or clean up the machine-dependent portion of struct thread */
 void thread_machdep_init(struct thread_machdep *tm);
 void thread_machdep_cleanup(struct thread_machdep *tm);
@@ -157,6 +157,16 @@ int vfs_getcwd(struct uio *buf);
  *                    specified device.
  *
  *    vfs_unmountall - Unmount all mounted filesystems.
+ *
+ *    vfs_claimdev  - Claim the mountable device named by DEVNAME for
+ *                    some other use, such as swap, and hand back its
+ *                    raw vnode, with a reference, in RESULT. Fails
+ *                    with EBUSY if a filesystem is mounted on it or
+ *                    it's already claimed; while claimed, it can't
+ *                    be mounted.
+ *
+ *    vfs_releasedev - Drop a claim made with vfs_claimdev. The caller
+ *                    should also VOP_DECREF the vnode it was given.
  */
 
 void vfs_bootstrap(void);
@@ -173,6 +183,8 @@ int vfs_mount(const char *devname, void *data,
 			       struct fs **result));
 int vfs_unmount(const char *devname);
 int vfs_unmountall(void);
+int vfs_claimdev(const char *devname, struct vnode **result);
+void vfs_releasedev(const char *devname);
 
 /*
  * Array of vnodes.
@@ -55,6 +55,20 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/* Allocate/free npages separate kernel pages in one call */
+int alloc_kpages_bulk(unsigned npages, vaddr_t *pages);
+void free_kpages_bulk(unsigned npages, const vaddr_t *pages);
+
+/* Start swapping to a disk (eg, "lhd1") */
+int vm_swapon(const char *devname);
+
+/* Print physical page allocator stats */
+void vm_printstats(void);
+
+/* Get the sizes of memory and swap, in pages, and swap in use */
+void vm_meminfo(unsigned *rampages, unsigned *swappages,
+		unsigned *swapused);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
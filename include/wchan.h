@@ -32,21 +32,40 @@
 
 /*
  * Wait channel.
+ *
+ * A wait channel is only a name and an address: the threads sleeping
+ * on it are kept on a sleep queue shared (through a hash table) with
+ * other channels. So a wchan is one word, and can be embedded in the
+ * object being waited for, or initialized statically with
+ * WCHAN_INITIALIZER, at no cost.
+ *
+ * Because channels can share a sleep queue, and locking a channel
+ * locks its queue, never lock one channel (or call any other wchan
+ * function) while holding another channel locked.
  */
 
+struct thread;
+
+struct wchan {
+	const char *wc_name;		/* name for this channel */
+};
 
-struct wchan; /* Opaque */
+#define WCHAN_INITIALIZER(name)	{ name }
 
 /*
- * Create a wait channel. Use NAME as a symbolic name for the channel.
- * NAME should be a string constant; if not, the caller is responsible
- * for freeing it after the wchan is destroyed.
+ * Initialize a wait channel in storage provided by the caller, or
+ * create one in its own memory. Use NAME as a symbolic name for the
+ * channel. NAME should be a string constant; if not, the caller is
+ * responsible for freeing it after the wchan is cleaned up.
  */
+void wchan_init(struct wchan *wc, const char *name);
 struct wchan *wchan_create(const char *name);
 
 /*
- * Destroy a wait channel. Must be empty and unlocked.
+ * Clean up or destroy a wait channel (the opposites of wchan_init and
+ * wchan_create). Must be empty and unlocked.
  */
+void wchan_cleanup(struct wchan *wc);
 void wchan_destroy(struct wchan *wc);
 
 /*
@@ -75,11 +94,35 @@ void wchan_sleep(struct wchan *wc);
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The queue should not already be locked.
  *
- * The current implementation is FIFO but this is not promised by the
- * interface.
+ * The current implementation wakes the highest-priority thread first,
+ * FIFO among equals, but this is not promised by the interface.
  */
 void wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+/*
+ * Wake up the specific thread T, but only if it is currently sleeping
+ * on WC. Returns true if it was. The queue should not already be
+ * locked.
+ */
+bool wchan_wakethread(struct wchan *wc, struct thread *t);
+
+/*
+ * Wake up one thread, like wchan_wakeone, but put it on the current
+ * cpu and arrange for it to run as soon as the current thread blocks
+ * or yields. The queue should not already be locked.
+ */
+void wchan_handoff(struct wchan *wc);
+
+/*
+ * Move one thread (the one wchan_wakeone would pick), or all threads,
+ * sleeping on FROM to sleep on TO instead, without waking them.
+ * FUNC is called with TO locked for each thread moved, with ARG.
+ * Returns the number of threads moved. Neither queue should already
+ * be locked.
+ */
+unsigned wchan_morph(struct wchan *from, struct wchan *to, bool all,
+		     void (*func)(struct thread *, void *), void *arg);
+
 
 #endif /* _WCHAN_H_ */
@@ -125,6 +125,9 @@ proc_create(const char *name)
 
 	threadarray_init(&proc->p_threads);
 	spinlock_init(&proc->p_lock);
+#if OPT_A2
+	cv_init(&proc->wait_cv, "wait_cv");
+#endif
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -165,6 +168,7 @@ proc_destroy(struct proc *proc)
 
 #if OPT_A2	
 	pid_list = create(proc->pid, pid_list);
+	cv_cleanup(&proc->wait_cv);
 #endif
 	/* VFS fields */
 	if (proc->p_cwd) {
@@ -288,11 +292,6 @@ proc_create_runprogram(const char *name)
 	/* proc->pid = pid_avail; */
 	/* pid_avail++; */
 
-    	proc->wait_cv = cv_create("wait_cv");
-	if(proc->wait_cv == NULL){
-		proc_destroy(proc);
-		return NULL;
-	}
     	proc->dead = false;
     	proc->parent_dead = true;
 
@@ -41,10 +41,13 @@
 #include <vfs.h>
 #include <sfs.h>
 #include <syscall.h>
+#include <vm.h>
+#include <lockstat.h>
 #include <test.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockstat.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -374,6 +377,31 @@ cmd_unmount(int nargs, char **args)
 	return vfs_unmount(device);
 }
 
+/*
+ * Command for swapping to a disk. The disk must not have a filesystem
+ * on it; whatever is on it is lost.
+ */
+static
+int
+cmd_swapon(int nargs, char **args)
+{
+	char *device;
+
+	if (nargs != 2) {
+		kprintf("Usage: swapon device:\n");
+		return EINVAL;
+	}
+
+	device = args[1];
+
+	/* Allow (but do not require) colon after device name */
+	if (device[strlen(device)-1]==':') {
+		device[strlen(device)-1] = 0;
+	}
+
+	return vm_swapon(device);
+}
+
 /*
  * Command to set the "boot fs". 
  *
@@ -415,6 +443,80 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Command for printing physical page allocator stats.
+ */
+static
+int
+cmd_pagestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for printing scheduler stats.
+ */
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printstats();
+
+	return 0;
+}
+
+#if OPT_LOCKSTAT
+
+#define LOCKSTAT_TOPN 20
+
+/*
+ * Command for printing the hottest locks.
+ */
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	int topn;
+
+	topn = LOCKSTAT_TOPN;
+	if (nargs > 1) {
+		topn = atoi(args[1]);
+	}
+	if (topn <= 0) {
+		kprintf("Usage: lks [count]\n");
+		return EINVAL;
+	}
+
+	lockstat_print(topn);
+
+	return 0;
+}
+
+/*
+ * Command for zeroing the lock stats.
+ */
+static
+int
+cmd_lockstatreset(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	lockstat_reset();
+
+	return 0;
+}
+
+#endif /* OPT_LOCKSTAT */
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -449,6 +551,7 @@ static const char *opsmenu[] = {
 	"[p]       Other program             ",
 	"[mount]   Mount a filesystem        ",
 	"[unmount] Unmount a filesystem      ",
+	"[swapon]  Swap to a disk            ",
 	"[bootfs]  Set \"boot\" filesystem     ",
 	"[pf]      Print a file              ",
 	"[cd]      Change directory          ",
@@ -476,15 +579,28 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] Page allocator test           ",
+	"[km4] Page allocator benchmark      ",
+	"[km5] Swap/COW/page-in test         ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[tt4] Thread fork benchmark         ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] Synch benchmark               ",
+	"[sy5] Rwlock test                   ",
+	"[sy6] Rwlock read scaling benchmark ",
+	"[sy7] Priority inheritance test     ",
+	"[sy8] Spinlock contention benchmark ",
+	"[sy9] Timed wait test               ",
+	"[sy10] Barrier/latch/completion test",
+	"[sy11] Join wakeup benchmark        ",
+	"[sy12] Handoff ping-pong benchmark  ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -525,6 +641,12 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[ps] Physical page stats            ",
+	"[ss] Scheduler stats                ",
+#if OPT_LOCKSTAT
+	"[lks] Hottest locks                 ",
+	"[lkr] Reset lock stats              ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -560,6 +682,7 @@ static struct {
 	{ "p",		cmd_prog },
 	{ "mount",	cmd_mount },
 	{ "unmount",	cmd_unmount },
+	{ "swapon",	cmd_swapon },
 	{ "bootfs",	cmd_bootfs },
 	{ "pf",		printfile },
 	{ "cd",		cmd_chdir },
@@ -582,23 +705,42 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "ps",         cmd_pagestats },
+	{ "ss",         cmd_schedstats },
+#if OPT_LOCKSTAT
+	{ "lks",        cmd_lockstats },
+	{ "lkr",        cmd_lockstatreset },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	pagetest },
+	{ "km4",	pagebench },
+	{ "km5",	swaptest },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "tt4",	threadforkbench },
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	synchbench },
+	{ "sy5",	rwtest },
+	{ "sy6",	rwbench },
+	{ "sy7",	pitest },
+	{ "sy8",	spinbench },
+	{ "sy9",	timedtest },
+	{ "sy10",	barriertest },
+	{ "sy11",	joinbench },
+	{ "sy12",	handofftest },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
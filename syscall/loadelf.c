@@ -59,6 +59,7 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-A3.h"
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -73,7 +74,12 @@
  * executable whose load address is in kernel space. If you should
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
+ *
+ * (With OPT_A3 segments aren't loaded here, but page by page as they
+ * are touched; see as_define_file.)
  */
+#if OPT_A3
+#else
 static
 int
 load_segment(struct addrspace *as, struct vnode *v,
@@ -144,6 +150,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 	
 	return result;
 }
+#endif
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -288,9 +295,20 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_A3
+		/* Pages are read in on demand; see vm_fault. */
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > "
+				"segment memsize\n");
+			ph.p_filesz = ph.p_memsz;
+		}
+		result = as_define_file(as, v, ph.p_offset, ph.p_vaddr,
+					ph.p_filesz);
+#else
 		result = load_segment(as, v, ph.p_offset, ph.p_vaddr, 
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
+#endif
 		if (result) {
 			return result;
 		}
@@ -107,7 +107,7 @@ void sys__exit(int exitcode) {
 		}
 	}
 	p->exitcode = exitcode;
-	cv_broadcast(p->wait_cv, proc_lock);
+	cv_broadcast(&p->wait_cv, proc_lock);
 	p->dead = true;
 
 
@@ -203,7 +203,7 @@ sys_waitpid(pid_t pid,
 		return ECHILD; 
 	}
 	if(! child->dead) {
-		cv_wait(child->wait_cv, proc_lock);
+		cv_wait(&child->wait_cv, proc_lock);
 	}
 
 	exitstatus = _MKWAIT_EXIT(child->exitcode);
@@ -56,19 +56,8 @@
 #define NTHREADS 12
 #define NCREATES 32
 
-static struct semaphore *threadsem = NULL;
-
-static
-void
-init_threadsem(void)
-{
-	if (threadsem==NULL) {
-		threadsem = sem_create("fstestsem", 0);
-		if (threadsem == NULL) {
-			panic("fstest: sem_create failed\n");
-		}
-	}
-}
+/* Counted down by each test thread as it finishes. */
+static struct latch threadlatch = LATCH_INITIALIZER("fstest", 0);
 
 /*
  * Vary each line of the test file in a way that's predictable but
@@ -306,7 +295,7 @@ readstress_thread(void *fs, unsigned long num)
 	if (fstest_read(filesys, "")) {
 		kprintf("*** Thread %lu: failed\n", num);
 	}
-	V(threadsem);
+	latch_countdown(&threadlatch);
 }
 
 static
@@ -315,7 +304,7 @@ doreadstress(const char *filesys)
 {
 	int i, err;
 
-	init_threadsem();
+	latch_reset(&threadlatch, NTHREADS);
 
 	kprintf("*** Starting fs read stress test on %s:\n", filesys);
 
@@ -333,9 +322,7 @@ doreadstress(const char *filesys)
 		}
 	}
 
-	for (i=0; i<NTHREADS; i++) {
-		P(threadsem);
-	}
+	latch_wait(&threadlatch);
 
 	if (fstest_remove(filesys, "")) {
 		kprintf("*** Test failed\n");
@@ -357,13 +344,13 @@ writestress_thread(void *fs, unsigned long num)
 
 	if (fstest_write(filesys, numstr, 1, 0)) {
 		kprintf("*** Thread %lu: failed\n", num);
-		V(threadsem);
+		latch_countdown(&threadlatch);
 		return;
 	}
 
 	if (fstest_read(filesys, numstr)) {
 		kprintf("*** Thread %lu: failed\n", num);
-		V(threadsem);
+		latch_countdown(&threadlatch);
 		return;
 	}
 
@@ -373,7 +360,7 @@ writestress_thread(void *fs, unsigned long num)
 
 	kprintf("*** Thread %lu: done\n", num);
 
-	V(threadsem);
+	latch_countdown(&threadlatch);
 }
 
 static
@@ -382,7 +369,7 @@ dowritestress(const char *filesys)
 {
 	int i, err;
 
-	init_threadsem();
+	latch_reset(&threadlatch, NTHREADS);
 
 	kprintf("*** Starting fs write stress test on %s:\n", filesys);
 
@@ -394,9 +381,7 @@ dowritestress(const char *filesys)
 		}
 	}
 
-	for (i=0; i<NTHREADS; i++) {
-		P(threadsem);
-	}
+	latch_wait(&threadlatch);
 
 	kprintf("*** fs write stress test done\n");
 }
@@ -411,11 +396,11 @@ writestress2_thread(void *fs, unsigned long num)
 
 	if (fstest_write(filesys, "", NTHREADS, num)) {
 		kprintf("*** Thread %lu: failed\n", num);
-		V(threadsem);
+		latch_countdown(&threadlatch);
 		return;
 	}
 
-	V(threadsem);
+	latch_countdown(&threadlatch);
 }
 
 static
@@ -426,7 +411,7 @@ dowritestress2(const char *filesys)
 	char name[32];
 	struct vnode *vn;
 
-	init_threadsem();
+	latch_reset(&threadlatch, NTHREADS);
 
 	kprintf("*** Starting fs write stress test 2 on %s:\n", filesys);
 
@@ -449,9 +434,7 @@ dowritestress2(const char *filesys)
 		}
 	}
 
-	for (i=0; i<NTHREADS; i++) {
-		P(threadsem);
-	}
+	latch_wait(&threadlatch);
 
 	if (fstest_read(filesys, "")) {
 		kprintf("*** Test failed\n");
@@ -482,25 +465,25 @@ createstress_thread(void *fs, unsigned long num)
 
 		if (fstest_write(filesys, numstr, 1, 0)) {
 			kprintf("*** Thread %lu: file %d: failed\n", num, i);
-			V(threadsem);
+			latch_countdown(&threadlatch);
 			return;
 		}
 		
 		if (fstest_read(filesys, numstr)) {
 			kprintf("*** Thread %lu: file %d: failed\n", num, i);
-			V(threadsem);
+			latch_countdown(&threadlatch);
 			return;
 		}
 
 		if (fstest_remove(filesys, numstr)) {
 			kprintf("*** Thread %lu: file %d: failed\n", num, i);
-			V(threadsem);
+			latch_countdown(&threadlatch);
 			return;
 		}
 
 	}
 
-	V(threadsem);
+	latch_countdown(&threadlatch);
 }
 
 static
@@ -509,7 +492,7 @@ docreatestress(const char *filesys)
 {
 	int i, err;
 
-	init_threadsem();
+	latch_reset(&threadlatch, NTHREADS);
 
 	kprintf("*** Starting fs create stress test on %s:\n", filesys);
 
@@ -528,9 +511,7 @@ docreatestress(const char *filesys)
 		}
 	}
 
-	for (i=0; i<NTHREADS; i++) {
-		P(threadsem);
-	}
+	latch_wait(&threadlatch);
 
 	kprintf("*** fs create stress test done\n");
 }
@@ -31,9 +31,17 @@
  * Test code for kmalloc.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
+#include <cpu.h>
 #include <thread.h>
+#include <current.h>
+#include <proc.h>
 #include <synch.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <vm.h>
 #include <test.h>
 
 /*
@@ -137,3 +145,511 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Page allocator test: keep KP_SLOTS multi-page allocations of random
+ * sizes live at once, allocating and freeing at random, so the free
+ * space is chopped up and has to coalesce again. Each allocation is
+ * filled with its own tag and checked before it's freed, which
+ * catches any two allocations that overlap.
+ */
+
+#define KP_SLOTS	32
+#define KP_ITERS	2000
+#define KP_MAXPAGES	7
+
+static
+void
+pagefill(vaddr_t va, unsigned npages, uint32_t tag)
+{
+	uint32_t *p = (uint32_t *)va;
+	unsigned i;
+
+	for (i=0; i<npages * PAGE_SIZE / sizeof(uint32_t); i++) {
+		p[i] = tag;
+	}
+}
+
+static
+bool
+pagecheck(vaddr_t va, unsigned npages, uint32_t tag)
+{
+	const uint32_t *p = (const uint32_t *)va;
+	unsigned i;
+
+	for (i=0; i<npages * PAGE_SIZE / sizeof(uint32_t); i++) {
+		if (p[i] != tag) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int
+pagetest(int nargs, char **args)
+{
+	vaddr_t va[KP_SLOTS];
+	unsigned npages[KP_SLOTS];
+	unsigned i, slot, nfailed;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting page allocator test...\n");
+
+	for (i=0; i<KP_SLOTS; i++) {
+		va[i] = 0;
+	}
+	nfailed = 0;
+
+	for (i=0; i<KP_ITERS; i++) {
+		slot = random() % KP_SLOTS;
+		if (va[slot] != 0) {
+			if (!pagecheck(va[slot], npages[slot], slot)) {
+				kprintf("Slot %u: %u pages at 0x%x "
+					"overwritten\n", slot,
+					npages[slot], va[slot]);
+				nfailed++;
+			}
+			free_kpages(va[slot]);
+			va[slot] = 0;
+		}
+		else {
+			npages[slot] = 1 + random() % KP_MAXPAGES;
+			va[slot] = alloc_kpages(npages[slot]);
+			if (va[slot] == 0) {
+				kprintf("alloc_kpages(%u) returned 0\n",
+					npages[slot]);
+				nfailed++;
+				continue;
+			}
+			pagefill(va[slot], npages[slot], slot);
+		}
+	}
+
+	for (i=0; i<KP_SLOTS; i++) {
+		if (va[i] != 0) {
+			if (!pagecheck(va[i], npages[i], i)) {
+				nfailed++;
+			}
+			free_kpages(va[i]);
+		}
+	}
+
+	vm_printstats();
+	kprintf("Page allocator test %s\n", nfailed ? "FAILED" : "done");
+
+	return 0;
+}
+
+/*
+ * Page allocator scaling benchmark. For 1, 2, 4, ... threads, up to
+ * the number of cpus, each thread allocates and frees PB_BATCH pages
+ * over and over for PB_MS, in three ways: one page at a time (which
+ * goes through the per-cpu magazines), all at once with the bulk
+ * calls, and two pages at a time (which always goes to the buddy
+ * allocator under its one global lock, for comparison). We print
+ * pages allocated and freed per ms; the magazine paths should scale
+ * with the threads where the global one doesn't.
+ */
+
+#define PB_MS		200
+#define PB_BATCH	8
+#define PB_MAXTHREADS	32
+#define PB_SINGLE	0
+#define PB_BULK		1
+#define PB_DOUBLE	2
+#define PB_NMODES	3
+
+static struct barrier pb_start;
+static struct latch pb_done = LATCH_INITIALIZER("pagebench", 0);
+static uint64_t pb_end;
+static unsigned long pb_counts[PB_MAXTHREADS];
+static volatile bool pb_failed;
+
+static
+void
+pagebenchthread(void *junk, unsigned long num)
+{
+	vaddr_t pages[PB_BATCH];
+	unsigned long count;
+	int mode = (intptr_t)junk;
+	unsigned i;
+
+	if (barrier_wait(&pb_start)) {
+		pb_end = gettime_ns() + (uint64_t)PB_MS * 1000000;
+	}
+	barrier_wait(&pb_start);
+
+	count = 0;
+	do {
+		switch (mode) {
+		    case PB_SINGLE:
+			for (i=0; i<PB_BATCH; i++) {
+				pages[i] = alloc_kpages(1);
+				if (pages[i] == 0) {
+					goto fail;
+				}
+			}
+			for (i=0; i<PB_BATCH; i++) {
+				free_kpages(pages[i]);
+			}
+			break;
+		    case PB_BULK:
+			if (alloc_kpages_bulk(PB_BATCH, pages)) {
+				goto fail;
+			}
+			free_kpages_bulk(PB_BATCH, pages);
+			break;
+		    case PB_DOUBLE:
+			for (i=0; i<PB_BATCH/2; i++) {
+				pages[i] = alloc_kpages(2);
+				if (pages[i] == 0) {
+					goto fail;
+				}
+			}
+			for (i=0; i<PB_BATCH/2; i++) {
+				free_kpages(pages[i]);
+			}
+			break;
+		}
+		count += PB_BATCH;
+	} while (gettime_ns() < pb_end);
+
+	pb_counts[num] = count;
+	latch_countdown(&pb_done);
+	return;
+
+ fail:
+	/* Leaks what it got so far; we're out of memory anyway. */
+	pb_failed = true;
+	pb_counts[num] = count;
+	latch_countdown(&pb_done);
+}
+
+static
+unsigned long
+pagebench_run(int mode, unsigned nthreads)
+{
+	unsigned long total;
+	unsigned i;
+	int result;
+
+	barrier_init(&pb_start, "pagebench", nthreads);
+	latch_reset(&pb_done, nthreads);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("pagebench", NULL, pagebenchthread,
+				     (void *)(intptr_t)mode, i);
+		if (result) {
+			panic("pagebench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	latch_wait(&pb_done);
+	barrier_cleanup(&pb_start);
+
+	total = 0;
+	for (i=0; i<nthreads; i++) {
+		total += pb_counts[i];
+	}
+	return total / PB_MS;
+}
+
+int
+pagebench(int nargs, char **args)
+{
+	unsigned ncpus, nthreads;
+	int mode;
+
+	(void)nargs;
+	(void)args;
+
+	ncpus = cpu_count();
+	if (ncpus > PB_MAXTHREADS) {
+		ncpus = PB_MAXTHREADS;
+	}
+
+	kprintf("Starting page allocator benchmark (%u cpus, %d ms)...\n",
+		ncpus, PB_MS);
+	kprintf("                pages per ms\n");
+	kprintf("threads     single       bulk     2-page\n");
+
+	pb_failed = false;
+	nthreads = 1;
+	while (1) {
+		kprintf("%7u", nthreads);
+		for (mode=0; mode<PB_NMODES; mode++) {
+			kprintf(" %10lu", pagebench_run(mode, nthreads));
+		}
+		kprintf("\n");
+		if (nthreads >= ncpus) {
+			break;
+		}
+		nthreads *= 2;
+		if (nthreads > ncpus) {
+			nthreads = ncpus;
+		}
+	}
+
+	kprintf("Page allocator benchmark %s\n",
+		pb_failed ? "ran out of memory" : "done");
+	return 0;
+}
+
+/*
+ * Swap test. A process gets a data region a quarter bigger than all
+ * of memory and writes a few words to every page, so most of them
+ * have to go out to swap, then reads them all back. Then it forks
+ * its address space, while the pages are shared partly in memory
+ * and partly in swap, and rewrites some pages at each end; the
+ * parent must see the new data and the child the old. Pages shared
+ * copy-on-write can't be paged out, so before forking it pushes some
+ * of its pages out with a big kernel allocation, to leave room for
+ * the copies. Finally both address spaces are destroyed, which must
+ * give back all the swap they used.
+ *
+ * This needs swap to be on (see the swapon command), with room for
+ * every page plus the copies.
+ */
+
+#define SWAPTEST_VBASE1	0x00400000
+#define SWAPTEST_VBASE2	0x10000000
+#define SWAPTEST_WORDS	8	/* words written per page */
+#define SWAPTEST_COW	32	/* pages rewritten at each end */
+#define SWAPTEST_SLACK	64	/* spare swap, for the stack and such */
+#define SWAPTEST_MAXBAD	5	/* bad pages reported */
+
+static struct latch st_done = LATCH_INITIALIZER("swaptest", 0);
+static unsigned st_npages;
+static unsigned st_swapused;
+static unsigned st_nfailed;
+
+static
+uint32_t
+swaptest_word(unsigned page, unsigned word, unsigned gen)
+{
+	return (gen << 28) | (page << 8) | word;
+}
+
+/*
+ * Write generation GEN of the pattern to data pages FIRST to LAST-1
+ * of the current address space.
+ */
+static
+int
+swaptest_fill(unsigned first, unsigned last, unsigned gen)
+{
+	uint32_t buf[SWAPTEST_WORDS];
+	unsigned i, j;
+	int result;
+
+	for (i=first; i<last; i++) {
+		for (j=0; j<SWAPTEST_WORDS; j++) {
+			buf[j] = swaptest_word(i, j, gen);
+		}
+		result = copyout(buf,
+				 (userptr_t)(SWAPTEST_VBASE2 + i * PAGE_SIZE),
+				 sizeof(buf));
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Check that data pages FIRST to LAST-1 of the current address space
+ * hold generation GEN of the pattern.
+ */
+static
+void
+swaptest_check(const char *who, unsigned first, unsigned last,
+	       unsigned gen)
+{
+	uint32_t buf[SWAPTEST_WORDS];
+	unsigned i, j;
+	int result;
+
+	for (i=first; i<last; i++) {
+		result = copyin((const_userptr_t)(SWAPTEST_VBASE2 +
+						  i * PAGE_SIZE),
+				buf, sizeof(buf));
+		for (j=0; result == 0 && j<SWAPTEST_WORDS; j++) {
+			if (buf[j] != swaptest_word(i, j, gen)) {
+				result = EINVAL;
+			}
+		}
+		if (result == 0) {
+			continue;
+		}
+		if (st_nfailed < SWAPTEST_MAXBAD) {
+			kprintf("swaptest: %s: page %u is wrong (%s)\n",
+				who, i, strerror(result));
+		}
+		st_nfailed++;
+	}
+}
+
+static
+void
+swaptest_thread(void *junk1, unsigned long junk2)
+{
+	struct addrspace *as, *child;
+	struct proc *p;
+	unsigned npages, rampages, swappages, swapused, nkpages;
+	vaddr_t stackptr, *kpages;
+	int result;
+
+	(void)junk1;
+	(void)junk2;
+
+	npages = st_npages;
+	child = NULL;
+
+	as = as_create();
+	if (as == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	result = as_define_region(as, SWAPTEST_VBASE1, PAGE_SIZE, 1, 1, 0);
+	if (result == 0) {
+		result = as_define_region(as, SWAPTEST_VBASE2,
+					  npages * PAGE_SIZE, 1, 1, 0);
+	}
+	if (result == 0) {
+		result = as_prepare_load(as);
+	}
+	if (result == 0) {
+		result = as_define_stack(as, &stackptr);
+	}
+	if (result) {
+		as_destroy(as);
+		goto fail;
+	}
+	curproc_setas(as);
+	as_activate();
+
+	kprintf("Writing %u pages...\n", npages);
+	result = swaptest_fill(0, npages, 0);
+	if (result) {
+		goto done;
+	}
+	vm_meminfo(&rampages, &swappages, &swapused);
+	kprintf("%u pages in swap\n", swapused - st_swapused);
+	if (swapused == st_swapused) {
+		kprintf("swaptest: nothing was paged out\n");
+		st_nfailed++;
+	}
+	kprintf("Reading them back...\n");
+	swaptest_check("first pass", 0, npages, 0);
+
+	nkpages = rampages / 4;
+	kpages = kmalloc(nkpages * sizeof(vaddr_t));
+	if (kpages == NULL) {
+		result = ENOMEM;
+		goto done;
+	}
+	result = alloc_kpages_bulk(nkpages, kpages);
+	if (result == 0) {
+		free_kpages_bulk(nkpages, kpages);
+	}
+	kfree(kpages);
+	if (result) {
+		goto done;
+	}
+
+	kprintf("Forking and rewriting %u pages...\n", 2 * SWAPTEST_COW);
+	result = as_copy(as, &child);
+	if (result) {
+		goto done;
+	}
+	result = swaptest_fill(0, SWAPTEST_COW, 1);
+	if (result == 0) {
+		result = swaptest_fill(npages - SWAPTEST_COW, npages, 1);
+	}
+	if (result) {
+		goto done;
+	}
+	swaptest_check("parent", 0, SWAPTEST_COW, 1);
+	swaptest_check("parent", SWAPTEST_COW, npages - SWAPTEST_COW, 0);
+	swaptest_check("parent", npages - SWAPTEST_COW, npages, 1);
+
+	curproc_setas(child);
+	as_activate();
+	swaptest_check("child", 0, npages, 0);
+
+ done:
+	as_deactivate();
+	curproc_setas(NULL);
+	if (child != NULL) {
+		as_destroy(child);
+	}
+	as_destroy(as);
+
+	vm_meminfo(&rampages, &swappages, &swapused);
+	if (swapused != st_swapused) {
+		kprintf("swaptest: %u swap pages leaked\n",
+			swapused - st_swapused);
+		st_nfailed++;
+	}
+
+ fail:
+	if (result) {
+		kprintf("swaptest: %s\n", strerror(result));
+		st_nfailed++;
+	}
+
+	p = curproc;
+	proc_remthread(curthread);
+	proc_destroy(p);
+	latch_countdown(&st_done);
+	thread_exit();
+}
+
+int
+swaptest(int nargs, char **args)
+{
+	struct proc *proc;
+	unsigned rampages, swappages;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	vm_meminfo(&rampages, &swappages, &st_swapused);
+	if (swappages == 0) {
+		kprintf("No swap; use swapon first\n");
+		return ENOSYS;
+	}
+	st_npages = rampages + rampages / 4;
+	if (swappages - st_swapused <
+	    st_npages + 2 * SWAPTEST_COW + SWAPTEST_SLACK) {
+		kprintf("Swap too small: need %u free pages for %u of memory\n",
+			st_npages + 2 * SWAPTEST_COW + SWAPTEST_SLACK,
+			rampages);
+		return ENOSPC;
+	}
+
+	kprintf("Starting swap test...\n");
+	st_nfailed = 0;
+
+	proc = proc_create_runprogram("swaptest");
+	if (proc == NULL) {
+		return ENOMEM;
+	}
+	latch_reset(&st_done, 1);
+	result = thread_fork("swaptest", proc, swaptest_thread, NULL, 0);
+	if (result) {
+		proc_destroy(proc);
+		return result;
+	}
+	latch_wait(&st_done);
+#ifdef UW
+	/* proc_destroy signalled this too, as it does for common_prog. */
+	P(no_proc_sem);
+#endif
+
+	vm_printstats();
+	kprintf("Swap test %s\n", st_nfailed ? "FAILED" : "done");
+	return 0;
+}
@@ -32,8 +32,13 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <clock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <spinlock.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -57,6 +62,7 @@ static struct lock *testlock;
 static struct cv *testcv;
 static struct semaphore *donesem;
 #endif
+static struct latch donelatch = LATCH_INITIALIZER("donelatch", 0);
 
 #ifdef UW
 static
@@ -105,6 +111,23 @@ inititems(void)
 	}
 }
 
+/*
+ * Fork a test thread in the kernel process, or panic.
+ */
+static
+void
+synchtest_fork(const char *name, void (*func)(void *, unsigned long),
+	       unsigned long num)
+{
+	int result;
+
+	result = thread_fork(name, NULL, func, NULL, num);
+	if (result) {
+		panic("synchtest: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
+
 static
 void
 semtestthread(void *junk, unsigned long num)
@@ -175,7 +198,7 @@ fail(unsigned long num, const char *msg)
 
 	lock_release(testlock);
 
-	V(donesem);
+	latch_countdown(&donelatch);
 	thread_exit();
 }
 
@@ -218,7 +241,7 @@ locktestthread(void *junk, unsigned long num)
 
 		lock_release(testlock);
 	}
-	V(donesem);
+	latch_countdown(&donelatch);
 #ifdef UW
   thread_exit();
 #endif
@@ -236,6 +259,7 @@ locktest(int nargs, char **args)
 	inititems();
 	kprintf("Starting lock test...\n");
 
+	latch_reset(&donelatch, NTHREADS);
 	for (i=0; i<NTHREADS; i++) {
 		result = thread_fork("synchtest", NULL, locktestthread,
 				     NULL, i);
@@ -244,9 +268,7 @@ locktest(int nargs, char **args)
 			      strerror(result));
 		}
 	}
-	for (i=0; i<NTHREADS; i++) {
-		P(donesem);
-	}
+	latch_wait(&donelatch);
 
 #ifdef UW
   cleanitems();
@@ -287,7 +309,7 @@ cvtestthread(void *junk, unsigned long num)
 				kprintf("cv_wait took only %u ns\n", nsecs2);
 				kprintf("That's too fast... you must be "
 					"busy-looping\n");
-				V(donesem);
+				latch_countdown(&donelatch);
 				thread_exit();
 			}
 
@@ -304,7 +326,7 @@ cvtestthread(void *junk, unsigned long num)
 		cv_broadcast(testcv, testlock);
 		lock_release(testlock);
 	}
-	V(donesem);
+	latch_countdown(&donelatch);
 #ifdef UW
   thread_exit();
 #endif
@@ -329,6 +351,7 @@ cvtest(int nargs, char **args)
 
 	testval1 = NTHREADS-1;
 
+	latch_reset(&donelatch, NTHREADS);
 	for (i=0; i<NTHREADS; i++) {
 		result = thread_fork("synchtest", NULL, cvtestthread, NULL, i);
 		if (result) {
@@ -336,9 +359,7 @@ cvtest(int nargs, char **args)
 			      strerror(result));
 		}
 	}
-	for (i=0; i<NTHREADS; i++) {
-		P(donesem);
-	}
+	latch_wait(&donelatch);
 
 #ifdef UW
   cleanitems();
@@ -347,3 +368,1168 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Reader-writer lock test. Every fourth thread is a writer; the rest
+ * read. Writers check they're alone, readers check no writer is in
+ * and the data doesn't change under them, and half the time writers
+ * downgrade and carry on as readers.
+ */
+
+#define NRWLOOPS	40
+
+static struct rwlock *testrw;
+static struct latch rwdone = LATCH_INITIALIZER("rwdone", 0);
+static struct spinlock rwcount_lock;
+static unsigned rwcount_readers;
+static unsigned rwcount_writers;
+
+static
+void
+rwcount(int dreaders, int dwriters, unsigned *readers, unsigned *writers)
+{
+	spinlock_acquire(&rwcount_lock);
+	rwcount_readers += dreaders;
+	rwcount_writers += dwriters;
+	*readers = rwcount_readers;
+	*writers = rwcount_writers;
+	spinlock_release(&rwcount_lock);
+}
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	kprintf("Test failed\n");
+
+	rwlock_release(testrw);
+
+	latch_countdown(&rwdone);
+	thread_exit();
+}
+
+static
+void
+rwtestreader(unsigned long num)
+{
+	unsigned long val;
+	unsigned readers, writers;
+
+	rwcount(1, 0, &readers, &writers);
+	if (writers != 0) {
+		rwfail(num, "reader got in with a writer");
+	}
+	val = testval1;
+	thread_yield();
+	if (testval1 != val) {
+		rwfail(num, "data changed under a reader");
+	}
+	rwcount(-1, 0, &readers, &writers);
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	unsigned readers, writers;
+	int i;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (num % 4 != 0) {
+			rwlock_acquire_read(testrw);
+			rwtestreader(num);
+			rwlock_release(testrw);
+			continue;
+		}
+
+		rwlock_acquire_write(testrw);
+		rwcount(0, 1, &readers, &writers);
+		if (readers != 0 || writers != 1) {
+			rwfail(num, "writer not alone");
+		}
+		testval1 = num;
+		thread_yield();
+		if (testval1 != num) {
+			rwfail(num, "data changed under the writer");
+		}
+		rwcount(0, -1, &readers, &writers);
+		if (i % 2 == 0) {
+			rwlock_downgrade(testrw);
+			rwtestreader(num);
+		}
+		rwlock_release(testrw);
+	}
+	latch_countdown(&rwdone);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	testrw = rwlock_create("testrw");
+	if (testrw == NULL) {
+		panic("rwtest: out of memory\n");
+	}
+	spinlock_init(&rwcount_lock);
+	rwcount_readers = rwcount_writers = 0;
+
+	kprintf("Starting rwlock test...\n");
+
+	latch_reset(&rwdone, NTHREADS);
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	latch_wait(&rwdone);
+
+	spinlock_cleanup(&rwcount_lock);
+	rwlock_destroy(testrw);
+	kprintf("Rwlock test done.\n");
+
+	return 0;
+}
+
+/*
+ * Read-side scaling benchmark. For 1 up to N threads, each thread
+ * takes the lock for reading RWBENCH_LOOPS times and does a little
+ * work while holding it; we time the whole run, once with an rwlock
+ * and once with a plain lock. With enough cpus, the rwlock's time
+ * should stay about flat as threads are added while the lock's
+ * grows.
+ */
+
+#define RWBENCH_MAXTHREADS	4
+#define RWBENCH_LOOPS		2000
+#define RWBENCH_WORK		200
+
+static struct rwlock *benchrw;
+static struct lock *benchlock;
+static struct latch benchdone = LATCH_INITIALIZER("rwbench", 0);
+
+static
+void
+rwbenchthread(void *junk, unsigned long userw)
+{
+	volatile unsigned j;
+	int i;
+
+	(void)junk;
+
+	for (i=0; i<RWBENCH_LOOPS; i++) {
+		if (userw) {
+			rwlock_acquire_read(benchrw);
+		}
+		else {
+			lock_acquire(benchlock);
+		}
+		for (j=0; j<RWBENCH_WORK; j++) {
+			/* nothing */
+		}
+		if (userw) {
+			rwlock_release(benchrw);
+		}
+		else {
+			lock_release(benchlock);
+		}
+	}
+	latch_countdown(&benchdone);
+}
+
+static
+uint64_t
+rwbench_run(int nthreads, bool userw)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	int i, result;
+
+	latch_reset(&benchdone, nthreads);
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("rwbench", NULL, rwbenchthread,
+				     NULL, userw);
+		if (result) {
+			panic("rwbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	latch_wait(&benchdone);
+	gettime(&secs2, &nsecs2);
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+int
+rwbench(int nargs, char **args)
+{
+	uint64_t rwtime, locktime;
+	int n, maxthreads;
+
+	maxthreads = RWBENCH_MAXTHREADS;
+	if (nargs > 1) {
+		maxthreads = atoi(args[1]);
+	}
+	if (maxthreads <= 0) {
+		kprintf("Usage: sy6 [maxthreads]\n");
+		return EINVAL;
+	}
+
+	benchrw = rwlock_create("rwbench");
+	benchlock = lock_create("rwbench");
+	if (benchrw == NULL || benchlock == NULL) {
+		panic("rwbench: out of memory\n");
+	}
+
+	kprintf("Starting rwlock read scaling benchmark...\n");
+	kprintf("threads  rwlock us    lock us\n");
+	for (n=1; n<=maxthreads; n++) {
+		rwtime = rwbench_run(n, true);
+		locktime = rwbench_run(n, false);
+		kprintf("%7d %10lu %10lu\n", n,
+			(unsigned long)(rwtime / 1000),
+			(unsigned long)(locktime / 1000));
+	}
+
+	lock_destroy(benchlock);
+	rwlock_destroy(benchrw);
+	kprintf("Rwlock benchmark done.\n");
+
+	return 0;
+}
+
+/*
+ * Priority inheritance test.
+ *
+ * Part 1 sets up the classic inversion: a low-priority thread holds a
+ * lock, a crowd of medium-priority threads hog the cpus for
+ * PITEST_HOGMS, and then a high-priority thread wants the lock.
+ * Without inheritance the high thread waits for the hogs to finish;
+ * with it, the low thread is boosted past them and the high thread's
+ * wait is bounded by the low thread's critical section instead.
+ *
+ * Part 2 checks inheritance is transitive and undone on release: a
+ * low thread holds lock A, a second low thread holds B and waits for
+ * A, and a high thread waits for B. The first thread should end up
+ * at the high priority, and drop back when it releases A.
+ */
+
+#define PITEST_NHOGS	8
+#define PITEST_HOGMS	1000
+#define PITEST_WORK	100000
+#define PITEST_POLLMS	1000
+
+static struct lock *pilock_a;
+static struct lock *pilock_b;
+static struct semaphore *piready;
+static struct latch pidone = LATCH_INITIALIZER("pidone", 0);
+static uint64_t pi_hogend;
+static uint64_t pi_highwait;
+static unsigned pi_boosted;
+static unsigned pi_restored;
+
+static
+void
+pitest_work(void)
+{
+	volatile unsigned j;
+
+	for (j=0; j<PITEST_WORK; j++) {
+		/* nothing */
+	}
+}
+
+static
+void
+pitest_low(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	thread_setpriority(PRI_MIN);
+	lock_acquire(pilock_a);
+	V(piready);
+	pitest_work();
+	lock_release(pilock_a);
+	latch_countdown(&pidone);
+}
+
+static
+void
+pitest_hog(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	thread_setpriority(PRI_DEFAULT);
+	while (gettime_ns() < pi_hogend) {
+		/* hog the cpu */
+	}
+	latch_countdown(&pidone);
+}
+
+static
+void
+pitest_high(void *junk, unsigned long num)
+{
+	uint64_t start;
+
+	(void)junk;
+	(void)num;
+
+	start = gettime_ns();
+	if (num == 0) {
+		lock_acquire(pilock_a);
+		pi_highwait = gettime_ns() - start;
+		lock_release(pilock_a);
+	}
+	else {
+		lock_acquire(pilock_b);
+		lock_release(pilock_b);
+	}
+	latch_countdown(&pidone);
+}
+
+static
+void
+pitest_chainlow(void *junk, unsigned long num)
+{
+	uint64_t end;
+
+	(void)junk;
+	(void)num;
+
+	thread_setpriority(PRI_MIN);
+	lock_acquire(pilock_a);
+	V(piready);
+	/* Wait for the donation to come through the chain. */
+	end = gettime_ns() + (uint64_t)PITEST_POLLMS * 1000000;
+	while (thread_getpriority() != PRI_MAX && gettime_ns() < end) {
+		thread_yield();
+	}
+	pi_boosted = thread_getpriority();
+	lock_release(pilock_a);
+	pi_restored = thread_getpriority();
+	latch_countdown(&pidone);
+}
+
+static
+void
+pitest_chainmid(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	thread_setpriority(PRI_MIN);
+	lock_acquire(pilock_b);
+	V(piready);
+	lock_acquire(pilock_a);
+	lock_release(pilock_a);
+	lock_release(pilock_b);
+	latch_countdown(&pidone);
+}
+
+int
+pitest(int nargs, char **args)
+{
+	unsigned oldpri;
+	bool ok;
+	int i;
+
+	(void)nargs;
+	(void)args;
+
+	pilock_a = lock_create("pilock_a");
+	pilock_b = lock_create("pilock_b");
+	piready = sem_create("piready", 0);
+	if (pilock_a == NULL || pilock_b == NULL || piready == NULL) {
+		panic("pitest: out of memory\n");
+	}
+
+	/* Stay above everything so the hogs can't starve us. */
+	oldpri = thread_getpriority();
+	thread_setpriority(PRI_MAX);
+
+	kprintf("Starting priority inheritance test...\n");
+	ok = true;
+
+	latch_reset(&pidone, PITEST_NHOGS + 2);
+	synchtest_fork("pi_low", pitest_low, 0);
+	P(piready);
+	pi_hogend = gettime_ns() + (uint64_t)PITEST_HOGMS * 1000000;
+	for (i=0; i<PITEST_NHOGS; i++) {
+		synchtest_fork("pi_hog", pitest_hog, i);
+	}
+	synchtest_fork("pi_high", pitest_high, 0);
+	latch_wait(&pidone);
+	kprintf("High-priority thread waited %lu ms for the lock "
+		"(hogs ran %u ms)\n",
+		(unsigned long)(pi_highwait / 1000000), PITEST_HOGMS);
+	if (pi_highwait >= (uint64_t)PITEST_HOGMS * 1000000 / 2) {
+		kprintf("Inversion was not bounded\n");
+		ok = false;
+	}
+
+	latch_reset(&pidone, 3);
+	synchtest_fork("pi_chainlow", pitest_chainlow, 0);
+	P(piready);
+	synchtest_fork("pi_chainmid", pitest_chainmid, 0);
+	P(piready);
+	synchtest_fork("pi_high", pitest_high, 1);
+	latch_wait(&pidone);
+	kprintf("Lock chain: holder boosted to %u (want %u), "
+		"then back to %u (want %u)\n",
+		pi_boosted, PRI_MAX, pi_restored, PRI_MIN);
+	if (pi_boosted != PRI_MAX || pi_restored != PRI_MIN) {
+		ok = false;
+	}
+
+	thread_setpriority(oldpri);
+	sem_destroy(piready);
+	lock_destroy(pilock_b);
+	lock_destroy(pilock_a);
+
+	kprintf("Priority inheritance test %s.\n", ok ? "done" : "FAILED");
+	return 0;
+}
+
+/*
+ * Spinlock contention benchmark. Several threads (spread over the
+ * cpus by the scheduler) hammer one spinlock for SPINBENCH_MS, with
+ * a short critical section; then we print how many times each got
+ * it. The total shows throughput under contention, and the spread
+ * between the luckiest and unluckiest thread shows fairness.
+ */
+
+#define SPINBENCH_THREADS	4
+#define SPINBENCH_MAXTHREADS	32
+#define SPINBENCH_MS		500
+#define SPINBENCH_BATCH		64
+#define SPINBENCH_WORK		20
+
+static struct spinlock spinbench_lock = SPINLOCK_INITIALIZER;
+static struct barrier spinbench_start;
+static struct latch spinbench_done = LATCH_INITIALIZER("spinbench", 0);
+static uint64_t spinbench_end;
+static volatile unsigned long spinbench_shared;
+static unsigned long spinbench_counts[SPINBENCH_MAXTHREADS];
+
+static
+void
+spinbenchthread(void *junk, unsigned long num)
+{
+	volatile unsigned j;
+	unsigned long count;
+	unsigned i;
+
+	(void)junk;
+
+	/* Start together, so the early ones don't get a head start. */
+	if (barrier_wait(&spinbench_start)) {
+		spinbench_end = gettime_ns() +
+			(uint64_t)SPINBENCH_MS * 1000000;
+	}
+	barrier_wait(&spinbench_start);
+
+	count = 0;
+	do {
+		/* Don't read the clock every time around. */
+		for (i=0; i<SPINBENCH_BATCH; i++) {
+			spinlock_acquire(&spinbench_lock);
+			spinbench_shared++;
+			for (j=0; j<SPINBENCH_WORK; j++) {
+				/* nothing */
+			}
+			spinlock_release(&spinbench_lock);
+		}
+		count += SPINBENCH_BATCH;
+	} while (gettime_ns() < spinbench_end);
+
+	spinbench_counts[num] = count;
+	latch_countdown(&spinbench_done);
+}
+
+int
+spinbench(int nargs, char **args)
+{
+	unsigned long total, min, max;
+	int i, nthreads, result;
+
+	nthreads = SPINBENCH_THREADS;
+	if (nargs > 1) {
+		nthreads = atoi(args[1]);
+	}
+	if (nthreads <= 0 || nthreads > SPINBENCH_MAXTHREADS) {
+		kprintf("Usage: sy8 [threads]   (at most %d)\n",
+			SPINBENCH_MAXTHREADS);
+		return EINVAL;
+	}
+
+	barrier_init(&spinbench_start, "spinbench", nthreads);
+	latch_reset(&spinbench_done, nthreads);
+
+	kprintf("Starting spinlock contention benchmark "
+		"(%d threads, %d ms)...\n", nthreads, SPINBENCH_MS);
+
+	spinbench_shared = 0;
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("spinbench", NULL, spinbenchthread,
+				     NULL, i);
+		if (result) {
+			panic("spinbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	latch_wait(&spinbench_done);
+
+	total = 0;
+	min = max = spinbench_counts[0];
+	for (i=0; i<nthreads; i++) {
+		kprintf("thread %2d: %lu acquires\n", i, spinbench_counts[i]);
+		total += spinbench_counts[i];
+		if (spinbench_counts[i] < min) {
+			min = spinbench_counts[i];
+		}
+		if (spinbench_counts[i] > max) {
+			max = spinbench_counts[i];
+		}
+	}
+	KASSERT(spinbench_shared == total);
+	kprintf("Total %lu acquires (%lu per ms); fewest %lu, most %lu\n",
+		total, total / SPINBENCH_MS, min, max);
+
+	barrier_cleanup(&spinbench_start);
+	kprintf("Spinlock benchmark done.\n");
+	return 0;
+}
+
+/*
+ * Microbenchmark for the uncontended paths of the synchronization
+ * primitives. A bare spinlock acquire+release is timed first, as a
+ * yardstick for the others.
+ */
+
+#define SYNCHBENCH_ROUNDS 100000
+
+static
+void
+synchbench_report(const char *what, int rounds,
+		  time_t secs1, uint32_t nsecs1)
+{
+	time_t secs2, secs;
+	uint32_t nsecs2, nsecs;
+	uint64_t total;
+
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	total = (uint64_t)secs * 1000000000 + nsecs;
+	kprintf("%-28s %6lu ns per op\n", what,
+		(unsigned long)(total / rounds));
+}
+
+int
+synchbench(int nargs, char **args)
+{
+	struct spinlock splk;
+	struct semaphore *sem;
+	struct lock *lock;
+	time_t secs;
+	uint32_t nsecs;
+	int i, rounds;
+	bool held;
+
+	rounds = SYNCHBENCH_ROUNDS;
+	if (nargs > 1) {
+		rounds = atoi(args[1]);
+	}
+	if (rounds <= 0) {
+		kprintf("Usage: sy4 [rounds]\n");
+		return EINVAL;
+	}
+
+	sem = sem_create("synchbench", 0);
+	lock = lock_create("synchbench");
+	if (sem == NULL || lock == NULL) {
+		panic("synchbench: out of memory\n");
+	}
+	spinlock_init(&splk);
+
+	kprintf("Starting synch benchmark (%d rounds)...\n", rounds);
+
+	gettime(&secs, &nsecs);
+	for (i=0; i<rounds; i++) {
+		spinlock_acquire(&splk);
+		spinlock_release(&splk);
+	}
+	synchbench_report("spinlock acquire+release", rounds, secs, nsecs);
+
+	gettime(&secs, &nsecs);
+	for (i=0; i<rounds; i++) {
+		lock_acquire(lock);
+		lock_release(lock);
+	}
+	synchbench_report("lock acquire+release", rounds, secs, nsecs);
+
+	lock_acquire(lock);
+	held = true;
+	gettime(&secs, &nsecs);
+	for (i=0; i<rounds; i++) {
+		held = held && lock_do_i_hold(lock);
+	}
+	synchbench_report("lock_do_i_hold", rounds, secs, nsecs);
+	lock_release(lock);
+	KASSERT(held);
+
+	gettime(&secs, &nsecs);
+	for (i=0; i<rounds; i++) {
+		V(sem);
+		P(sem);
+	}
+	synchbench_report("V+P", rounds, secs, nsecs);
+
+	spinlock_cleanup(&splk);
+	lock_destroy(lock);
+	sem_destroy(sem);
+
+	kprintf("Synch benchmark done.\n");
+	return 0;
+}
+
+/*
+ * Timed wait test.
+ *
+ * Part 1 checks that P_timed, lock_acquire_timed and cv_timedwait
+ * give up with ETIMEDOUT when nothing comes, after at least about
+ * the time asked for, and leave the lock as they found it.
+ *
+ * Part 2 checks that a V, lock_release or cv_signal that comes in
+ * time wins, and that the timeout doesn't fire later anyway.
+ *
+ * Part 3 races wakeups against timeouts: TT_RACERS threads P_timed
+ * with a one-tick timeout while another thread Vs at the same rate,
+ * and no V may be lost; every one is either taken or still in the
+ * count at the end.
+ */
+
+#define TT_TICKS	10
+#define TT_LONGTICKS	10000
+#define TT_RACERS	4
+#define TT_ROUNDS	200
+
+/* These are static to exercise the initializers. */
+static struct semaphore ttsem = SEMAPHORE_INITIALIZER("ttsem", 0);
+static struct semaphore ttdone = SEMAPHORE_INITIALIZER("ttdone", 0);
+static struct lock ttlock = LOCK_INITIALIZER("ttlock");
+static struct cv ttcv = CV_INITIALIZER("ttcv");
+static volatile bool ttflag;
+static unsigned long tt_taken;
+
+static
+void
+timedtest_waker(void *junk, unsigned long num)
+{
+	(void)junk;
+
+	switch (num) {
+	    case 0:
+		clocknap(2);
+		V(&ttsem);
+		break;
+	    case 1:
+		lock_acquire(&ttlock);
+		V(&ttdone);
+		clocknap(2);
+		lock_release(&ttlock);
+		break;
+	    case 2:
+		clocknap(2);
+		lock_acquire(&ttlock);
+		ttflag = true;
+		cv_signal(&ttcv, &ttlock);
+		lock_release(&ttlock);
+		break;
+	}
+	V(&ttdone);
+}
+
+static
+void
+timedtest_holder(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	lock_acquire(&ttlock);
+	V(&ttdone);
+	/* Hold it until the main thread is done timing out on it. */
+	P(&ttsem);
+	lock_release(&ttlock);
+	V(&ttdone);
+}
+
+static
+void
+timedtest_racer(void *junk, unsigned long num)
+{
+	unsigned long taken;
+	int i;
+
+	(void)junk;
+
+	taken = 0;
+	for (i=0; i<TT_ROUNDS; i++) {
+		if (num == TT_RACERS) {
+			V(&ttsem);
+			if (i % TT_RACERS == 0) {
+				clocknap(1);
+			}
+		}
+		else if (P_timed(&ttsem, 1) == 0) {
+			taken++;
+		}
+	}
+	lock_acquire(&ttlock);
+	tt_taken += taken;
+	lock_release(&ttlock);
+	V(&ttdone);
+}
+
+static
+bool
+timedtest_check(const char *what, int result, int want)
+{
+	if (result == want) {
+		return true;
+	}
+	kprintf("%s: got %s, expected %s\n", what,
+		result ? strerror(result) : "success",
+		want ? strerror(want) : "success");
+	return false;
+}
+
+int
+timedtest(int nargs, char **args)
+{
+	uint64_t start, mintime;
+	unsigned long left;
+	bool ok;
+	int i;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting timed wait test...\n");
+	ok = true;
+	/* Allow for starting partway through a tick. */
+	mintime = (uint64_t)(TT_TICKS - 1) * 1000000000 /
+		clock_nstoticks(1000000000);
+
+	/* Part 1: nothing comes. */
+	ok &= timedtest_check("P_timed(0)", P_timed(&ttsem, 0), ETIMEDOUT);
+	start = gettime_ns();
+	ok &= timedtest_check("P_timed", P_timed(&ttsem, TT_TICKS), ETIMEDOUT);
+	if (gettime_ns() - start < mintime) {
+		kprintf("P_timed: timed out early\n");
+		ok = false;
+	}
+
+	synchtest_fork("tt_holder", timedtest_holder, 0);
+	P(&ttdone);
+	ok &= timedtest_check("lock_acquire_timed(0)",
+			      lock_acquire_timed(&ttlock, 0), ETIMEDOUT);
+	start = gettime_ns();
+	ok &= timedtest_check("lock_acquire_timed",
+			      lock_acquire_timed(&ttlock, TT_TICKS), ETIMEDOUT);
+	if (gettime_ns() - start < mintime) {
+		kprintf("lock_acquire_timed: timed out early\n");
+		ok = false;
+	}
+	if (ttlock.lk_nwaiters != 0 || ttlock.lk_piwaiters != NULL) {
+		kprintf("lock_acquire_timed: left itself queued\n");
+		ok = false;
+	}
+	V(&ttsem);
+	P(&ttdone);
+
+	lock_acquire(&ttlock);
+	ok &= timedtest_check("cv_timedwait",
+			      cv_timedwait(&ttcv, &ttlock, TT_TICKS), ETIMEDOUT);
+	if (!lock_do_i_hold(&ttlock)) {
+		panic("cv_timedwait: returned without the lock\n");
+	}
+	lock_release(&ttlock);
+
+	/* Part 2: the wakeup comes first. */
+	synchtest_fork("tt_waker", timedtest_waker, 0);
+	ok &= timedtest_check("P_timed (woken)",
+			      P_timed(&ttsem, TT_LONGTICKS), 0);
+	P(&ttdone);
+
+	synchtest_fork("tt_waker", timedtest_waker, 1);
+	P(&ttdone);
+	ok &= timedtest_check("lock_acquire_timed (woken)",
+			      lock_acquire_timed(&ttlock, TT_LONGTICKS), 0);
+	lock_release(&ttlock);
+	P(&ttdone);
+
+	ttflag = false;
+	lock_acquire(&ttlock);
+	synchtest_fork("tt_waker", timedtest_waker, 2);
+	while (!ttflag) {
+		ok &= timedtest_check("cv_timedwait (signalled)",
+				      cv_timedwait(&ttcv, &ttlock, TT_LONGTICKS),
+				      0);
+	}
+	lock_release(&ttlock);
+	P(&ttdone);
+
+	/* Part 3: races. */
+	tt_taken = 0;
+	for (i=0; i<=TT_RACERS; i++) {
+		synchtest_fork("tt_racer", timedtest_racer, i);
+	}
+	for (i=0; i<=TT_RACERS; i++) {
+		P(&ttdone);
+	}
+	left = 0;
+	while (P_timed(&ttsem, 0) == 0) {
+		left++;
+	}
+	kprintf("Races: %lu taken, %lu left over, %d posted\n",
+		tt_taken, left, TT_ROUNDS);
+	if (tt_taken + left != TT_ROUNDS) {
+		ok = false;
+	}
+
+	kprintf("Timed wait test %s.\n", ok ? "done" : "FAILED");
+	return 0;
+}
+
+/*
+ * Barrier, latch and completion test. BT_THREADS threads wait at a
+ * completion until we open it, then go through BT_ROUNDS rounds of a
+ * barrier. Each counts itself in for the round before waiting, so
+ * everyone should see the full count on the way out, and exactly one
+ * thread per round should be told it was last. A latch tells us when
+ * they've all finished.
+ */
+
+#define BT_THREADS	8
+#define BT_ROUNDS	20
+
+static struct barrier btbarrier;
+static struct completion btgo = COMPLETION_INITIALIZER("btgo");
+static struct latch btdone = LATCH_INITIALIZER("btdone", 0);
+static struct spinlock btlock = SPINLOCK_INITIALIZER;
+static unsigned bt_arrived[BT_ROUNDS];
+static unsigned bt_last[BT_ROUNDS];
+static volatile bool bt_failed;
+
+static
+void
+barriertestthread(void *junk, unsigned long num)
+{
+	int r;
+
+	(void)junk;
+
+	completion_wait(&btgo);
+	for (r=0; r<BT_ROUNDS; r++) {
+		spinlock_acquire(&btlock);
+		bt_arrived[r]++;
+		spinlock_release(&btlock);
+
+		if (barrier_wait(&btbarrier)) {
+			spinlock_acquire(&btlock);
+			bt_last[r]++;
+			spinlock_release(&btlock);
+		}
+
+		if (bt_arrived[r] != BT_THREADS) {
+			kprintf("thread %lu: left round %d with %u of %d "
+				"arrived\n", num, r, bt_arrived[r],
+				BT_THREADS);
+			bt_failed = true;
+		}
+	}
+	latch_countdown(&btdone);
+}
+
+int
+barriertest(int nargs, char **args)
+{
+	int i, r, result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting barrier test...\n");
+
+	barrier_init(&btbarrier, "btbarrier", BT_THREADS);
+	latch_reset(&btdone, BT_THREADS);
+	for (r=0; r<BT_ROUNDS; r++) {
+		bt_arrived[r] = bt_last[r] = 0;
+	}
+	bt_failed = false;
+
+	for (i=0; i<BT_THREADS; i++) {
+		result = thread_fork("barriertest", NULL, barriertestthread,
+				     NULL, i);
+		if (result) {
+			panic("barriertest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	completion_signal(&btgo);
+	latch_wait(&btdone);
+
+	for (r=0; r<BT_ROUNDS; r++) {
+		if (bt_last[r] != 1) {
+			kprintf("Round %d: %u threads were last\n", r,
+				bt_last[r]);
+			bt_failed = true;
+		}
+	}
+
+	completion_reset(&btgo);
+	barrier_cleanup(&btbarrier);
+	kprintf("Barrier test %s.\n", bt_failed ? "FAILED" : "done");
+	return 0;
+}
+
+/*
+ * Join benchmark: the cost of waiting for JB_THREADS threads to
+ * finish, with one semaphore V and P per thread as the tests used to
+ * do it, and with a latch. The threads do different amounts of work
+ * so they finish one at a time; each time one does, the semaphore
+ * wakes the waiting thread up, to go back to sleep for the next,
+ * while the latch only wakes it once at the end. We report how many
+ * times the waiter was switched out, which is mostly those wakeups.
+ */
+
+#define JB_THREADS	16
+#define JB_ROUNDS	10
+#define JB_WORK		20000
+
+static struct semaphore jbsem = SEMAPHORE_INITIALIZER("joinbench", 0);
+static struct latch jblatch = LATCH_INITIALIZER("joinbench", 0);
+
+static
+void
+joinbenchthread(void *junk, unsigned long num)
+{
+	volatile unsigned j;
+	bool uselatch = num & 1;
+
+	(void)junk;
+
+	for (j=0; j<JB_WORK * (num >> 1); j++) {
+		/* nothing */
+	}
+	if (uselatch) {
+		latch_countdown(&jblatch);
+	}
+	else {
+		V(&jbsem);
+	}
+}
+
+static
+void
+joinbench_run(bool uselatch, unsigned *switches, uint64_t *time)
+{
+	unsigned before;
+	uint64_t start;
+	int i, result;
+
+	before = curthread->t_nswitches;
+	start = gettime_ns();
+	latch_reset(&jblatch, JB_THREADS);
+	for (i=0; i<JB_THREADS; i++) {
+		result = thread_fork("joinbench", NULL, joinbenchthread,
+				     NULL, (i << 1) | uselatch);
+		if (result) {
+			panic("joinbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	if (uselatch) {
+		latch_wait(&jblatch);
+	}
+	else {
+		for (i=0; i<JB_THREADS; i++) {
+			P(&jbsem);
+		}
+	}
+	*time += gettime_ns() - start;
+	*switches += curthread->t_nswitches - before;
+}
+
+int
+joinbench(int nargs, char **args)
+{
+	unsigned semswitches, latchswitches;
+	uint64_t semtime, latchtime;
+	int i;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting join benchmark (%d threads, %d rounds)...\n",
+		JB_THREADS, JB_ROUNDS);
+
+	semswitches = latchswitches = 0;
+	semtime = latchtime = 0;
+	for (i=0; i<JB_ROUNDS; i++) {
+		joinbench_run(false, &semswitches, &semtime);
+		joinbench_run(true, &latchswitches, &latchtime);
+	}
+
+	kprintf("            waiter switches   us per join\n");
+	kprintf("semaphore %17u %13lu\n", semswitches / JB_ROUNDS,
+		(unsigned long)(semtime / JB_ROUNDS / 1000));
+	kprintf("latch     %17u %13lu\n", latchswitches / JB_ROUNDS,
+		(unsigned long)(latchtime / JB_ROUNDS / 1000));
+
+	kprintf("Join benchmark done.\n");
+	return 0;
+}
+
+/*
+ * Handoff ping-pong benchmark. Two threads bounce a token back and
+ * forth through a pair of semaphores, first normally and then with
+ * both semaphores in handoff mode, and we report the time per round
+ * trip. HP_HOGS threads that do nothing but yield keep the run queues
+ * busy, so a woken thread that isn't handed the cpu has to wait its
+ * turn behind them.
+ *
+ * With handoff on, the thread V wakes should be the very next thread
+ * to run on the waker's cpu. Before each V the waker notes its cpu
+ * and that cpu's switch count, and the woken thread checks that it's
+ * on the same cpu one switch later. An interrupt can preempt either
+ * of them in between, so we only insist on this for most rounds.
+ */
+
+#define HP_ROUNDS	1000
+#define HP_HOGS		4
+
+static struct semaphore hpping = SEMAPHORE_INITIALIZER("hpping", 0);
+static struct semaphore hppong = SEMAPHORE_INITIALIZER("hppong", 0);
+static struct latch hpdone = LATCH_INITIALIZER("hpdone", 0);
+static volatile bool hp_stop;
+static struct cpu *volatile hp_cpu;
+static volatile unsigned hp_mark;
+static unsigned hp_next;	/* Rounds where the woken thread ran next */
+
+static
+void
+handofftest_hog(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	while (!hp_stop) {
+		thread_yield();
+	}
+	latch_countdown(&hpdone);
+}
+
+static
+void
+handofftest_pong(void *junk, unsigned long rounds)
+{
+	unsigned long i;
+	int spl;
+
+	(void)junk;
+
+	for (i=0; i<rounds; i++) {
+		P(&hpping);
+		spl = splhigh();
+		if (curcpu->c_self == hp_cpu &&
+		    curcpu->c_nswitches == hp_mark + 1) {
+			hp_next++;
+		}
+		splx(spl);
+		V(&hppong);
+	}
+	latch_countdown(&hpdone);
+}
+
+static
+uint64_t
+handofftest_run(bool handoff, unsigned *next)
+{
+	uint64_t start, time;
+	int i, spl;
+
+	sem_sethandoff(&hpping, handoff);
+	sem_sethandoff(&hppong, handoff);
+	hp_stop = false;
+	hp_next = 0;
+	latch_reset(&hpdone, HP_HOGS + 1);
+	for (i=0; i<HP_HOGS; i++) {
+		synchtest_fork("hp_hog", handofftest_hog, i);
+	}
+	synchtest_fork("hp_pong", handofftest_pong, HP_ROUNDS);
+
+	start = gettime_ns();
+	for (i=0; i<HP_ROUNDS; i++) {
+		spl = splhigh();
+		hp_cpu = curcpu->c_self;
+		hp_mark = curcpu->c_nswitches;
+		splx(spl);
+		V(&hpping);
+		P(&hppong);
+	}
+	time = gettime_ns() - start;
+
+	hp_stop = true;
+	latch_wait(&hpdone);
+	*next = hp_next;
+	return time;
+}
+
+int
+handofftest(int nargs, char **args)
+{
+	uint64_t normaltime, handofftime;
+	unsigned normalnext, handoffnext;
+	bool ok;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting handoff ping-pong benchmark (%d rounds, "
+		"%d hogs)...\n", HP_ROUNDS, HP_HOGS);
+
+	normaltime = handofftest_run(false, &normalnext);
+	handofftime = handofftest_run(true, &handoffnext);
+	sem_sethandoff(&hpping, false);
+	sem_sethandoff(&hppong, false);
+
+	kprintf("          ns per round trip   woken thread ran next\n");
+	kprintf("normal   %18lu %19u/%u\n",
+		(unsigned long)(normaltime / HP_ROUNDS), normalnext,
+		HP_ROUNDS);
+	kprintf("handoff  %18lu %19u/%u\n",
+		(unsigned long)(handofftime / HP_ROUNDS), handoffnext,
+		HP_ROUNDS);
+
+	ok = handoffnext >= HP_ROUNDS * 3 / 4;
+	if (!ok) {
+		kprintf("Handoff didn't run the woken thread next\n");
+	}
+	kprintf("Handoff benchmark %s.\n", ok ? "done" : "FAILED");
+	return 0;
+}
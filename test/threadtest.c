@@ -31,7 +31,9 @@
  * Thread test code.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -144,3 +146,67 @@ threadtest2(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Thread creation/teardown benchmark.
+ *
+ * Fork a trivial thread and wait for it, over and over, and report
+ * the average time per round trip. This is dominated by thread_fork,
+ * the context switches, and thread_exit/exorcise, so it shows the
+ * effect of the per-cpu thread cache.
+ */
+
+#define FORKBENCH_ROUNDS  1000
+
+static
+void
+forkbenchthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	V(tsem);
+}
+
+int
+threadforkbench(int nargs, char **args)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint64_t total;
+	int i, rounds, result;
+
+	rounds = FORKBENCH_ROUNDS;
+	if (nargs > 1) {
+		rounds = atoi(args[1]);
+	}
+	if (rounds <= 0) {
+		kprintf("Usage: tt4 [rounds]\n");
+		return EINVAL;
+	}
+
+	init_sem();
+	kprintf("Starting thread fork benchmark (%d rounds)...\n", rounds);
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<rounds; i++) {
+		result = thread_fork("forkbench", NULL,
+				     forkbenchthread, NULL, i);
+		if (result) {
+			panic("threadforkbench: thread_fork failed %s)\n",
+			      strerror(result));
+		}
+		P(tsem);
+	}
+	gettime(&secs2, &nsecs2);
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	total = (uint64_t)secs * 1000000000 + nsecs;
+	kprintf("%d fork/exit round trips in %lu.%09lu seconds\n",
+		rounds, (unsigned long)secs, (unsigned long)nsecs);
+	kprintf("Average: %lu ns per thread\n",
+		(unsigned long)(total / rounds));
+	kprintf("Thread fork benchmark done.\n");
+
+	return 0;
+}
@@ -34,14 +34,14 @@
 #include <clock.h>
 #include <thread.h>
 #include <lamebus/ltimer.h>
+#include <mainbus.h>
 #include <current.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * Callouts let kernel code schedule a function to run at a given
+ * timer tick in the future; clocknap and clocksleep are built on them.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -55,23 +55,42 @@
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * Callout wheel.
+ *
+ * Pending callouts are hashed by expiry tick into CALLOUT_WHEELSIZE
+ * buckets. Each timer tick looks only at the bucket for the current
+ * tick; callouts more than one revolution away stay put until their
+ * tick comes around. Ticks are 32-bit and compared with wraparound.
  */
-static struct wchan *lbolt;
+#define CALLOUT_WHEELSIZE	256	/* must be a power of 2 */
+#define CALLOUT_WHEELMASK	(CALLOUT_WHEELSIZE - 1)
+
+static struct spinlock callout_lock = SPINLOCK_INITIALIZER;
+static struct callout *callout_wheel[CALLOUT_WHEELSIZE];
+static uint32_t callout_ticks;	/* Timer ticks while callouts pending */
+static unsigned callout_npending;	/* Callouts on the wheel */
+
 /*
- * Once every LT_GRANULARITY usec, everything on minibolt is awakenened by CPU 0
+ * The timerclock device, and whether it's currently interrupting.
+ * There's no point in taking timer interrupts with no callouts
+ * pending, so the device is stopped while the wheel is empty. While
+ * it is stopped callout_ticks doesn't advance; that's fine, because
+ * deadlines are only ever set relative to the current tick.
  */
-static struct wchan *minibolt;
+static void (*timerclock_setrunning)(void *data, bool running);
+static void *timerclock_data;
+static bool timerclock_running;
 
-/* 
- * number of minibolts per second
+/*
+ * number of timer ticks per second
  */
-#define MINI_PER_SECOND (1000000/LT_GRANULARITY);
+#define TICKS_PER_SECOND	(1000000 / LT_GRANULARITY)
 
 /*
- * minibolt countdown
+ * Wait channel used by clocknap/clocksleep. Sleepers are woken
+ * individually by their own callout, never broadcast.
  */
-static int minicount;
+static struct wchan *napchan;
 
 /*
  * Setup.
@@ -79,17 +98,115 @@ static int minicount;
 void
 hardclock_bootstrap(void)
 {
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	napchan = wchan_create("clocknap");
+	if (napchan == NULL) {
+		panic("Couldn't create clocknap wchan\n");
+	}
+	/* we assume TICKS_PER_SECOND > 0 */
+	KASSERT(TICKS_PER_SECOND > 0);
+}
+
+/*
+ * Remove CO from its bucket. Callout lock must be held.
+ */
+static
+void
+callout_unlink(struct callout *co)
+{
+	KASSERT(spinlock_do_i_hold(&callout_lock));
+	KASSERT(co->co_pending);
+
+	if (co->co_prev != NULL) {
+		co->co_prev->co_next = co->co_next;
 	}
-	minibolt = wchan_create("minibolt");
-	if (minibolt == NULL) {
-		panic("Couldn't create minibolt\n");
+	else {
+		callout_wheel[co->co_expires & CALLOUT_WHEELMASK] =
+			co->co_next;
 	}
-	minicount = MINI_PER_SECOND;
-	/* we assume MINI_PER_SECOND > 0 */
-	KASSERT(minicount > 0);
+	if (co->co_next != NULL) {
+		co->co_next->co_prev = co->co_prev;
+	}
+	co->co_next = co->co_prev = NULL;
+	co->co_pending = false;
+	callout_npending--;
+}
+
+void
+callout_init(struct callout *co, void (*func)(void *), void *arg)
+{
+	co->co_next = co->co_prev = NULL;
+	co->co_expires = 0;
+	co->co_pending = false;
+	co->co_func = func;
+	co->co_arg = arg;
+}
+
+void
+callout_schedule(struct callout *co, unsigned ticks)
+{
+	struct callout **bucket;
+
+	KASSERT(ticks > 0);
+
+	spinlock_acquire(&callout_lock);
+	if (co->co_pending) {
+		callout_unlink(co);
+	}
+	co->co_expires = callout_ticks + ticks;
+	bucket = &callout_wheel[co->co_expires & CALLOUT_WHEELMASK];
+	co->co_prev = NULL;
+	co->co_next = *bucket;
+	if (*bucket != NULL) {
+		(*bucket)->co_prev = co;
+	}
+	*bucket = co;
+	co->co_pending = true;
+	callout_npending++;
+	if (!timerclock_running && timerclock_setrunning != NULL) {
+		timerclock_running = true;
+		timerclock_setrunning(timerclock_data, true);
+	}
+	spinlock_release(&callout_lock);
+}
+
+bool
+callout_cancel(struct callout *co)
+{
+	bool ret;
+
+	spinlock_acquire(&callout_lock);
+	ret = co->co_pending;
+	if (ret) {
+		callout_unlink(co);
+	}
+	spinlock_release(&callout_lock);
+	return ret;
+}
+
+bool
+callout_pending(struct callout *co)
+{
+	bool ret;
+
+	spinlock_acquire(&callout_lock);
+	ret = co->co_pending;
+	spinlock_release(&callout_lock);
+	return ret;
+}
+
+/*
+ * Register the device that calls timerclock().
+ */
+void
+timerclock_attach(void (*setrunning)(void *data, bool running), void *data)
+{
+	spinlock_acquire(&callout_lock);
+	KASSERT(timerclock_setrunning == NULL);
+	timerclock_setrunning = setrunning;
+	timerclock_data = data;
+	timerclock_running = callout_npending > 0;
+	setrunning(data, timerclock_running);
+	spinlock_release(&callout_lock);
 }
 
 /*
@@ -99,59 +216,184 @@ hardclock_bootstrap(void)
 void
 timerclock(void)
 {
-	/* Broadcast on minibolt */
-	wchan_wakeall(minibolt);
-	/* Broadcast on lbolt if a second has elapsed */
-	if (--minicount <= 0) {
-	  minicount = MINI_PER_SECOND;
-	  wchan_wakeall(lbolt);
+	struct callout *co, *next, *expired;
+	void (*func)(void *);
+	void *arg;
+
+	/*
+	 * Pull the expired callouts off the current bucket onto a
+	 * private list, then call them without the lock held so they
+	 * can schedule or cancel callouts themselves.
+	 */
+	expired = NULL;
+	spinlock_acquire(&callout_lock);
+	callout_ticks++;
+	co = callout_wheel[callout_ticks & CALLOUT_WHEELMASK];
+	while (co != NULL) {
+		next = co->co_next;
+		if ((int32_t)(co->co_expires - callout_ticks) <= 0) {
+			callout_unlink(co);
+			co->co_next = expired;
+			expired = co;
+		}
+		co = next;
+	}
+	if (callout_npending == 0 && timerclock_running) {
+		timerclock_running = false;
+		timerclock_setrunning(timerclock_data, false);
+	}
+	spinlock_release(&callout_lock);
+
+	/*
+	 * Once co_pending is clear the owner may reuse the callout as
+	 * soon as its function runs, so fetch everything first.
+	 */
+	while (expired != NULL) {
+		func = expired->co_func;
+		arg = expired->co_arg;
+		expired = expired->co_next;
+		func(arg);
+	}
+}
+
+/*
+ * Tickless operation.
+ *
+ * c_tickperiod is the number of hardclock periods the timer is
+ * currently set for: 1 normally, more while the cpu runs a single
+ * thread, 0 (off) while it is idle. It is protected by the runqueue
+ * lock, because other cpus check it when adding threads.
+ *
+ * A deferred tick is not put off past the next migration check, so
+ * that a cpu running one thread still pulls work from busier cpus.
+ */
+void
+hardclock_stop(void)
+{
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	if (curcpu->c_tickperiod != 0) {
+		curcpu->c_tickperiod = 0;
+		mainbus_hardclock_set(0);
+	}
+}
+
+void
+hardclock_defer(unsigned nticks)
+{
+	unsigned tomigrate;
+
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	tomigrate = MIGRATE_HARDCLOCKS -
+		(curcpu->c_hardclocks % MIGRATE_HARDCLOCKS);
+	if (nticks > tomigrate) {
+		nticks = tomigrate;
+	}
+	if (nticks > 1) {
+		curcpu->c_tickperiod = nticks;
+		mainbus_hardclock_set(nticks);
+	}
+}
+
+void
+hardclock_resume(void)
+{
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	if (curcpu->c_tickperiod != 1) {
+		curcpu->c_tickperiod = 1;
+		mainbus_hardclock_set(1);
 	}
 }
 
 /*
  * This is called HZ times a second (on each processor) by the timer
- * code.
+ * code, or less often if the tick was deferred; in that case all the
+ * periods that went by are accounted for at once.
  */
 void
 hardclock(void)
 {
+	unsigned elapsed, i;
+
 	/*
 	 * Collect statistics here as desired.
 	 */
 
-	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
-		schedule();
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	elapsed = curcpu->c_tickperiod;
+	if (elapsed == 0) {
+		/* The timer was off and wrapped around; call it one. */
+		elapsed = 1;
 	}
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
+	/* The interrupt code has already reset the timer. */
+	curcpu->c_tickperiod = 1;
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	for (i=0; i<elapsed; i++) {
+		curcpu->c_hardclocks++;
+		if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
+			schedule();
+		}
+		if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
+			thread_consider_migration();
+		}
 	}
-	thread_yield();
+	thread_timeslice(elapsed);
 }
 
 /*
- * Suspend execution for n seconds.
+ * Callout function for clocknap: wake the thread that went to sleep.
  */
+static
 void
-clocksleep(int num_secs)
+clocknap_wakeup(void *arg)
 {
-  while (num_secs > 0) {
-    wchan_lock(lbolt);
-    wchan_sleep(lbolt);
-    num_secs--;
-  }
+	wchan_wakethread(napchan, arg);
 }
 
 /*
  * Suspend execution for num_ticks timer ticks.
  *  (one tick every LT_GRANULARITY usec)
+ *
+ * The callout lives on our stack. It cannot fire before we are on the
+ * wchan, because we schedule it with the wchan locked and the wakeup
+ * needs that lock; and we cannot return before it has fired, because
+ * nothing else wakes threads on napchan.
  */
 void
 clocknap(int num_ticks)
 {
-  while (num_ticks > 0) {
-    wchan_lock(minibolt);
-    wchan_sleep(minibolt);
-    num_ticks--;
-  }
+	struct callout co;
+
+	if (num_ticks <= 0) {
+		return;
+	}
+
+	callout_init(&co, clocknap_wakeup, curthread);
+	wchan_lock(napchan);
+	callout_schedule(&co, num_ticks);
+	wchan_sleep(napchan);
+	KASSERT(!callout_pending(&co));
+}
+
+unsigned
+clock_nstoticks(uint64_t ns)
+{
+	const uint64_t nspertick = (uint64_t)LT_GRANULARITY * 1000;
+
+	return (ns + nspertick - 1) / nspertick;
+}
+
+/*
+ * Suspend execution for n seconds.
+ */
+void
+clocksleep(int num_secs)
+{
+	if (num_secs <= 0) {
+		return;
+	}
+	clocknap(num_secs * TICKS_PER_SECOND);
 }
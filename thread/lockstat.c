@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Lock contention statistics. See <lockstat.h>.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <lockstat.h>
+
+/*
+ * The table is a fixed-size open-addressed hash table, so lookups
+ * never allocate memory. Entries are never removed; a reset only
+ * zeroes the counters.
+ */
+#define LOCKSTAT_SIZE		256
+#define LOCKSTAT_NAMELEN	24
+
+struct lockstat {
+	bool ls_used;
+	const void *ls_site;		/* Spinlock call site, or NULL */
+	char ls_name[LOCKSTAT_NAMELEN];	/* Sleep lock name, if no site */
+	unsigned ls_acquires;		/* Times acquired */
+	unsigned ls_contended;		/* ...that had to wait */
+	uint64_t ls_waittime;		/* Total time waiting */
+	uint64_t ls_maxwait;		/* Longest wait */
+	uint64_t ls_holdtime;		/* Total time held */
+	uint64_t ls_maxhold;		/* Longest hold */
+};
+
+static struct lockstat lockstats[LOCKSTAT_SIZE];
+
+/*
+ * This can't be a spinlock, since spinlock_acquire calls us; it's
+ * the bare machine-dependent lock word, with interrupts off while
+ * it's held.
+ */
+static volatile spinlock_data_t lockstats_lock = SPINLOCK_DATA_INITIALIZER;
+
+static
+void
+lockstats_acquire(void)
+{
+	splraise(IPL_NONE, IPL_HIGH);
+	while (spinlock_data_get(&lockstats_lock) != 0 ||
+	       spinlock_data_testandset(&lockstats_lock) != 0) {
+		/* spin */
+	}
+}
+
+static
+void
+lockstats_release(void)
+{
+	spinlock_data_set(&lockstats_lock, 0);
+	spllower(IPL_HIGH, IPL_NONE);
+}
+
+/*
+ * Check if the (possibly truncated) name in LS is NAME.
+ */
+static
+bool
+lockstat_namematch(const struct lockstat *ls, const char *name)
+{
+	unsigned j;
+
+	for (j = 0; j < LOCKSTAT_NAMELEN - 1; j++) {
+		if (ls->ls_name[j] != name[j]) {
+			return false;
+		}
+		if (name[j] == 0) {
+			return true;
+		}
+	}
+	return true;
+}
+
+/*
+ * Find the entry for SITE or NAME (the other is NULL), starting at
+ * slot HASH, making it if it's not there yet.
+ */
+static
+struct lockstat *
+lockstat_lookup(unsigned hash, const void *site, const char *name)
+{
+	struct lockstat *ls;
+	unsigned i, j;
+
+	lockstats_acquire();
+	for (i = 0; i < LOCKSTAT_SIZE; i++) {
+		ls = &lockstats[(hash + i) % LOCKSTAT_SIZE];
+		if (!ls->ls_used) {
+			/* Empty slot: claim it. */
+			ls->ls_used = true;
+			ls->ls_site = site;
+			j = 0;
+			if (name != NULL) {
+				for (; j < LOCKSTAT_NAMELEN - 1 &&
+					     name[j] != 0; j++) {
+					ls->ls_name[j] = name[j];
+				}
+			}
+			ls->ls_name[j] = 0;
+			lockstats_release();
+			return ls;
+		}
+		if (ls->ls_site != site) {
+			continue;
+		}
+		if (site != NULL || lockstat_namematch(ls, name)) {
+			lockstats_release();
+			return ls;
+		}
+	}
+	lockstats_release();
+	return NULL;
+}
+
+struct lockstat *
+lockstat_name(const char *name)
+{
+	unsigned hash, j;
+
+	hash = 0;
+	for (j = 0; j < LOCKSTAT_NAMELEN - 1 && name[j] != 0; j++) {
+		hash = hash * 31 + (unsigned char)name[j];
+	}
+	return lockstat_lookup(hash, NULL, name);
+}
+
+struct lockstat *
+lockstat_site(const void *site)
+{
+	KASSERT(site != NULL);
+	return lockstat_lookup((uintptr_t)site >> 2, site, NULL);
+}
+
+/*
+ * Time from THEN to NOW, or 0 if the clock wasn't running at THEN.
+ */
+static
+uint64_t
+lockstat_interval(uint64_t then, uint64_t now)
+{
+	if (then == 0 || now < then) {
+		return 0;
+	}
+	return now - then;
+}
+
+void
+lockstat_acquired(struct lockstat *ls, bool contended,
+		  uint64_t start, uint64_t now)
+{
+	uint64_t waittime;
+
+	if (ls == NULL) {
+		return;
+	}
+	waittime = lockstat_interval(start, now);
+
+	lockstats_acquire();
+	ls->ls_acquires++;
+	if (contended) {
+		ls->ls_contended++;
+		ls->ls_waittime += waittime;
+		if (waittime > ls->ls_maxwait) {
+			ls->ls_maxwait = waittime;
+		}
+	}
+	lockstats_release();
+}
+
+void
+lockstat_released(struct lockstat *ls, uint64_t acquired, uint64_t now)
+{
+	uint64_t holdtime;
+
+	if (ls == NULL) {
+		return;
+	}
+	holdtime = lockstat_interval(acquired, now);
+
+	lockstats_acquire();
+	ls->ls_holdtime += holdtime;
+	if (holdtime > ls->ls_maxhold) {
+		ls->ls_maxhold = holdtime;
+	}
+	lockstats_release();
+}
+
+/*
+ * Print the TOPN hottest locks: the ones that made threads (or cpus)
+ * wait longest in total, with the number of contended acquires to
+ * break ties.
+ */
+void
+lockstat_print(unsigned topn)
+{
+	struct lockstat *copy, *ls, *best, tmp;
+	char name[LOCKSTAT_NAMELEN];
+	unsigned i, n, count;
+
+	/* Copy it out so we don't kprintf holding the table lock. */
+	copy = kmalloc(LOCKSTAT_SIZE * sizeof(struct lockstat));
+	if (copy == NULL) {
+		kprintf("lockstat: Out of memory\n");
+		return;
+	}
+	lockstats_acquire();
+	count = 0;
+	for (i = 0; i < LOCKSTAT_SIZE; i++) {
+		if (lockstats[i].ls_used && lockstats[i].ls_acquires > 0) {
+			copy[count++] = lockstats[i];
+		}
+	}
+	lockstats_release();
+
+	kprintf("lock                   acquires  contended   wait us"
+		"    max us   hold us    max us\n");
+	for (n = 0; n < topn && n < count; n++) {
+		/* Selection sort, just as far as we need to go. */
+		best = &copy[n];
+		for (i = n + 1; i < count; i++) {
+			ls = &copy[i];
+			if (ls->ls_waittime > best->ls_waittime ||
+			    (ls->ls_waittime == best->ls_waittime &&
+			     ls->ls_contended > best->ls_contended)) {
+				best = ls;
+			}
+		}
+		tmp = copy[n];
+		copy[n] = *best;
+		*best = tmp;
+
+		ls = &copy[n];
+		if (ls->ls_site != NULL) {
+			snprintf(name, sizeof(name), "spinlock@%p",
+				 ls->ls_site);
+		}
+		else {
+			strcpy(name, ls->ls_name);
+		}
+		kprintf("%-22s %9u %10u %9lu %9lu %9lu %9lu\n", name,
+			ls->ls_acquires, ls->ls_contended,
+			(unsigned long)(ls->ls_waittime / 1000),
+			(unsigned long)(ls->ls_maxwait / 1000),
+			(unsigned long)(ls->ls_holdtime / 1000),
+			(unsigned long)(ls->ls_maxhold / 1000));
+	}
+
+	kfree(copy);
+}
+
+void
+lockstat_reset(void)
+{
+	struct lockstat *ls;
+	unsigned i;
+
+	lockstats_acquire();
+	for (i = 0; i < LOCKSTAT_SIZE; i++) {
+		ls = &lockstats[i];
+		ls->ls_acquires = 0;
+		ls->ls_contended = 0;
+		ls->ls_waittime = 0;
+		ls->ls_maxwait = 0;
+		ls->ls_holdtime = 0;
+		ls->ls_maxhold = 0;
+	}
+	lockstats_release();
+}
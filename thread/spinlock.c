@@ -35,6 +35,8 @@
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <atomic.h>
+#include <clock.h>	/* for gettime_ns */
 #include <current.h>	/* for curcpu */
 
 /*
@@ -48,8 +50,13 @@
 void
 spinlock_init(struct spinlock *lk)
 {
-	spinlock_data_set(&lk->lk_lock, 0);
+	lk->lk_ticket = 0;
+	lk->lk_serving = 0;
 	lk->lk_holder = NULL;
+#if OPT_LOCKSTAT
+	lk->lk_stat = NULL;
+	lk->lk_acquiretime = 0;
+#endif
 }
 
 /*
@@ -59,20 +66,25 @@ void
 spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
-	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+	KASSERT(lk->lk_ticket == lk->lk_serving);
 }
 
 /*
  * Get the lock.
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
- * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * might come back to this lock and deadlock), then take a ticket with
+ * a machine-level atomic operation and wait for our turn.
  */
 void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+	unsigned ticket;
+#if OPT_LOCKSTAT
+	bool contended = false;
+	uint64_t start = 0;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,27 +99,30 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&lk->lk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
-			continue;
-		}
-		break;
+	/*
+	 * The atomic add is the only write waiting cpus make; after
+	 * that we just read lk_serving until the holders ahead of us
+	 * have gone through. Since nobody can jump the queue, no cpu
+	 * waits for more than the cpus ahead of it, however busy the
+	 * lock is. (Ticket numbers wrap around harmlessly.)
+	 */
+	ticket = atomic_add(&lk->lk_ticket, 1);
+#if OPT_LOCKSTAT
+	if (lk->lk_serving != ticket) {
+		contended = true;
+		start = gettime_ns();
+	}
+#endif
+	while (lk->lk_serving != ticket) {
+		/* spin */
 	}
 
 	lk->lk_holder = mycpu;
+#if OPT_LOCKSTAT
+	lk->lk_stat = lockstat_site(__builtin_return_address(0));
+	lk->lk_acquiretime = gettime_ns();
+	lockstat_acquired(lk->lk_stat, contended, start, lk->lk_acquiretime);
+#endif
 }
 
 /*
@@ -121,8 +136,12 @@ spinlock_release(struct spinlock *lk)
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+#if OPT_LOCKSTAT
+	lockstat_released(lk->lk_stat, lk->lk_acquiretime, gettime_ns());
+#endif
 	lk->lk_holder = NULL;
-	spinlock_data_set(&lk->lk_lock, 0);
+	/* Only the holder writes this, so it needn't be atomic. */
+	lk->lk_serving = lk->lk_serving + 1;
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -33,75 +33,212 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <atomic.h>
 #include <wchan.h>
 #include <thread.h>
+#include <threadprivate.h>
 #include <current.h>
+#include <cpu.h>
+#include <clock.h>
 #include <synch.h>
 
 ////////////////////////////////////////////////////////////
 //
-// Semaphore.
+// Timeouts.
 
-	struct semaphore *
-sem_create(const char *name, int initial_count)
+/*
+ * A timed wait arms a callout, on the waiting thread's stack, for the
+ * whole operation. When it fires it sets tw_expired and wakes the
+ * thread if it's asleep on tw_wchan. Waiters check tw_expired with
+ * the wchan locked just before sleeping, so an expiry can't slip in
+ * between the check and the sleep; and they always recheck what they
+ * were waiting for first, so a real wakeup that races the timeout
+ * isn't thrown away.
+ *
+ * The callout may be running on another cpu when the waiter cancels
+ * it, so the waiter waits for tw_done before letting it go out of
+ * scope. That wait is short and bounded: see timedwait_stop.
+ */
+struct timedwait {
+	struct callout tw_callout;
+	struct wchan *tw_wchan;
+	struct thread *tw_thread;
+	volatile bool tw_expired;	/* The time is up */
+	volatile bool tw_woke;		/* ...and the callout woke us */
+	volatile bool tw_done;		/* The callout is done with us */
+};
+
+static
+void
+timedwait_expire(void *data)
 {
-	struct semaphore *sem;
+	struct timedwait *tw = data;
 
-	KASSERT(initial_count >= 0);
+	tw->tw_expired = true;
+	tw->tw_woke = wchan_wakethread(tw->tw_wchan, tw->tw_thread);
+	tw->tw_done = true;
+}
 
-	sem = kmalloc(sizeof(struct semaphore));
-	if (sem == NULL) {
-		return NULL;
-	}
+static
+void
+timedwait_start(struct timedwait *tw, struct wchan *wc, unsigned ticks)
+{
+	KASSERT(ticks > 0);
 
-	sem->sem_name = kstrdup(name);
-	if (sem->sem_name == NULL) {
-		kfree(sem);
-		return NULL;
-	}
+	tw->tw_wchan = wc;
+	tw->tw_thread = curthread;
+	tw->tw_expired = false;
+	tw->tw_woke = false;
+	tw->tw_done = false;
+	callout_init(&tw->tw_callout, timedwait_expire, tw);
+	callout_schedule(&tw->tw_callout, ticks);
+}
 
-	sem->sem_wchan = wchan_create(sem->sem_name);
-	if (sem->sem_wchan == NULL) {
-		kfree(sem->sem_name);
-		kfree(sem);
-		return NULL;
+/*
+ * Cancel the callout, and if it has already been taken off the wheel,
+ * wait until it's done with TW.
+ *
+ * Spinning here is safe and brief. timerclock unlinks the callout and
+ * calls timedwait_expire in the same timer interrupt, with interrupts
+ * off, and neither it nor the callouts queued ahead of it in that
+ * tick can sleep: they only take spinlocks to wake threads. So we
+ * wait at most for one tick's worth of wakeups on the other cpu. If
+ * the interrupt was on our own cpu it has finished before we get
+ * here, and tw_done is already set.
+ */
+static
+void
+timedwait_stop(struct timedwait *tw)
+{
+	if (!callout_cancel(&tw->tw_callout)) {
+		while (!tw->tw_done) {
+			/* nothing */
+		}
 	}
+}
 
-	spinlock_init(&sem->sem_lock);
-	sem->sem_count = initial_count;
+////////////////////////////////////////////////////////////
+//
+// Semaphore.
 
-	return sem;
+/*
+ * The count lives in the upper bits of sem_count, so that P and V can
+ * update it with one compare-and-swap and skip the spinlock when
+ * nobody is waiting. The low bit, SEM_WAITERS, is set (under the
+ * spinlock) by any thread about to sleep in P; while it's set, V
+ * takes the spinlock and does a wakeup. The bit is cleared when the
+ * last waiter leaves.
+ *
+ * Because a V that doesn't see SEM_WAITERS never touches the
+ * semaphore again after its compare-and-swap, it's safe for the
+ * thread it lets through P to destroy the semaphore right away.
+ */
+#define SEM_WAITERS	1
+#define SEM_ONE		2
+
+	void
+sem_init(struct semaphore *sem, const char *name, int initial_count)
+{
+	KASSERT(sem != NULL);
+	KASSERT(initial_count >= 0);
+
+	sem->sem_name = name;
+	wchan_init(&sem->sem_wchan, name);
+	spinlock_init(&sem->sem_lock);
+	sem->sem_count = (unsigned)initial_count * SEM_ONE;
+	sem->sem_nwaiters = 0;
+	sem->sem_handoff = false;
 }
 
 	void
-sem_destroy(struct semaphore *sem)
+sem_cleanup(struct semaphore *sem)
 {
 	KASSERT(sem != NULL);
 
 	/* wchan_cleanup will assert if anyone's waiting on it */
+	KASSERT(sem->sem_nwaiters == 0);
 	spinlock_cleanup(&sem->sem_lock);
-	wchan_destroy(sem->sem_wchan);
-	kfree(sem->sem_name);
+	wchan_cleanup(&sem->sem_wchan);
+}
+
+	struct semaphore *
+sem_create(const char *name, int initial_count)
+{
+	struct semaphore *sem;
+
+	sem = kmalloc(sizeof(struct semaphore));
+	if (sem == NULL) {
+		return NULL;
+	}
+	sem_init(sem, name, initial_count);
+	return sem;
+}
+
+	void
+sem_destroy(struct semaphore *sem)
+{
+	sem_cleanup(sem);
 	kfree(sem);
 }
 
-	void 
-P(struct semaphore *sem)
+/*
+ * Fast path: if the count isn't 0, just take one.
+ */
+static
+bool
+P_try(struct semaphore *sem)
 {
-	KASSERT(sem != NULL);
+	unsigned count, new;
 
-	/*
-	 * May not block in an interrupt handler.
-	 *
-	 * For robustness, always check, even if we can actually
-	 * complete the P without blocking.
-	 */
-	KASSERT(curthread->t_in_interrupt == false);
+	count = sem->sem_count;
+	while (count >= SEM_ONE) {
+		new = atomic_cas(&sem->sem_count, count, count - SEM_ONE);
+		if (new == count) {
+			return true;
+		}
+		count = new;
+	}
+	return false;
+}
+
+/*
+ * Slow path: wait for the count to come up, or for TW (if not NULL)
+ * to expire.
+ */
+static
+int
+P_slow(struct semaphore *sem, struct timedwait *tw)
+{
+	unsigned count, new;
+	int result;
 
+	result = 0;
 	spinlock_acquire(&sem->sem_lock);
-	while (sem->sem_count == 0) {
+	sem->sem_nwaiters++;
+	while (1) {
+		count = sem->sem_count;
+		if (count >= SEM_ONE) {
+			new = count - SEM_ONE;
+			if (sem->sem_nwaiters == 1) {
+				/* We're the last waiter. */
+				new &= ~SEM_WAITERS;
+			}
+			if (atomic_cas(&sem->sem_count, count, new) == count) {
+				break;
+			}
+			continue;
+		}
+		if ((count & SEM_WAITERS) == 0) {
+			/* Make V come through the slow path. */
+			if (atomic_cas(&sem->sem_count, count,
+				       count | SEM_WAITERS) != count) {
+				continue;
+			}
+		}
+
 		/*
 		 * Bridge to the wchan lock, so if someone else comes
 		 * along in V right this instant the wakeup can't go
@@ -118,28 +255,112 @@ P(struct semaphore *sem)
 		 * Exercise: how would you implement strict FIFO
 		 * ordering?
 		 */
-		wchan_lock(sem->sem_wchan);
+		wchan_lock(&sem->sem_wchan);
+		if (tw != NULL && tw->tw_expired) {
+			wchan_unlock(&sem->sem_wchan);
+			result = ETIMEDOUT;
+			break;
+		}
 		spinlock_release(&sem->sem_lock);
-		wchan_sleep(sem->sem_wchan);
+		wchan_sleep(&sem->sem_wchan);
 
 		spinlock_acquire(&sem->sem_lock);
 	}
-	KASSERT(sem->sem_count > 0);
-	sem->sem_count--;
+	sem->sem_nwaiters--;
+	if (result && sem->sem_nwaiters == 0) {
+		/* We were the last waiter, but didn't get to clear it. */
+		do {
+			count = sem->sem_count;
+		} while (atomic_cas(&sem->sem_count, count,
+				    count & ~SEM_WAITERS) != count);
+	}
 	spinlock_release(&sem->sem_lock);
+	return result;
+}
+
+	void 
+P(struct semaphore *sem)
+{
+	KASSERT(sem != NULL);
+
+	/*
+	 * May not block in an interrupt handler.
+	 *
+	 * For robustness, always check, even if we can actually
+	 * complete the P without blocking.
+	 */
+	KASSERT(curthread->t_in_interrupt == false);
+
+	if (P_try(sem)) {
+		return;
+	}
+	P_slow(sem, NULL);
+}
+
+	int
+P_timed(struct semaphore *sem, unsigned ticks)
+{
+	struct timedwait tw;
+	int result;
+
+	KASSERT(sem != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	if (P_try(sem)) {
+		return 0;
+	}
+	if (ticks == 0) {
+		return ETIMEDOUT;
+	}
+	timedwait_start(&tw, &sem->sem_wchan, ticks);
+	result = P_slow(sem, &tw);
+	timedwait_stop(&tw);
+	return result;
 }
 
 	void
 V(struct semaphore *sem)
 {
+	unsigned count, old;
+
 	KASSERT(sem != NULL);
 
+	/* Fast path: if nobody's waiting, just bump the count. */
+	count = sem->sem_count;
+	while ((count & SEM_WAITERS) == 0) {
+		KASSERT(count + SEM_ONE > count);
+		old = atomic_cas(&sem->sem_count, count, count + SEM_ONE);
+		if (old == count) {
+			return;
+		}
+		count = old;
+	}
+
 	spinlock_acquire(&sem->sem_lock);
 
-	sem->sem_count++;
-	KASSERT(sem->sem_count > 0);
-	wchan_wakeone(sem->sem_wchan);
+	/* Fast-path Ps can still be changing the count under us. */
+	do {
+		count = sem->sem_count;
+		KASSERT(count + SEM_ONE > count);
+	} while (atomic_cas(&sem->sem_count, count, count + SEM_ONE) != count);
+
+	if (sem->sem_handoff) {
+		wchan_handoff(&sem->sem_wchan);
+	}
+	else {
+		wchan_wakeone(&sem->sem_wchan);
+	}
+
+	spinlock_release(&sem->sem_lock);
+}
+
+	void
+sem_sethandoff(struct semaphore *sem, bool handoff)
+{
+	KASSERT(sem != NULL);
 
+	spinlock_acquire(&sem->sem_lock);
+	sem->sem_handoff = handoff;
 	spinlock_release(&sem->sem_lock);
 }
 
@@ -147,153 +368,1116 @@ V(struct semaphore *sem)
 //
 // Lock.
 
-	struct lock *
-lock_create(const char *name)
-{
-	struct lock *lock;
+/*
+ * lk_owner holds the owning thread's address, or 0 if the lock is
+ * free, so uncontended acquires and releases are one compare-and-swap
+ * each. As with semaphores, the low bit (LOCK_WAITERS; struct thread
+ * is word-aligned) is set under the spinlock by threads waiting for
+ * the lock, and sends lock_release through the slow path. It also
+ * keeps the owner from finishing lock_release, and maybe exiting,
+ * while a waiter holding the spinlock looks at it.
+ *
+ * Locks are adaptive: while the holder is running on another cpu it
+ * will probably let go soon, so lock_acquire polls for up to
+ * LOCK_SPINROUNDS rounds of LOCK_SPINPOLLS reads before giving up and
+ * sleeping, which costs two context switches. It rechecks the holder
+ * between rounds, and sleeps at once if the holder is not running.
+ */
+#define LOCK_WAITERS	1
+#define LOCK_SPINROUNDS	64
+#define LOCK_SPINPOLLS	64
 
-	lock = kmalloc(sizeof(struct lock));
-	if (lock == NULL) {
-		return NULL;
-	}
+/*
+ * Priority inheritance.
+ *
+ * A thread waiting for a lock donates its effective priority to the
+ * lock's holder, and if the holder is itself waiting for a lock, on
+ * to that lock's holder, and so on (up to PI_MAXDEPTH locks, which
+ * also stops us going around a deadlock cycle forever). The holder
+ * keeps the donation until it releases the lock, at which point its
+ * priority is recomputed from its base priority and the waiters for
+ * any other locks it still holds.
+ *
+ * Only contended locks are involved: each lock's waiters are listed
+ * on lk_piwaiters, and once the holder has been donated to, the lock
+ * goes on the holder's t_piheld list (lk_piholder says whose). Since
+ * donating requires LOCK_WAITERS, such a lock is always released
+ * through the slow path, which takes it off the list again. All of
+ * this is protected by pi_lock, which is taken after a lock's
+ * spinlock and before run queue locks.
+ *
+ * If a waiter's own priority drops while it waits, holders keep what
+ * it donated until they release; that errs on the side of running
+ * the holder sooner.
+ */
+#define PI_MAXDEPTH	16
 
-	lock->lk_name = kstrdup(name);
-	if (lock->lk_name == NULL) {
-		kfree(lock);
-		return NULL;
-	}
+static struct spinlock pi_lock = SPINLOCK_INITIALIZER;
 
-	lock->curthread = NULL;
-	spinlock_init(& lock->spin);
-	lock->wc = wchan_create(lock->lk_name);
-	lock->held = false;
+/*
+ * Return the highest effective priority among LOCK's waiters.
+ */
+static
+unsigned
+pi_lockmax(struct lock *lock)
+{
+	struct thread *t;
+	unsigned max;
 
-	// add stuff here as needed
+	KASSERT(spinlock_do_i_hold(&pi_lock));
 
-	return lock;
+	max = PRI_MIN;
+	for (t = lock->lk_piwaiters; t != NULL; t = t->t_piwaitnext) {
+		if (t->t_epriority > max) {
+			max = t->t_epriority;
+		}
+	}
+	return max;
 }
 
-	void
-lock_destroy(struct lock *lock)
+/*
+ * Return what thread T's effective priority should be.
+ */
+static
+unsigned
+pi_compute(struct thread *t)
 {
-	KASSERT(lock != NULL);
+	struct lock *lock;
+	unsigned pri, max;
 
-	// add stuff here as needed
+	KASSERT(spinlock_do_i_hold(&pi_lock));
 
-	spinlock_cleanup(& lock->spin);
-	wchan_destroy(lock->wc);
-	kfree(lock->lk_name);
-	kfree(lock);
+	pri = t->t_priority;
+	for (lock = t->t_piheld; lock != NULL; lock = lock->lk_pinext) {
+		max = pi_lockmax(lock);
+		if (max > pri) {
+			pri = max;
+		}
+	}
+	return pri;
 }
 
-	void
-lock_acquire(struct lock *lock)
+/*
+ * Raise LOCK's holder to at least PRI, and pass that on down the
+ * chain of locks it's waiting for.
+ */
+static
+void
+pi_boost(struct lock *lock, unsigned pri)
 {
-	// Write this
-	KASSERT(lock != NULL);
-	KASSERT(!lock_do_i_hold(lock));
-	spinlock_acquire(&lock->spin);
-	while(lock->held){
-		wchan_lock(lock->wc);
-		spinlock_release(&lock->spin);
-		wchan_sleep(lock->wc);
-		spinlock_acquire(&lock->spin);
+	struct thread *holder;
+	unsigned depth;
+
+	KASSERT(spinlock_do_i_hold(&pi_lock));
+
+	for (depth = 0; depth < PI_MAXDEPTH && lock != NULL; depth++) {
+		holder = lock->lk_piholder;
+		if (holder == NULL || holder->t_epriority >= pri) {
+			break;
+		}
+		thread_repriority(holder, pri);
+		lock = holder->t_blockedon;
 	}
-	lock->held = true;
-	lock->curthread = curthread;
-	spinlock_release(&lock->spin);
 }
 
-	void
-lock_release(struct lock *lock)
+/*
+ * Make HOLDER LOCK's priority inheritance holder, and donate to it.
+ */
+static
+void
+pi_hold(struct lock *lock, struct thread *holder)
 {
-	// Write this
-	KASSERT(lock != NULL);
-	KASSERT(lock->held );
-	spinlock_acquire(&lock->spin);
-	lock->held = false;
-	lock->curthread = NULL;
-	wchan_wakeone(lock->wc);
-	spinlock_release(&lock->spin);	
+	KASSERT(spinlock_do_i_hold(&pi_lock));
+
+	if (lock->lk_piholder != holder) {
+		KASSERT(lock->lk_piholder == NULL);
+		lock->lk_piholder = holder;
+		lock->lk_pinext = holder->t_piheld;
+		holder->t_piheld = lock;
+	}
+	pi_boost(lock, pi_lockmax(lock));
 }
 
-	bool
-lock_do_i_hold(struct lock *lock)
+/*
+ * Undo pi_hold, and put the holder back to whatever priority it
+ * should have without LOCK.
+ */
+static
+void
+pi_unhold(struct lock *lock)
 {
-	// Write this
-	KASSERT(lock != NULL);
-	spinlock_acquire(&lock->spin);
-	bool hold = (lock->curthread == curthread);
-	spinlock_release(&lock->spin);
-	return hold;
+	struct thread *holder;
+	struct lock **lp;
+	unsigned pri;
 
+	KASSERT(spinlock_do_i_hold(&pi_lock));
+
+	holder = lock->lk_piholder;
+	for (lp = &holder->t_piheld; *lp != lock; lp = &(*lp)->lk_pinext) {
+		KASSERT(*lp != NULL);
+	}
+	*lp = lock->lk_pinext;
+	lock->lk_pinext = NULL;
+	lock->lk_piholder = NULL;
+
+	pri = pi_compute(holder);
+	if (pri != holder->t_epriority) {
+		thread_repriority(holder, pri);
+	}
 }
 
-////////////////////////////////////////////////////////////
-//
-// CV
+/*
+ * Add T, or remove the current thread, as a waiter for LOCK.
+ */
+static
+void
+pi_wait(struct lock *lock, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&pi_lock));
+	KASSERT(t->t_blockedon == NULL);
 
+	t->t_blockedon = lock;
+	t->t_piwaitnext = lock->lk_piwaiters;
+	lock->lk_piwaiters = t;
+}
 
-	struct cv *
-cv_create(const char *name)
+static
+void
+pi_unwait(struct lock *lock)
 {
-	struct cv *cv;
+	struct thread *cur = curthread;
+	struct thread **tp;
 
-	cv = kmalloc(sizeof(struct cv));
-	if (cv == NULL) {
-		return NULL;
-	}
+	KASSERT(spinlock_do_i_hold(&pi_lock));
+	KASSERT(cur->t_blockedon == lock);
 
-	cv->cv_name = kstrdup(name);
-	if (cv->cv_name==NULL) {
-		kfree(cv);
-		return NULL;
+	for (tp = &lock->lk_piwaiters; *tp != cur; tp = &(*tp)->t_piwaitnext) {
+		KASSERT(*tp != NULL);
 	}
-	cv->cv_wc = wchan_create(cv->cv_name);
+	*tp = cur->t_piwaitnext;
+	cur->t_piwaitnext = NULL;
+	cur->t_blockedon = NULL;
+}
 
-	// add stuff here as needed
+void
+lock_pi_recompute(struct thread *t)
+{
+	unsigned pri;
 
-	return cv;
+	spinlock_acquire(&pi_lock);
+	pri = pi_compute(t);
+	if (pri != t->t_epriority) {
+		thread_repriority(t, pri);
+		pi_boost(t->t_blockedon, pri);
+	}
+	spinlock_release(&pi_lock);
 }
 
 	void
-cv_destroy(struct cv *cv)
+lock_init(struct lock *lock, const char *name)
 {
-	KASSERT(cv != NULL);
+	KASSERT(lock != NULL);
 
-	// add stuff here as needed
-	wchan_destroy(cv->cv_wc);
-	kfree(cv->cv_name);
-	kfree(cv);
+	lock->lk_name = name;
+	lock->lk_owner = 0;
+	lock->lk_nwaiters = 0;
+	lock->lk_piwaiters = NULL;
+	lock->lk_piholder = NULL;
+	lock->lk_pinext = NULL;
+	spinlock_init(& lock->spin);
+	wchan_init(&lock->wc, name);
+	lock->handoff = false;
+#if OPT_LOCKSTAT
+	lock->lk_stat = lockstat_name(name);
+	lock->lk_acquiretime = 0;
+#endif
 }
 
 	void
-cv_wait(struct cv *cv, struct lock *lock)
+lock_cleanup(struct lock *lock)
 {
-	// Write this
-	KASSERT(cv != NULL);
 	KASSERT(lock != NULL);
-	KASSERT(lock_do_i_hold(lock));
-	wchan_lock(cv->cv_wc);
-	lock_release(lock);
-	wchan_sleep(cv->cv_wc);
-	lock_acquire(lock);
+	KASSERT(lock->lk_owner == 0);
+	KASSERT(lock->lk_piwaiters == NULL);
+	KASSERT(lock->lk_piholder == NULL);
+
+	spinlock_cleanup(& lock->spin);
+	wchan_cleanup(&lock->wc);
 }
 
-	void
-cv_signal(struct cv *cv, struct lock *lock)
+	struct lock *
+lock_create(const char *name)
 {
-	// Write this
-	KASSERT(lock != NULL);
-	KASSERT(lock_do_i_hold(lock));
-	wchan_wakeone(cv->cv_wc);
+	struct lock *lock;
+
+	lock = kmalloc(sizeof(struct lock));
+	if (lock == NULL) {
+		return NULL;
+	}
+	lock_init(lock, name);
+	return lock;
 }
 
 	void
-cv_broadcast(struct cv *cv, struct lock *lock)
+lock_destroy(struct lock *lock)
 {
-	// Write this
-	KASSERT(lock != NULL);
-	KASSERT(lock->held );
-	wchan_wakeall(cv->cv_wc);
+	lock_cleanup(lock);
+	kfree(lock);
+}
+
+#if OPT_LOCKSTAT
+/*
+ * LOCK_INITIALIZER can't look up the stats entry, so do it the first
+ * time the lock is used.
+ */
+static
+struct lockstat *
+lock_stat(struct lock *lock)
+{
+	if (lock->lk_stat == NULL) {
+		lock->lk_stat = lockstat_name(lock->lk_name);
+	}
+	return lock->lk_stat;
+}
+#endif
+
+/*
+ * Stop waiting for LOCK without getting it: undo what lock_acquire's
+ * slow path did on the way in, including what we lent the holder.
+ */
+static
+void
+lock_giveup(struct lock *lock)
+{
+	struct thread *holder;
+	unsigned pri;
+
+	KASSERT(spinlock_do_i_hold(&lock->spin));
+
+	lock->lk_nwaiters--;
+	if (lock->lk_nwaiters == 0) {
+		/*
+		 * Nobody left for lock_release to wake. The holder
+		 * can't release (or anyone else take) the lock while
+		 * the bit is set and we hold the spinlock.
+		 */
+		lock->lk_owner &= ~LOCK_WAITERS;
+	}
+
+	spinlock_acquire(&pi_lock);
+	pi_unwait(lock);
+	holder = lock->lk_piholder;
+	if (holder != NULL) {
+		if (lock->lk_piwaiters == NULL) {
+			pi_unhold(lock);
+		}
+		else {
+			pri = pi_compute(holder);
+			if (pri != holder->t_epriority) {
+				thread_repriority(holder, pri);
+			}
+		}
+	}
+	spinlock_release(&pi_lock);
+}
+
+/*
+ * Contended part of lock_acquire. If QUEUED, cv_signal has already
+ * counted us as a waiter and put us on lk_piwaiters (see below). If
+ * TW isn't NULL, give up with ETIMEDOUT when it expires.
+ */
+static
+int
+lock_acquire_slow(struct lock *lock, bool queued, struct timedwait *tw)
+{
+	unsigned me, owner, new, donated, rounds, i;
+	bool spun, slept;
+#if OPT_LOCKSTAT
+	uint64_t start;
+#endif
+
+	me = (unsigned)curthread;
+#if OPT_LOCKSTAT
+	start = gettime_ns();
+#endif
+	spun = slept = false;
+	rounds = 0;
+	donated = 0;
+	spinlock_acquire(&lock->spin);
+	if (!queued) {
+		lock->lk_nwaiters++;
+		spinlock_acquire(&pi_lock);
+		pi_wait(lock, curthread);
+		spinlock_release(&pi_lock);
+	}
+	while (1) {
+		owner = lock->lk_owner;
+		if (owner == 0) {
+			new = me;
+			if (lock->lk_nwaiters > 1) {
+				new |= LOCK_WAITERS;
+			}
+			if (atomic_cas(&lock->lk_owner, 0, new) == 0) {
+				break;
+			}
+			continue;
+		}
+		if ((owner & LOCK_WAITERS) == 0) {
+			if (atomic_cas(&lock->lk_owner, owner,
+				       owner | LOCK_WAITERS) != owner) {
+				continue;
+			}
+			owner |= LOCK_WAITERS;
+		}
+
+		/*
+		 * With LOCK_WAITERS set, the holder can't get through
+		 * lock_release while we hold the spinlock, so it's
+		 * safe to look at it here. Lend it our priority (once
+		 * per holder) before we wait for it.
+		 */
+		if (owner != donated) {
+			spinlock_acquire(&pi_lock);
+			pi_hold(lock,
+				(struct thread *)(owner & ~LOCK_WAITERS));
+			spinlock_release(&pi_lock);
+			donated = owner;
+		}
+
+		if (rounds < LOCK_SPINROUNDS &&
+		    thread_oncpu((struct thread *)(owner & ~LOCK_WAITERS))) {
+			rounds++;
+			spun = true;
+			spinlock_release(&lock->spin);
+			for (i=0; i<LOCK_SPINPOLLS &&
+				     lock->lk_owner == owner; i++) {
+				/* nothing */
+			}
+			spinlock_acquire(&lock->spin);
+			continue;
+		}
+		wchan_lock(&lock->wc);
+		if (tw != NULL && tw->tw_expired) {
+			wchan_unlock(&lock->wc);
+			lock_giveup(lock);
+			spinlock_release(&lock->spin);
+			return ETIMEDOUT;
+		}
+		slept = true;
+		spinlock_release(&lock->spin);
+		wchan_sleep(&lock->wc);
+		spinlock_acquire(&lock->spin);
+		/* New holder; give it a fresh spin budget. */
+		rounds = 0;
+	}
+	lock->lk_nwaiters--;
+	spinlock_acquire(&pi_lock);
+	pi_unwait(lock);
+	if (lock->lk_piwaiters != NULL) {
+		/* The others waiting now wait for us. */
+		pi_hold(lock, curthread);
+	}
+	spinlock_release(&pi_lock);
+	if (slept) {
+		curcpu->c_lockblocks++;
+	}
+	else if (spun) {
+		curcpu->c_lockspins++;
+	}
+	spinlock_release(&lock->spin);
+#if OPT_LOCKSTAT
+	lock->lk_acquiretime = gettime_ns();
+	lockstat_acquired(lock_stat(lock), true, start, lock->lk_acquiretime);
+#endif
+	return 0;
+}
+
+	void
+lock_acquire(struct lock *lock)
+{
+	unsigned me;
+
+	KASSERT(lock != NULL);
+	KASSERT(!lock_do_i_hold(lock));
+
+	me = (unsigned)curthread;
+	KASSERT((me & LOCK_WAITERS) == 0);
+	if (atomic_cas(&lock->lk_owner, 0, me) == 0) {
+#if OPT_LOCKSTAT
+		lock->lk_acquiretime = gettime_ns();
+		lockstat_acquired(lock_stat(lock), false, 0,
+				  lock->lk_acquiretime);
+#endif
+		return;
+	}
+	lock_acquire_slow(lock, false, NULL);
+}
+
+	int
+lock_acquire_timed(struct lock *lock, unsigned ticks)
+{
+	struct timedwait tw;
+	unsigned me;
+	int result;
+
+	KASSERT(lock != NULL);
+	KASSERT(!lock_do_i_hold(lock));
+
+	me = (unsigned)curthread;
+	if (atomic_cas(&lock->lk_owner, 0, me) == 0) {
+#if OPT_LOCKSTAT
+		lock->lk_acquiretime = gettime_ns();
+		lockstat_acquired(lock_stat(lock), false, 0,
+				  lock->lk_acquiretime);
+#endif
+		return 0;
+	}
+	if (ticks == 0) {
+		return ETIMEDOUT;
+	}
+	timedwait_start(&tw, &lock->wc, ticks);
+	result = lock_acquire_slow(lock, false, &tw);
+	timedwait_stop(&tw);
+	return result;
+}
+
+/*
+ * Release LOCK, which we hold, with its spinlock held. Nobody else
+ * can change lk_owner while it's nonzero and we have the spinlock.
+ */
+static
+void
+lock_release_spin(struct lock *lock)
+{
+	unsigned owner;
+
+	KASSERT(spinlock_do_i_hold(&lock->spin));
+	KASSERT(lock_do_i_hold(lock));
+
+	owner = lock->lk_owner;
+	lock->lk_owner = 0;
+	if ((owner & LOCK_WAITERS) == 0) {
+		return;
+	}
+	if (lock->lk_piholder != NULL) {
+		/* Give back what the waiters lent us. */
+		KASSERT(lock->lk_piholder == curthread);
+		spinlock_acquire(&pi_lock);
+		pi_unhold(lock);
+		spinlock_release(&pi_lock);
+	}
+	if (lock->handoff) {
+		wchan_handoff(&lock->wc);
+	}
+	else {
+		wchan_wakeone(&lock->wc);
+	}
+}
+
+	void
+lock_release(struct lock *lock)
+{
+	unsigned me;
+
+	KASSERT(lock != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+#if OPT_LOCKSTAT
+	lockstat_released(lock_stat(lock), lock->lk_acquiretime, gettime_ns());
+#endif
+
+	me = (unsigned)curthread;
+	if (atomic_cas(&lock->lk_owner, me, 0) == me) {
+		return;
+	}
+
+	spinlock_acquire(&lock->spin);
+	lock_release_spin(lock);
+	spinlock_release(&lock->spin);
+}
+
+	void
+lock_sethandoff(struct lock *lock, bool handoff)
+{
+	KASSERT(lock != NULL);
+
+	spinlock_acquire(&lock->spin);
+	lock->handoff = handoff;
+	spinlock_release(&lock->spin);
+}
+
+	bool
+lock_do_i_hold(struct lock *lock)
+{
+	KASSERT(lock != NULL);
+
+	/* Only we can make this true or false, so no locking needed. */
+	return (lock->lk_owner & ~LOCK_WAITERS) == (unsigned)curthread;
+}
+
+////////////////////////////////////////////////////////////
+//
+// CV
+
+/*
+ * Wait morphing.
+ *
+ * A thread woken from a cv goes straight to lock_acquire, so waking
+ * it while the signaller still holds the lock just gets it two
+ * context switches and another sleep, and cv_broadcast sets the whole
+ * herd doing that. Instead, cv_signal and cv_broadcast move sleepers
+ * from the cv's wait channel directly onto the lock's, as if they had
+ * already called lock_acquire and blocked: they're counted in
+ * lk_nwaiters, donate their priority to the signaller, and LOCK_WAITERS
+ * is set so that lock_release wakes them one at a time. cv_wait sees
+ * t_cvmorphed and carries on in lock_acquire_slow without queueing
+ * again.
+ */
+static
+void
+cv_morphed(struct thread *t, void *data)
+{
+	struct lock *lock = data;
+
+	KASSERT(spinlock_do_i_hold(&lock->spin));
+
+	lock->lk_nwaiters++;
+	spinlock_acquire(&pi_lock);
+	pi_wait(lock, t);
+	spinlock_release(&pi_lock);
+	t->t_cvmorphed = true;
+}
+
+static
+void
+cv_morph(struct cv *cv, struct lock *lock, bool all)
+{
+	unsigned me;
+
+	me = (unsigned)curthread;
+	spinlock_acquire(&lock->spin);
+	if (wchan_morph(&cv->cv_wc, &lock->wc, all, cv_morphed, lock) > 0) {
+		/* We hold the lock, so only we change lk_owner. */
+		lock->lk_owner = me | LOCK_WAITERS;
+		spinlock_acquire(&pi_lock);
+		pi_hold(lock, curthread);
+		spinlock_release(&pi_lock);
+	}
+	spinlock_release(&lock->spin);
+}
+
+
+/*
+ * Release LOCK for cv_wait, but keep its spinlock, which cv_signal
+ * needs, until we have the cv's wait channel locked. We can't just
+ * call lock_release with the channel locked, as that might wake a
+ * thread on the lock's channel, which might share its sleep queue.
+ */
+static
+void
+cv_release(struct lock *lock)
+{
+#if OPT_LOCKSTAT
+	lockstat_released(lock_stat(lock), lock->lk_acquiretime, gettime_ns());
+#endif
+	spinlock_acquire(&lock->spin);
+	lock_release_spin(lock);
+}
+
+	void
+cv_init(struct cv *cv, const char *name)
+{
+	KASSERT(cv != NULL);
+
+	cv->cv_name = name;
+	wchan_init(&cv->cv_wc, name);
+}
+
+	void
+cv_cleanup(struct cv *cv)
+{
+	KASSERT(cv != NULL);
+
+	wchan_cleanup(&cv->cv_wc);
+}
+
+	struct cv *
+cv_create(const char *name)
+{
+	struct cv *cv;
+
+	cv = kmalloc(sizeof(struct cv));
+	if (cv == NULL) {
+		return NULL;
+	}
+	cv_init(cv, name);
+	return cv;
+}
+
+	void
+cv_destroy(struct cv *cv)
+{
+	cv_cleanup(cv);
+	kfree(cv);
+}
+
+	void
+cv_wait(struct cv *cv, struct lock *lock)
+{
+	/* A signal moves us onto the lock's queue; see cv_morph. */
+	KASSERT(cv != NULL);
+	KASSERT(lock != NULL);
+	KASSERT(lock_do_i_hold(lock));
+	cv_release(lock);
+	wchan_lock(&cv->cv_wc);
+	spinlock_release(&lock->spin);
+	wchan_sleep(&cv->cv_wc);
+	if (curthread->t_cvmorphed) {
+		curthread->t_cvmorphed = false;
+		lock_acquire_slow(lock, true, NULL);
+	}
+	else {
+		lock_acquire(lock);
+	}
+}
+
+/*
+ * If a cv_signal moves us onto the lock before the timeout fires, the
+ * callout finds us gone from the cv and leaves us alone, and we count
+ * as signalled. Either way we wait for the lock itself untimed.
+ */
+	int
+cv_timedwait(struct cv *cv, struct lock *lock, unsigned ticks)
+{
+	struct timedwait tw;
+
+	KASSERT(cv != NULL);
+	KASSERT(lock != NULL);
+	KASSERT(lock_do_i_hold(lock));
+
+	if (ticks == 0) {
+		return ETIMEDOUT;
+	}
+	cv_release(lock);
+	/* With the wchan locked the callout can't wake us too soon. */
+	wchan_lock(&cv->cv_wc);
+	timedwait_start(&tw, &cv->cv_wc, ticks);
+	spinlock_release(&lock->spin);
+	wchan_sleep(&cv->cv_wc);
+	timedwait_stop(&tw);
+	if (curthread->t_cvmorphed) {
+		curthread->t_cvmorphed = false;
+		lock_acquire_slow(lock, true, NULL);
+	}
+	else {
+		lock_acquire(lock);
+	}
+	return tw.tw_woke ? ETIMEDOUT : 0;
+}
+
+	void
+cv_signal(struct cv *cv, struct lock *lock)
+{
+	/* The waiter is moved onto the lock's queue; see cv_morph. */
+	KASSERT(lock != NULL);
+	KASSERT(lock_do_i_hold(lock));
+	cv_morph(cv, lock, false);
+}
+
+	void
+cv_broadcast(struct cv *cv, struct lock *lock)
+{
+	/* The waiters are moved onto the lock's queue; see cv_morph. */
+	KASSERT(lock != NULL);
+	KASSERT(lock_do_i_hold(lock));
+	cv_morph(cv, lock, true);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+	void
+rwlock_init(struct rwlock *rw, const char *name)
+{
+	KASSERT(rw != NULL);
+
+	rw->rw_name = name;
+	spinlock_init(&rw->rw_lock);
+	wchan_init(&rw->rw_readwchan, name);
+	wchan_init(&rw->rw_writewchan, name);
+	rw->rw_readers = 0;
+	rw->rw_waitingwriters = 0;
+	rw->rw_writer = NULL;
+}
+
+	void
+rwlock_cleanup(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_waitingwriters == 0);
+
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_cleanup(&rw->rw_writewchan);
+	wchan_cleanup(&rw->rw_readwchan);
+}
+
+	struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(struct rwlock));
+	if (rw == NULL) {
+		return NULL;
+	}
+	rwlock_init(rw, name);
+	return rw;
+}
+
+	void
+rwlock_destroy(struct rwlock *rw)
+{
+	rwlock_cleanup(rw);
+	kfree(rw);
+}
+
+	void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	/* Waiting writers go first. */
+	while (rw->rw_writer != NULL || rw->rw_waitingwriters > 0) {
+		wchan_lock(&rw->rw_readwchan);
+		spinlock_release(&rw->rw_lock);
+		wchan_sleep(&rw->rw_readwchan);
+		spinlock_acquire(&rw->rw_lock);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+	void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	rw->rw_waitingwriters++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		wchan_lock(&rw->rw_writewchan);
+		spinlock_release(&rw->rw_lock);
+		wchan_sleep(&rw->rw_writewchan);
+		spinlock_acquire(&rw->rw_lock);
+	}
+	rw->rw_waitingwriters--;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+	void
+rwlock_release(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	if (rw->rw_writer != NULL) {
+		KASSERT(rw->rw_writer == curthread);
+		KASSERT(rw->rw_readers == 0);
+		rw->rw_writer = NULL;
+	}
+	else {
+		KASSERT(rw->rw_readers > 0);
+		rw->rw_readers--;
+		if (rw->rw_readers > 0) {
+			/* Still held; nobody else can get in. */
+			spinlock_release(&rw->rw_lock);
+			return;
+		}
+	}
+
+	/*
+	 * The lock is free. Hand it to a writer if one is waiting;
+	 * otherwise let in all the readers.
+	 */
+	if (rw->rw_waitingwriters > 0) {
+		wchan_wakeone(&rw->rw_writewchan);
+	}
+	else {
+		wchan_wakeall(&rw->rw_readwchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+	void
+rwlock_downgrade(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	KASSERT(rw->rw_readers == 0);
+	rw->rw_writer = NULL;
+	rw->rw_readers = 1;
+	if (rw->rw_waitingwriters == 0) {
+		/* Other readers can share it with us now. */
+		wchan_wakeall(&rw->rw_readwchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Barrier.
+
+	void
+barrier_init(struct barrier *b, const char *name, unsigned count)
+{
+	KASSERT(b != NULL);
+	KASSERT(count > 0);
+
+	b->b_name = name;
+	spinlock_init(&b->b_lock);
+	wchan_init(&b->b_wchan, name);
+	b->b_count = count;
+	b->b_arrived = 0;
+	b->b_generation = 0;
+}
+
+	void
+barrier_cleanup(struct barrier *b)
+{
+	KASSERT(b != NULL);
+	KASSERT(b->b_arrived == 0);
+
+	spinlock_cleanup(&b->b_lock);
+	wchan_cleanup(&b->b_wchan);
+}
+
+	struct barrier *
+barrier_create(const char *name, unsigned count)
+{
+	struct barrier *b;
+
+	b = kmalloc(sizeof(struct barrier));
+	if (b == NULL) {
+		return NULL;
+	}
+	barrier_init(b, name, count);
+	return b;
+}
+
+	void
+barrier_destroy(struct barrier *b)
+{
+	barrier_cleanup(b);
+	kfree(b);
+}
+
+/*
+ * Waiters wait for b_generation to change, not for b_arrived to reach
+ * the count, as the next round may already have begun by the time
+ * they get to run.
+ */
+	bool
+barrier_wait(struct barrier *b)
+{
+	unsigned generation;
+
+	KASSERT(b != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&b->b_lock);
+	generation = b->b_generation;
+	b->b_arrived++;
+	if (b->b_arrived == b->b_count) {
+		b->b_arrived = 0;
+		b->b_generation++;
+		wchan_wakeall(&b->b_wchan);
+		spinlock_release(&b->b_lock);
+		return true;
+	}
+	while (b->b_generation == generation) {
+		wchan_lock(&b->b_wchan);
+		spinlock_release(&b->b_lock);
+		wchan_sleep(&b->b_wchan);
+		spinlock_acquire(&b->b_lock);
+	}
+	spinlock_release(&b->b_lock);
+	return false;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Latch.
+
+	void
+latch_init(struct latch *lt, const char *name, unsigned count)
+{
+	KASSERT(lt != NULL);
+
+	lt->lt_name = name;
+	spinlock_init(&lt->lt_lock);
+	wchan_init(&lt->lt_wchan, name);
+	lt->lt_count = count;
+}
+
+	void
+latch_cleanup(struct latch *lt)
+{
+	KASSERT(lt != NULL);
+
+	spinlock_cleanup(&lt->lt_lock);
+	wchan_cleanup(&lt->lt_wchan);
+}
+
+	struct latch *
+latch_create(const char *name, unsigned count)
+{
+	struct latch *lt;
+
+	lt = kmalloc(sizeof(struct latch));
+	if (lt == NULL) {
+		return NULL;
+	}
+	latch_init(lt, name, count);
+	return lt;
+}
+
+	void
+latch_destroy(struct latch *lt)
+{
+	latch_cleanup(lt);
+	kfree(lt);
+}
+
+	void
+latch_countdown(struct latch *lt)
+{
+	KASSERT(lt != NULL);
+
+	spinlock_acquire(&lt->lt_lock);
+	KASSERT(lt->lt_count > 0);
+	lt->lt_count--;
+	if (lt->lt_count == 0) {
+		wchan_wakeall(&lt->lt_wchan);
+	}
+	spinlock_release(&lt->lt_lock);
+}
+
+	void
+latch_wait(struct latch *lt)
+{
+	KASSERT(lt != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&lt->lt_lock);
+	while (lt->lt_count > 0) {
+		wchan_lock(&lt->lt_wchan);
+		spinlock_release(&lt->lt_lock);
+		wchan_sleep(&lt->lt_wchan);
+		spinlock_acquire(&lt->lt_lock);
+	}
+	spinlock_release(&lt->lt_lock);
+}
+
+	void
+latch_reset(struct latch *lt, unsigned count)
+{
+	KASSERT(lt != NULL);
+	KASSERT(wchan_isempty(&lt->lt_wchan));
+
+	spinlock_acquire(&lt->lt_lock);
+	lt->lt_count = count;
+	spinlock_release(&lt->lt_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Completion.
+
+	void
+completion_init(struct completion *cm, const char *name)
+{
+	KASSERT(cm != NULL);
+
+	cm->cm_name = name;
+	spinlock_init(&cm->cm_lock);
+	wchan_init(&cm->cm_wchan, name);
+	cm->cm_done = false;
+}
+
+	void
+completion_cleanup(struct completion *cm)
+{
+	KASSERT(cm != NULL);
+
+	spinlock_cleanup(&cm->cm_lock);
+	wchan_cleanup(&cm->cm_wchan);
+}
+
+	struct completion *
+completion_create(const char *name)
+{
+	struct completion *cm;
+
+	cm = kmalloc(sizeof(struct completion));
+	if (cm == NULL) {
+		return NULL;
+	}
+	completion_init(cm, name);
+	return cm;
+}
+
+	void
+completion_destroy(struct completion *cm)
+{
+	completion_cleanup(cm);
+	kfree(cm);
+}
+
+	void
+completion_signal(struct completion *cm)
+{
+	KASSERT(cm != NULL);
+
+	spinlock_acquire(&cm->cm_lock);
+	cm->cm_done = true;
+	wchan_wakeall(&cm->cm_wchan);
+	spinlock_release(&cm->cm_lock);
+}
+
+	void
+completion_wait(struct completion *cm)
+{
+	KASSERT(cm != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&cm->cm_lock);
+	while (!cm->cm_done) {
+		wchan_lock(&cm->cm_wchan);
+		spinlock_release(&cm->cm_lock);
+		wchan_sleep(&cm->cm_wchan);
+		spinlock_acquire(&cm->cm_lock);
+	}
+	spinlock_release(&cm->cm_lock);
+}
+
+	void
+completion_reset(struct completion *cm)
+{
+	KASSERT(cm != NULL);
+	KASSERT(wchan_isempty(&cm->cm_wchan));
+
+	spinlock_acquire(&cm->cm_lock);
+	cm->cm_done = false;
+	spinlock_release(&cm->cm_lock);
 }
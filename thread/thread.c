@@ -37,6 +37,7 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <array.h>
+#include <atomic.h>
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
@@ -49,6 +50,7 @@
 #include <synch.h>
 #include <addrspace.h>
 #include <mainbus.h>
+#include <clock.h>
 #include <vnode.h>
 
 #include "opt-synchprobs.h"
@@ -57,13 +59,37 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
-/* Wait channel. */
-struct wchan {
-	const char *wc_name;		/* name for this channel */
-	struct threadlist wc_threads;	/* list of waiting threads */
-	struct spinlock wc_lock;	/* lock for mutual exclusion */
+/*
+ * Scheduler tuning.
+ *
+ * sched_quantum[] is the number of hardclocks a thread may run at
+ * each run queue level before being demoted to the next one. Lower
+ * levels get longer quanta, so CPU-bound threads that sink to the
+ * bottom switch less often.
+ *
+ * Every SCHED_BOOST_PERIOD calls to schedule(), everything is moved
+ * back to level 0 so nothing starves behind a stream of interactive
+ * threads.
+ */
+static const unsigned sched_quantum[SCHED_NLEVELS] = { 1, 2, 4, 8 };
+#define SCHED_BOOST_PERIOD	25
+
+/*
+ * Sleep queues. A wait channel doesn't have a queue of its own;
+ * sleepers go on one of SLEEPQ_SIZE shared queues chosen by hashing
+ * the channel's address, and t_wchan says which channel each is
+ * really waiting on. Locking a channel locks its queue, so code that
+ * has one channel locked must not lock another: they might share.
+ */
+#define SLEEPQ_SIZE	64	/* must be a power of 2 */
+
+struct sleepq {
+	struct threadlist sq_threads;	/* waiting threads, in FIFO order */
+	struct spinlock sq_lock;	/* lock for mutual exclusion */
 };
 
+static struct sleepq sleepqs[SLEEPQ_SIZE];
+
 /* Master array of CPUs. */
 DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
@@ -72,6 +98,13 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Load balancing; see thread_consider_migration. */
+static unsigned thread_steal(bool idle);
+
+/* Sleep queues; see below. */
+static void sleepq_bootstrap(void);
+static struct sleepq *wchan_sq(struct wchan *wc);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -111,9 +144,116 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Thread cache.
+ *
+ * Rather than freeing a dead thread's struct thread and stack, we
+ * keep up to THREADCACHE_HIWAT of them per cpu for thread_create to
+ * reuse. This saves two kmallocs (one of them a whole page) per
+ * thread_fork and the matching kfrees at exit. The stack magic is
+ * checked on the way in and left in place, so it needn't be redone.
+ *
+ * The cache is per-cpu, but it has its own lock: the thread using it
+ * might migrate to another cpu partway through, and
+ * thread_cache_reclaim empties other cpus' caches when memory runs
+ * short. Reclaim trims each cache down to THREADCACHE_LOWAT.
+ */
+#define THREADCACHE_HIWAT	16
+#define THREADCACHE_LOWAT	4
+
+/*
+ * Get a thread from the current cpu's cache, or NULL if it's empty.
+ */
+static
+struct thread *
+thread_cache_get(void)
+{
+	struct cpu *c;
+	struct thread *thread;
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_threadcache_lock);
+	thread = threadlist_remhead(&c->c_threadcache);
+	spinlock_release(&c->c_threadcache_lock);
+	return thread;
+}
+
+/*
+ * Put a dead thread in the current cpu's cache. Returns false if the
+ * cache is full or the thread has no stack.
+ */
+static
+bool
+thread_cache_put(struct thread *thread)
+{
+	struct cpu *c;
+	bool ret;
+
+	if (thread->t_stack == NULL) {
+		return false;
+	}
+	thread_checkstack(thread);
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_threadcache_lock);
+	ret = c->c_threadcache.tl_count < THREADCACHE_HIWAT;
+	if (ret) {
+		threadlist_addhead(&c->c_threadcache, thread);
+	}
+	spinlock_release(&c->c_threadcache_lock);
+	return ret;
+}
+
+/*
+ * Really free a thread's memory.
+ */
+static
+void
+thread_free(struct thread *thread)
+{
+	if (thread->t_stack != NULL) {
+		kfree(thread->t_stack);
+	}
+	threadlistnode_cleanup(&thread->t_listnode);
+	kfree(thread);
+}
+
+/*
+ * Return memory held by the thread caches, down to the low watermark.
+ * Called by the VM system when it runs out of pages.
+ */
+void
+thread_cache_reclaim(void)
+{
+	struct threadlist list;
+	struct thread *thread;
+	struct cpu *c;
+	unsigned i;
+
+	threadlist_init(&list);
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_threadcache_lock);
+		while (c->c_threadcache.tl_count >
+		       THREADCACHE_LOWAT) {
+			thread = threadlist_remtail(&c->c_threadcache);
+			threadlist_addhead(&list, thread);
+		}
+		spinlock_release(&c->c_threadcache_lock);
+	}
+
+	while ((thread = threadlist_remhead(&list)) != NULL) {
+		thread_free(thread);
+	}
+	threadlist_cleanup(&list);
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
+ *
+ * If the thread comes from the thread cache it already has a stack
+ * (with the magic in place); otherwise t_stack is NULL.
  */
 static
 struct thread *
@@ -123,14 +263,19 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = thread_cache_get();
 	if (thread == NULL) {
-		return NULL;
+		thread = kmalloc(sizeof(*thread));
+		if (thread == NULL) {
+			return NULL;
+		}
+		threadlistnode_init(&thread->t_listnode, thread);
+		thread->t_stack = NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		thread_free(thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -138,11 +283,26 @@ thread_create(const char *name)
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
+	thread->t_wchan = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_level = 0;
+	thread->t_quantum_used = 0;
+	thread->t_yieldto = NULL;
+	thread->t_inboxnext = NULL;
+	thread->t_priority = PRI_DEFAULT;
+	thread->t_epriority = PRI_DEFAULT;
+	thread->t_blockedon = NULL;
+	thread->t_piwaitnext = NULL;
+	thread->t_piheld = NULL;
+	thread->t_cvmorphed = false;
+	thread->t_stamp = 0;
+	thread->t_runtime = 0;
+	thread->t_waittime = 0;
+	thread->t_sleeptime = 0;
+	thread->t_nswitches = 0;
+	thread->t_nmigrations = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -167,6 +327,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -180,10 +341,38 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_schedboost = SCHED_BOOST_PERIOD;
+	for (i=0; i<WAKEUP_NPLACES; i++) {
+		c->c_wakeups[i] = 0;
+	}
+	c->c_busytime = 0;
+	c->c_idletime = 0;
+	c->c_nswitches = 0;
+	c->c_nmigrations = 0;
+	for (i=0; i<SCHED_HISTBUCKETS; i++) {
+		c->c_waithist[i] = 0;
+		c->c_runhist[i] = 0;
+		c->c_sleephist[i] = 0;
+	}
+	bzero(c->c_wchanstats, sizeof(c->c_wchanstats));
+	c->c_lockspins = 0;
+	c->c_lockblocks = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
+	c->c_tickperiod = 1;
 	spinlock_init(&c->c_runqueue_lock);
+	c->c_inbox = NULL;
+	c->c_inboxcount = 0;
+
+	threadlist_init(&c->c_threadcache);
+	spinlock_init(&c->c_threadcache_lock);
+
+	c->c_pagemag_count = 0;
+	spinlock_init(&c->c_pagemag_lock);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -213,7 +402,7 @@ cpu_create(unsigned hardware_number)
 		 */
 		/*c->c_curthread->t_stack = ... */
 	}
-	else {
+	else if (c->c_curthread->t_stack == NULL) {
 		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
 		if (c->c_curthread->t_stack == NULL) {
 			panic("cpu_create: couldn't allocate stack");
@@ -227,6 +416,23 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Count and look up cpus. All cpus are created during boot, before
+ * any other cpu is started, so no locking is needed.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned number)
+{
+	KASSERT(number < cpuarray_num(&allcpus));
+	return cpuarray_get(&allcpus, number);
+}
+
 /*
  * Destroy a thread.
  *
@@ -249,17 +455,24 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
-	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
+	DEBUG(DB_THREADS, "Thread %s: ran %lu us, waited %lu us, "
+	      "slept %lu us, %u switches, %u migrations\n", thread->t_name,
+	      (unsigned long)(thread->t_runtime / 1000),
+	      (unsigned long)(thread->t_waittime / 1000),
+	      (unsigned long)(thread->t_sleeptime / 1000),
+	      thread->t_nswitches, thread->t_nmigrations);
+
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	thread->t_name = NULL;
+
+	if (!thread_cache_put(thread)) {
+		thread_free(thread);
+	}
 }
 
 /*
@@ -289,6 +502,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -303,9 +518,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -350,6 +568,7 @@ thread_bootstrap(void)
 	struct thread *bootthread;
 
 	cpuarray_init(&allcpus);
+	sleepq_bootstrap();
 
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
@@ -427,158 +646,690 @@ thread_start_cpus(void)
 }
 
 /*
- * Make a thread runnable.
+ * Run queue operations. The cpu's runqueue lock must be held.
  *
- * targetcpu might be curcpu; it might not be, too. 
+ * Threads are queued at the level recorded in t_level. Each level is
+ * kept sorted by effective priority (t_epriority), highest first, and
+ * FIFO among equals. Removal from the head takes the highest-priority
+ * thread, and among those the one at the highest level; removal from
+ * the tail takes the last thread of the lowest nonempty level.
+ */
+
+/*
+ * Insert T into TL after everything of the same or higher priority.
+ * Usually that's the tail, so search from there.
  */
 static
 void
-thread_make_runnable(struct thread *target, bool already_have_lock)
+runqueue_insert(struct threadlist *tl, struct thread *t)
 {
-	struct cpu *targetcpu;
-	bool isidle;
-
-	/* Lock the run queue of the target thread's cpu. */
-	targetcpu = target->t_cpu;
-
-	if (already_have_lock) {
-		/* The target thread's cpu should be already locked. */
-		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
-	}
-	else {
-		spinlock_acquire(&targetcpu->c_runqueue_lock);
+	struct threadlistnode *tln;
+
+	for (tln = tl->tl_tail.tln_prev;
+	     tln->tln_prev != NULL;
+	     tln = tln->tln_prev) {
+		if (tln->tln_self->t_epriority >= t->t_epriority) {
+			threadlist_insertafter(tl, tln->tln_self, t);
+			return;
+		}
 	}
+	threadlist_addhead(tl, t);
+}
 
-	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
-	if (isidle) {
-		/*
-		 * Other processor is idle; send interrupt to make
-		 * sure it unidles.
-		 */
-		ipi_send(targetcpu, IPI_UNIDLE);
-	}
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	KASSERT(t->t_level < SCHED_NLEVELS);
 
-	if (!already_have_lock) {
-		spinlock_release(&targetcpu->c_runqueue_lock);
-	}
+	runqueue_insert(&c->c_runqueue[t->t_level], t);
+	c->c_runcount++;
 }
 
 /*
- * Create a new thread based on an existing one.
- *
- * The new thread has name NAME, and starts executing in function
- * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
- *
- * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * Return the thread runqueue_remhead would take, without taking it.
  */
-int
-thread_fork(const char *name,
-	    struct proc *proc,
-	    void (*entrypoint)(void *data1, unsigned long data2),
-	    void *data1, unsigned long data2)
+static
+struct thread *
+runqueue_peek(struct cpu *c)
 {
-	struct thread *newthread;
-	int result;
+	struct thread *t, *best;
+	unsigned i;
 
-#ifdef UW
-	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
-#endif // UW
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
 
-	newthread = thread_create(name);
-	if (newthread == NULL) {
-		return ENOMEM;
+	best = NULL;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		if (threadlist_isempty(&c->c_runqueue[i])) {
+			continue;
+		}
+		t = c->c_runqueue[i].tl_head.tln_next->tln_self;
+		if (best == NULL || t->t_epriority > best->t_epriority) {
+			best = t;
+		}
 	}
+	return best;
+}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+
+	t = runqueue_peek(c);
+	if (t != NULL) {
+		threadlist_remove(&c->c_runqueue[t->t_level], t);
+		c->c_runcount--;
 	}
-	thread_checkstack_init(newthread);
+	return t;
+}
 
-	/*
-	 * Now we clone various fields from the parent thread.
-	 */
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
 
-	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
 
-	/* Attach the new thread to its process */
-	if (proc == NULL) {
-		proc = curthread->t_proc;
-	}
-	result = proc_addthread(proc, newthread);
-	if (result) {
-		/* thread_destroy will clean up the stack */
-		thread_destroy(newthread);
-		return result;
+	for (i=SCHED_NLEVELS; i-- > 0; ) {
+		t = threadlist_remtail(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
 	}
+	return NULL;
+}
 
-	/*
-	 * Because new threads come out holding the cpu runqueue lock
-	 * (see notes at bottom of thread_switch), we need to account
-	 * for the spllower() that will be done releasing it.
-	 */
-	newthread->t_iplhigh_count++;
-
-	/* Set up the switchframe so entrypoint() gets called */
-	switchframe_init(newthread, entrypoint, data1, data2);
+/*
+ * Remove thread T from C's run queue, if it's there, and return it;
+ * otherwise return NULL. T is compared against the queued threads
+ * but not dereferenced, so it may be a stale pointer.
+ */
+static
+struct thread *
+runqueue_remove(struct cpu *c, struct thread *t)
+{
+	struct threadlistnode *tln;
+	unsigned i;
 
-	/* Lock the current cpu's run queue and make the new thread runnable */
-	thread_make_runnable(newthread, false);
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
 
-	return 0;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		for (tln = c->c_runqueue[i].tl_head.tln_next;
+		     tln->tln_next != NULL;
+		     tln = tln->tln_next) {
+			if (tln->tln_self == t) {
+				threadlist_remove(&c->c_runqueue[i], t);
+				c->c_runcount--;
+				return t;
+			}
+		}
+	}
+	return NULL;
 }
 
 /*
- * High level, machine-independent context switch code.
- *
- * The current thread is queued appropriately and its state is changed
- * to NEWSTATE; another thread to run is selected and switched to.
- *
- * If NEWSTATE is S_SLEEP, the thread is queued on the wait channel
- * WC. Otherwise WC should be NULL.
+ * Return true if thread T is on C's run queue. Like runqueue_remove,
+ * this doesn't dereference T.
  */
 static
-void
-thread_switch(threadstate_t newstate, struct wchan *wc)
+bool
+runqueue_contains(struct cpu *c, struct thread *t)
 {
-	struct thread *cur, *next;
-	int spl;
-
-	DEBUGASSERT(curcpu->c_curthread == curthread);
-	DEBUGASSERT(curthread->t_cpu == curcpu->c_self);
-
-	/* Explicitly disable interrupts on this processor */
-	spl = splhigh();
+	struct threadlistnode *tln;
+	unsigned i;
 
-	cur = curthread;
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
 
-	/*
-	 * If we're idle, return without doing anything. This happens
-	 * when the timer interrupt interrupts the idle loop.
-	 */
-	if (curcpu->c_isidle) {
-		splx(spl);
-		return;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		for (tln = c->c_runqueue[i].tl_head.tln_next;
+		     tln->tln_next != NULL;
+		     tln = tln->tln_next) {
+			if (tln->tln_self == t) {
+				return true;
+			}
+		}
 	}
+	return false;
+}
 
-	/* Check the stack guard band. */
-	thread_checkstack(cur);
-
-	/* Lock the run queue. */
-	spinlock_acquire(&curcpu->c_runqueue_lock);
+/*
+ * Return true if something waiting should run ahead of thread T:
+ * it has a higher priority, or the same one at a higher level.
+ */
+static
+bool
+runqueue_has_better(struct cpu *c, struct thread *t)
+{
+	struct thread *best;
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
-		spinlock_release(&curcpu->c_runqueue_lock);
-		splx(spl);
-		return;
+	best = runqueue_peek(c);
+	if (best == NULL) {
+		return false;
 	}
+	return best->t_epriority > t->t_epriority ||
+		(best->t_epriority == t->t_epriority &&
+		 best->t_level < t->t_level);
+}
+
+/*
+ * Idle cpus don't tick, so they no longer notice on their own that
+ * some other cpu has work queued. When a thread has to wait on the
+ * busy cpu BUSY, poke one idle cpu so it wakes up and tries to steal.
+ * The other cpus' state is read without their locks; it's a hint.
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	struct cpu *c;
+	unsigned i;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c->c_isidle && c->c_tickperiod == 0) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
+/*
+ * Let TARGETCPU know that threads have been added to its run queue.
+ * ISIDLE is whether it was idle beforehand. The caller holds its
+ * runqueue lock. This sends at most one IPI.
+ */
+static
+void
+runqueue_notify(struct cpu *targetcpu, bool isidle)
+{
+	KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
+
+	if (isidle) {
+		/*
+		 * Other processor is idle; send interrupt to make
+		 * sure it unidles.
+		 */
+		ipi_send(targetcpu, IPI_UNIDLE);
+	}
+	else {
+		if (targetcpu->c_tickperiod != 1) {
+			/*
+			 * It's running one thread with the hardclock
+			 * deferred; it needs to tick again so the new
+			 * thread gets a turn.
+			 */
+			if (targetcpu == curcpu->c_self) {
+				hardclock_resume();
+			}
+			else {
+				ipi_send(targetcpu, IPI_UNIDLE);
+			}
+		}
+		thread_kick_idle(targetcpu);
+	}
+}
+
+/*
+ * Remote wakeup inbox.
+ *
+ * Putting a thread on another cpu's run queue means taking its
+ * runqueue lock, which that cpu holds for the whole of thread_switch.
+ * So instead each cpu has an inbox: a lock-free stack of threads,
+ * linked through t_inboxnext, that other cpus push onto with
+ * atomic_cas. Only a cpu holding the owner's runqueue lock drains it,
+ * taking everything at once with atomic_swap and putting it on the
+ * owner's run queue. Since nothing is ever popped singly there is no
+ * ABA problem.
+ *
+ * The owner drains its inbox whenever it's about to look at its run
+ * queue: in thread_switch (each time around the idle loop too), in
+ * thread_timeslice, and on IPI_UNIDLE. A cpu stealing work also
+ * drains its victim's inbox, under the victim's runqueue lock, so the
+ * threads waiting there can be stolen too.
+ *
+ * c_inboxcount counts the threads in the inbox, so that choosing a
+ * cpu by load (cpu_load) sees them. It's raised before a push and
+ * lowered after a drain, so it's never less than the true number.
+ *
+ * After pushing, the waker reads c_isidle and c_tickperiod to decide
+ * whether to send an IPI; the owner sets those before it checks the
+ * inbox for the last time. So either the owner sees the thread or
+ * the waker sees that the owner needs waking. (This depends on
+ * stores not being reordered after later loads, which is true on
+ * System/161.)
+ */
+static
+void
+inbox_push(struct cpu *c, struct thread *first, struct thread *last,
+	   unsigned n)
+{
+	struct thread *head;
+
+	atomic_add(&c->c_inboxcount, n);
+	do {
+		head = c->c_inbox;
+		last->t_inboxnext = head;
+	} while (atomic_cas_ptr((void *volatile *)&c->c_inbox,
+				head, first) != head);
+}
+
+static
+void
+inbox_drain(struct cpu *c)
+{
+	struct thread *t, *next, *list;
+	unsigned n;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (c->c_inbox == NULL) {
+		return;
+	}
+	t = atomic_swap_ptr((void *volatile *)&c->c_inbox, NULL);
+
+	/* It's a stack; reverse it so threads are queued in order. */
+	list = NULL;
+	n = 0;
+	while (t != NULL) {
+		next = t->t_inboxnext;
+		t->t_inboxnext = list;
+		list = t;
+		t = next;
+		n++;
+	}
+	atomic_add(&c->c_inboxcount, -n);
+	while (list != NULL) {
+		next = list->t_inboxnext;
+		list->t_inboxnext = NULL;
+		runqueue_add(c, list);
+		list = next;
+	}
+}
+
+/*
+ * The number of threads waiting to run on C, whether on its run queue
+ * or in its inbox. Read without locking, as a hint.
+ */
+static
+unsigned
+cpu_load(struct cpu *c)
+{
+	return c->c_runcount + c->c_inboxcount;
+}
+
+/*
+ * Let TARGETCPU know that threads have been put in its inbox. This
+ * is runqueue_notify without the lock.
+ */
+static
+void
+inbox_notify(struct cpu *targetcpu)
+{
+	if (targetcpu->c_isidle || targetcpu->c_tickperiod != 1) {
+		ipi_send(targetcpu, IPI_UNIDLE);
+	}
+	else {
+		thread_kick_idle(targetcpu);
+	}
+}
+
+/*
+ * Make a thread runnable.
+ *
+ * targetcpu might be curcpu; it might not be, too. If it isn't, and
+ * we don't already hold its lock, the thread goes in its inbox.
+ */
+static
+void
+thread_make_runnable(struct thread *target, bool already_have_lock)
+{
+	struct cpu *targetcpu;
+	bool isidle;
+
+	targetcpu = target->t_cpu;
+
+	if (!already_have_lock && targetcpu != curcpu->c_self) {
+		inbox_push(targetcpu, target, target, 1);
+		inbox_notify(targetcpu);
+		return;
+	}
+
+	/* Lock the run queue of the target thread's cpu. */
+	if (already_have_lock) {
+		/* The target thread's cpu should be already locked. */
+		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
+	}
+	else {
+		spinlock_acquire(&targetcpu->c_runqueue_lock);
+	}
+
+	isidle = targetcpu->c_isidle;
+	runqueue_add(targetcpu, target);
+	runqueue_notify(targetcpu, isidle);
+
+	if (!already_have_lock) {
+		spinlock_release(&targetcpu->c_runqueue_lock);
+	}
+}
+
+/*
+ * Create a new thread based on an existing one.
+ *
+ * The new thread has name NAME, and starts executing in function
+ * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
+ *
+ * The new thread is created in the process P. If P is null, the
+ * process is inherited from the caller. It will start on the same CPU
+ * as the caller, unless the scheduler intervenes first.
+ */
+int
+thread_fork(const char *name,
+	    struct proc *proc,
+	    void (*entrypoint)(void *data1, unsigned long data2),
+	    void *data1, unsigned long data2)
+{
+	struct thread *newthread;
+	int result;
+
+#ifdef UW
+	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
+#endif // UW
+
+	newthread = thread_create(name);
+	if (newthread == NULL) {
+		return ENOMEM;
+	}
+
+	/* Allocate a stack, unless it came with one from the cache */
+	if (newthread->t_stack == NULL) {
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
+	}
+
+	/*
+	 * Now we clone various fields from the parent thread.
+	 */
+
+	/* Thread subsystem fields */
+	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_priority = curthread->t_priority;
+	newthread->t_epriority = curthread->t_priority;
+
+	/* Attach the new thread to its process */
+	if (proc == NULL) {
+		proc = curthread->t_proc;
+	}
+	result = proc_addthread(proc, newthread);
+	if (result) {
+		/* thread_destroy will clean up the stack */
+		thread_destroy(newthread);
+		return result;
+	}
+
+	/*
+	 * Because new threads come out holding the cpu runqueue lock
+	 * (see notes at bottom of thread_switch), we need to account
+	 * for the spllower() that will be done releasing it.
+	 */
+	newthread->t_iplhigh_count++;
+
+	/* Set up the switchframe so entrypoint() gets called */
+	switchframe_init(newthread, entrypoint, data1, data2);
+
+	/* It starts out waiting on the run queue */
+	newthread->t_stamp = gettime_ns();
+
+	/* Lock the current cpu's run queue and make the new thread runnable */
+	thread_make_runnable(newthread, false);
+
+	return 0;
+}
+
+/*
+ * Scheduler accounting.
+ *
+ * Each thread's t_stamp is updated whenever it changes state, and
+ * the time since the previous change is charged to the appropriate
+ * counter: running (sched_account_run, when it's switched out),
+ * waiting on a run queue (sched_account_wait, when it's switched
+ * in), or asleep (sched_account_sleep, when it's woken up). The
+ * latter also charges the sleep to the name of the wait channel, in
+ * the waker's cpu's table, so wakeups on different cpus don't share
+ * anything; thread_printstats adds the tables up.
+ *
+ * Times come from gettime_ns(), which returns 0 early in boot before
+ * the clock exists; intervals touching such a time count as 0.
+ */
+
+static
+uint64_t
+sched_interval(uint64_t then, uint64_t now)
+{
+	if (then == 0 || now < then) {
+		return 0;
+	}
+	return now - then;
+}
+
+static
+unsigned
+sched_histbucket(uint64_t ns)
+{
+	unsigned b;
+
+	ns >>= 11;
+	for (b = 0; ns > 0 && b < SCHED_HISTBUCKETS - 1; b++) {
+		ns >>= 1;
+	}
+	return b;
+}
+
+/*
+ * Find the slot for wait channel name NAME in TABLE, which is either
+ * this cpu's (and we're at splhigh) or private to the caller.
+ */
+static
+struct wchanstat *
+wchanstats_lookup(struct wchanstat *table, const char *name)
+{
+	struct wchanstat *ws;
+	unsigned hash, i, j;
+
+	hash = 0;
+	for (j = 0; j < WCHANSTATS_NAMELEN - 1 && name[j] != 0; j++) {
+		hash = hash * 31 + (unsigned char)name[j];
+	}
+
+	for (i = 0; i < WCHANSTATS_SIZE - 1; i++) {
+		ws = &table[(hash + i) % (WCHANSTATS_SIZE - 1)];
+		if (ws->ws_name[0] == 0) {
+			/* Empty slot: claim it. */
+			for (j = 0; j < WCHANSTATS_NAMELEN - 1 &&
+				     name[j] != 0; j++) {
+				ws->ws_name[j] = name[j];
+			}
+			ws->ws_name[j] = 0;
+			return ws;
+		}
+		for (j = 0; j < WCHANSTATS_NAMELEN - 1; j++) {
+			if (ws->ws_name[j] != name[j] || name[j] == 0) {
+				break;
+			}
+		}
+		if (j == WCHANSTATS_NAMELEN - 1 || ws->ws_name[j] == name[j]) {
+			return ws;
+		}
+	}
+
+	/* Full; lump it in with the rest. */
+	ws = &table[WCHANSTATS_SIZE - 1];
+	if (ws->ws_name[0] == 0) {
+		strcpy(ws->ws_name, "(other)");
+	}
+	return ws;
+}
+
+/*
+ * Charge the time since T's last state change to running, on this
+ * cpu. T is the current thread, being switched out.
+ */
+static
+void
+sched_account_run(struct thread *t, uint64_t now)
+{
+	uint64_t ran;
+
+	ran = sched_interval(t->t_stamp, now);
+	t->t_stamp = now;
+	t->t_runtime += ran;
+	t->t_nswitches++;
+
+	curcpu->c_busytime += ran;
+	curcpu->c_nswitches++;
+	curcpu->c_runhist[sched_histbucket(ran)]++;
+}
+
+/*
+ * Charge the time since T's last state change to waiting to run. T
+ * is about to be switched in on this cpu.
+ */
+static
+void
+sched_account_wait(struct thread *t, uint64_t now)
+{
+	uint64_t waited;
+
+	waited = sched_interval(t->t_stamp, now);
+	t->t_stamp = now;
+	t->t_waittime += waited;
+
+	curcpu->c_waithist[sched_histbucket(waited)]++;
+}
+
+/*
+ * Charge the time since T's last state change to sleeping on the
+ * wait channel it's on. T is being woken up and belongs to the caller.
+ */
+static
+void
+sched_account_sleep(struct thread *t)
+{
+	struct wchanstat *ws;
+	uint64_t now, slept;
+	int spl;
+
+	now = gettime_ns();
+	slept = sched_interval(t->t_stamp, now);
+	t->t_stamp = now;
+	t->t_sleeptime += slept;
+
+	/* Stay on this cpu, and keep its interrupts out of the table. */
+	spl = splhigh();
+	ws = wchanstats_lookup(curcpu->c_wchanstats, t->t_wchan_name);
+	ws->ws_count++;
+	ws->ws_time += slept;
+	curcpu->c_sleephist[sched_histbucket(slept)]++;
+	splx(spl);
+}
+
+/*
+ * Print a histogram HIST, of which there are SCHED_HISTBUCKETS
+ * buckets, on one line per nonempty bucket.
+ */
+static
+void
+sched_printhist(const char *title, const unsigned *hist)
+{
+	unsigned b;
+
+	kprintf("%s:\n", title);
+	for (b = 0; b < SCHED_HISTBUCKETS; b++) {
+		if (hist[b] == 0) {
+			continue;
+		}
+		if (b == SCHED_HISTBUCKETS - 1) {
+			kprintf("  >= %7lu us: %u\n",
+				(unsigned long)(1UL << (b + 10)) / 1000,
+				hist[b]);
+		}
+		else {
+			kprintf("   < %7lu us: %u\n",
+				(unsigned long)(1UL << (b + 11)) / 1000,
+				hist[b]);
+		}
+	}
+}
+
+/*
+ * High level, machine-independent context switch code.
+ *
+ * The current thread is queued appropriately and its state is changed
+ * to NEWSTATE; another thread to run is selected and switched to.
+ *
+ * If NEWSTATE is S_SLEEP, the thread is queued on the wait channel
+ * WC. Otherwise WC should be NULL.
+ */
+static
+void
+thread_switch(threadstate_t newstate, struct wchan *wc)
+{
+	struct thread *cur, *next, *yieldto;
+	uint64_t now, then;
+	bool idled;
+	int spl;
+
+	DEBUGASSERT(curcpu->c_curthread == curthread);
+	DEBUGASSERT(curthread->t_cpu == curcpu->c_self);
+
+	/* Explicitly disable interrupts on this processor */
+	spl = splhigh();
+
+	cur = curthread;
+
+	/*
+	 * If we're idle, return without doing anything. This happens
+	 * when the timer interrupt interrupts the idle loop.
+	 */
+	if (curcpu->c_isidle) {
+		splx(spl);
+		return;
+	}
+
+	/* Check the stack guard band. */
+	thread_checkstack(cur);
+
+	/* Take the directed-yield hint; it's good for one switch. */
+	yieldto = cur->t_yieldto;
+	cur->t_yieldto = NULL;
+
+	/* Lock the run queue, and collect any remote wakeups. */
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	inbox_drain(curcpu->c_self);
+
+	/* Micro-optimization: if nothing to do, just return */
+	if (newstate == S_READY && curcpu->c_runcount == 0) {
+		spinlock_release(&curcpu->c_runqueue_lock);
+		splx(spl);
+		return;
+	}
+
+	/*
+	 * Charge the time run to the thread. This has to happen
+	 * before it's on a wait channel, where someone could wake it
+	 * up and look at t_stamp.
+	 */
+	now = gettime_ns();
+	sched_account_run(cur, now);
 
 	/* Put the thread in the right place. */
 	switch (newstate) {
@@ -602,7 +1353,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		 * or want it locked and if it does can lock it itself
 		 * without racing. Exercise: what's the other?)
 		 */
-		threadlist_addtail(&wc->wc_threads, cur);
+		threadlist_addtail(&wchan_sq(wc)->sq_threads, cur);
+		cur->t_wchan = wc;
 		wchan_unlock(wc);
 		break;
 	    case S_ZOMBIE:
@@ -613,10 +1365,25 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call md_idle().
-	 * curcpu->c_isidle must be true when md_idle is
-	 * called. Unlock the runqueue while idling too, to make sure
-	 * things can be added to it.
+	 * If we were asked to yield to a particular thread (by
+	 * thread_yield_to or a handoff wakeup), and it's waiting here,
+	 * run it next, ahead of everything else of its priority. It
+	 * doesn't jump ahead of higher-priority threads (see the
+	 * priority rules below); then the hint is just dropped.
+	 */
+	next = NULL;
+	if (yieldto != NULL && yieldto != cur &&
+	    runqueue_contains(curcpu, yieldto) &&
+	    yieldto->t_epriority >= runqueue_peek(curcpu)->t_epriority) {
+		next = runqueue_remove(curcpu, yieldto);
+	}
+
+	/*
+	 * Get the next thread. While there isn't one, try to steal
+	 * work from another cpu, and if there's nothing to steal
+	 * either, call md_idle(). curcpu->c_isidle must be true when
+	 * md_idle is called. Unlock the runqueue while idling too, to
+	 * make sure things can be added to it.
 	 *
 	 * Note that we don't need to unlock the runqueue atomically
 	 * with idling; becoming unidle requires receiving an
@@ -627,19 +1394,38 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
+	 *
+	 * The hardclock is stopped while we idle; an idle cpu has
+	 * nothing to preempt, and anyone who gives us work sends an
+	 * IPI. Because idle cpus no longer poll, busy cpus kick an
+	 * idle one (thread_kick_idle) when threads have to wait.
 	 */
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
-	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+	idled = false;
+	while (next == NULL) {
+		inbox_drain(curcpu->c_self);
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
+			hardclock_stop();
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (thread_steal(true) == 0) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
+			idled = true;
 		}
-	} while (next == NULL);
+	}
 	curcpu->c_isidle = false;
+	hardclock_resume();
+
+	if (idled) {
+		then = now;
+		now = gettime_ns();
+		curcpu->c_idletime += sched_interval(then, now);
+	}
+	sched_account_wait(next, now);
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -784,192 +1570,635 @@ thread_exit(void)
 
 	cur = curthread;
 
-#ifdef UW
-	/* threads for user processes should have detached from their process
-	   in sys__exit */
-	KASSERT(curproc == kproc || curproc == NULL);	
-	/* kernel threads don't go through sys__exit, so we detach them from kproc here */
-	if (curproc == kproc) {
-	  proc_remthread(cur);
+#ifdef UW
+	/* threads for user processes should have detached from their process
+	   in sys__exit */
+	KASSERT(curproc == kproc || curproc == NULL);	
+	/* kernel threads don't go through sys__exit, so we detach them from kproc here */
+	if (curproc == kproc) {
+	  proc_remthread(cur);
+	}
+#else // UW
+	proc_remthread(cur);
+#endif // UW
+
+	/* Make sure we *are* detached (move this only if you're sure!) */
+	KASSERT(cur->t_proc == NULL);
+
+	/* Check the stack guard band. */
+	thread_checkstack(cur);
+
+	/* Exiting holding a contended lock would strand its waiters. */
+	KASSERT(cur->t_piheld == NULL);
+
+	/* Interrupts off on this processor */
+        splhigh();
+	thread_switch(S_ZOMBIE, NULL);
+	panic("The zombie walks!\n");
+}
+
+/*
+ * Yield the cpu to another process, but stay runnable.
+ */
+void
+thread_yield(void)
+{
+	thread_switch(S_READY, NULL);
+}
+
+/*
+ * Yield the cpu, preferring thread T as the next thread to run.
+ */
+void
+thread_yield_to(struct thread *t)
+{
+	curthread->t_yieldto = t;
+	thread_switch(S_READY, NULL);
+}
+
+/*
+ * Check if thread T is running right now on some other cpu.
+ *
+ * The caller must keep T from exiting (e.g. T holds a lock the caller
+ * has spinlocked); the answer is only a hint, since T can block or be
+ * preempted as soon as we've looked.
+ */
+bool
+thread_oncpu(struct thread *t)
+{
+	struct cpu *c;
+
+	c = t->t_cpu;
+	return c != NULL && c != curcpu->c_self &&
+		t->t_state == S_RUN && c->c_curthread == t;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Scheduler.
+ *
+ * Each cpu's run queue is a multi-level feedback queue. thread_switch
+ * always runs the first thread of the highest-priority nonempty level;
+ * within a level threads run round-robin. The rules are:
+ *
+ *    - New threads start at level 0.
+ *    - A thread that uses up its whole quantum at a level is demoted
+ *      one level (thread_timeslice).
+ *    - A thread woken up from a wait channel gave up the cpu on its
+ *      own, so it is promoted one level (thread_wakeup_boost).
+ *    - Periodically everything goes back to level 0 (schedule).
+ *
+ * The upshot is that threads that mostly wait for I/O stay near the
+ * top and get the cpu promptly when they wake up, while CPU-bound
+ * threads sink to the bottom and run in longer slices behind them.
+ */
+
+/*
+ * Promote a thread that is being woken up from a wait channel. The
+ * caller must own the thread, that is, have just taken it off the
+ * wait channel and not yet made it runnable.
+ */
+static
+void
+thread_wakeup_boost(struct thread *t)
+{
+	if (t->t_level > 0) {
+		t->t_level--;
+	}
+	t->t_quantum_used = 0;
+}
+
+/*
+ * Priorities.
+ *
+ * On top of the feedback levels, each thread has a base priority
+ * (t_priority) that it sets for itself, and an effective priority
+ * (t_epriority) that is the base plus whatever waiters for locks it
+ * holds have donated (see synch.c). Effective priority always comes
+ * first: a thread never waits on a run queue or a wait channel
+ * behind one of lower effective priority. The feedback levels only
+ * order threads of equal priority.
+ */
+
+/*
+ * Change thread T's effective priority to EPRI, moving it in its run
+ * queue if it's on one. Used by synch.c for priority inheritance.
+ */
+void
+thread_repriority(struct thread *t, unsigned epri)
+{
+	struct cpu *c;
+
+	KASSERT(epri <= PRI_MAX);
+
+	/* T can migrate until we hold its cpu's lock. */
+	while (1) {
+		c = t->t_cpu;
+		spinlock_acquire(&c->c_runqueue_lock);
+		if (t->t_cpu == c) {
+			break;
+		}
+		spinlock_release(&c->c_runqueue_lock);
+	}
+
+	if (t->t_state == S_READY && runqueue_remove(c, t) != NULL) {
+		t->t_epriority = epri;
+		runqueue_add(c, t);
+	}
+	else {
+		t->t_epriority = epri;
+	}
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+/*
+ * Set the current thread's base priority. If that leaves it behind
+ * something else waiting to run here, yield to it.
+ */
+void
+thread_setpriority(unsigned pri)
+{
+	struct thread *cur;
+	bool preempt;
+
+	KASSERT(pri <= PRI_MAX);
+
+	cur = curthread;
+	cur->t_priority = pri;
+	lock_pi_recompute(cur);
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	preempt = runqueue_has_better(curcpu, cur);
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
+}
+
+/*
+ * Get the current thread's effective priority.
+ */
+unsigned
+thread_getpriority(void)
+{
+	return curthread->t_epriority;
+}
+
+/*
+ * Called from hardclock() on every tick. Charge the ticks to the
+ * current thread; if it has used up its quantum, demote it and yield.
+ * Otherwise yield only if a higher-priority thread has become
+ * runnable in the meantime.
+ *
+ * If the run queue is empty there is nobody to yield to, so instead
+ * of taking a tick every period until something happens, defer the
+ * next hardclock until the quantum would run out. Whoever adds a
+ * thread to our run queue resumes the ticks (thread_make_runnable).
+ */
+void
+thread_timeslice(unsigned nticks)
+{
+	struct thread *cur;
+	bool preempt;
+
+	cur = curthread;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (curcpu->c_isidle) {
+		/* Nothing is running; there is nobody to charge. */
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return;
+	}
+	inbox_drain(curcpu->c_self);
+
+	preempt = false;
+	cur->t_quantum_used += nticks;
+	if (cur->t_quantum_used >= sched_quantum[cur->t_level]) {
+		cur->t_quantum_used = 0;
+		if (cur->t_level < SCHED_NLEVELS - 1) {
+			cur->t_level++;
+		}
+		preempt = true;
+	}
+	else if (runqueue_has_better(curcpu, cur)) {
+		preempt = true;
+	}
+	if (curcpu->c_runcount == 0) {
+		preempt = false;
+		hardclock_defer(sched_quantum[cur->t_level] -
+				cur->t_quantum_used);
+		/* Catch a remote wakeup that raced with the deferral. */
+		if (curcpu->c_inbox != NULL) {
+			hardclock_resume();
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
+}
+
+/*
+ * This is called periodically from hardclock(). It reshuffles the
+ * current CPU's run queue by job priority: every SCHED_BOOST_PERIOD
+ * calls, all threads are moved back to level 0 so that CPU-bound
+ * threads that have sunk to the bottom are not starved.
+ */
+void
+schedule(void)
+{
+	struct thread *t;
+	unsigned i;
+
+	if (--curcpu->c_schedboost > 0) {
+		return;
+	}
+	curcpu->c_schedboost = SCHED_BOOST_PERIOD;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<SCHED_NLEVELS; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i]))
+		       != NULL) {
+			t->t_level = 0;
+			t->t_quantum_used = 0;
+			runqueue_insert(&curcpu->c_runqueue[0], t);
+		}
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_level = 0;
+		curthread->t_quantum_used = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
+
+/*
+ * Thread migration.
+ *
+ * Load balancing is pull-based: a cpu takes work from the busiest
+ * other cpu rather than pushing its own work elsewhere. An idle cpu
+ * does this from the idle loop in thread_switch before it goes to
+ * sleep in cpu_idle(), and busy cpus do it periodically from
+ * hardclock() through thread_consider_migration() if they are
+ * noticeably less loaded than the busiest one.
+ *
+ * The loads of the other cpus are sampled without taking their
+ * runqueue locks, so they're only a hint; the only lock taken is the
+ * chosen victim's, and never while holding our own. Threads are taken
+ * from the tail of the victim's run queue, which is the
+ * lowest-priority work and the work that would run there last.
+ *
+ * Migrating threads isn't free because of cache affinity; a thread's
+ * working cache set will end up having to be moved to the other CPU,
+ * which is fairly slow. The tradeoff between this performance loss
+ * and the performance loss due to underutilization of some CPUs is
+ * something that needs to be tuned and probably is workload-specific.
+ *
+ * For here and now, because we know we're running on System/161 and
+ * System/161 does not (yet) model such cache effects, we'll be very
+ * aggressive: an idle cpu will take half of any nonempty run queue.
+ */
+static
+unsigned
+thread_steal(bool idle)
+{
+	struct cpu *c, *victim;
+	struct threadlist stolen;
+	struct thread *t;
+	unsigned i, numcpus, load, maxload, want, got;
+
+	numcpus = cpuarray_num(&allcpus);
+
+	/* Find the busiest other cpu. */
+	victim = NULL;
+	maxload = 0;
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		load = cpu_load(c);
+		if (load > maxload) {
+			maxload = load;
+			victim = c;
+		}
+	}
+
+	if (idle) {
+		if (maxload == 0) {
+			return 0;
+		}
+		want = (maxload + 1) / 2;
 	}
-#else // UW
-	proc_remthread(cur);
-#endif // UW
+	else {
+		load = cpu_load(curcpu->c_self);
+		if (maxload <= load + 1) {
+			return 0;
+		}
+		want = (maxload - load) / 2;
+	}
+	KASSERT(victim != NULL);
+
+	threadlist_init(&stolen);
+	got = 0;
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	/* Threads in its inbox count as its load; make them stealable. */
+	inbox_drain(victim);
+	while (got < want) {
+		t = runqueue_remtail(victim);
+		if (t == NULL) {
+			break;
+		}
+		/*
+		 * The victim's curthread can be on its run queue if it
+		 * went to sleep, the victim went idle, and it was woken
+		 * up again before the victim finished unidling. It
+		 * must not be migrated (see the notes in
+		 * thread_switch), so put it back and stop.
+		 */
+		if (t == victim->c_curthread) {
+			runqueue_add(victim, t);
+			break;
+		}
+		t->t_cpu = curcpu->c_self;
+		t->t_nmigrations++;
+		curcpu->c_nmigrations++;
+		threadlist_addhead(&stolen, t);
+		got++;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
 
-	/* Make sure we *are* detached (move this only if you're sure!) */
-	KASSERT(cur->t_proc == NULL);
+	if (got > 0) {
+		DEBUG(DB_THREADS, "cpu %u: stole %u threads from cpu %u\n",
+		      curcpu->c_number, got, victim->c_number);
 
-	/* Check the stack guard band. */
-	thread_checkstack(cur);
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		while ((t = threadlist_remhead(&stolen)) != NULL) {
+			runqueue_add(curcpu, t);
+		}
+		spinlock_release(&curcpu->c_runqueue_lock);
+	}
 
-	/* Interrupts off on this processor */
-        splhigh();
-	thread_switch(S_ZOMBIE, NULL);
-	panic("The zombie walks!\n");
+	threadlist_cleanup(&stolen);
+	return got;
 }
 
 /*
- * Yield the cpu to another process, but stay runnable.
+ * Periodic load balancing, called from hardclock(). If some other cpu
+ * has a noticeably longer run queue than ours, pull part of the
+ * difference across.
  */
 void
-thread_yield(void)
+thread_consider_migration(void)
 {
-	thread_switch(S_READY, NULL);
+	thread_steal(false);
 }
 
 ////////////////////////////////////////////////////////////
 
 /*
- * Scheduler.
+ * Wakeup placement.
+ *
+ * When a thread is woken up, choose which cpu to put it on:
+ *
+ *    - its previous cpu, if that cpu is idle or lightly loaded,
+ *      because the thread's cache footprint is likely still there;
+ *    - otherwise, an idle cpu, so it runs right away;
+ *    - otherwise, the waker's cpu.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * The other cpus' state is read without their locks (c_isidle and
+ * cpu_load are hints), so the choice can be wrong; work stealing
+ * will clean up after it.
+ *
+ * A thread that has just gone to sleep may still be running on its
+ * old cpu's stack, finishing thread_switch. That cpu holds its
+ * runqueue lock until the switch is complete, except while it sits
+ * in the idle loop, in which case it is still its c_curthread. So
+ * before moving the thread, lock the old cpu's run queue and check.
+ */
+#define WAKEUP_LIGHTLOAD	1	/* Max queued threads for "light" */
+
+/*
+ * Move thread T, which is being woken up, to cpu TARGET. Returns
+ * false if it couldn't be moved because it's still on its old cpu's
+ * stack.
  */
+static
+bool
+thread_wakeup_move(struct thread *t, struct cpu *target)
+{
+	struct cpu *prev;
+	bool ret;
+
+	prev = t->t_cpu;
+	if (target == prev) {
+		return true;
+	}
+
+	spinlock_acquire(&prev->c_runqueue_lock);
+	ret = prev->c_curthread != t;
+	spinlock_release(&prev->c_runqueue_lock);
+	if (ret) {
+		t->t_cpu = target;
+	}
+	return ret;
+}
 
+/* Where to start looking for an idle cpu; spreads out wakeall */
+static unsigned wakeup_rotor;
+
+static
 void
-schedule(void)
+thread_wakeup_place(struct thread *t)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct cpu *prev, *target, *c;
+	unsigned i, n, start, place;
+	int spl;
+
+	prev = t->t_cpu;
+	target = NULL;
+	place = WAKEUP_PREV;
+
+	if (prev->c_isidle || cpu_load(prev) <= WAKEUP_LIGHTLOAD) {
+		target = prev;
+	}
+	else {
+		n = cpuarray_num(&allcpus);
+		start = wakeup_rotor++;
+		for (i=0; i<n; i++) {
+			c = cpuarray_get(&allcpus, (start + i) % n);
+			if (c != prev && c->c_isidle) {
+				target = c;
+				place = WAKEUP_IDLE;
+				break;
+			}
+		}
+		if (target == NULL) {
+			target = curcpu->c_self;
+			if (target != prev) {
+				place = WAKEUP_WAKER;
+			}
+		}
+	}
+
+	if (!thread_wakeup_move(t, target)) {
+		target = prev;
+		place = WAKEUP_PREV;
+	}
+
+	spl = splhigh();
+	curcpu->c_wakeups[place]++;
+	if (target != prev) {
+		t->t_nmigrations++;
+		curcpu->c_nmigrations++;
+	}
+	splx(spl);
 }
 
 /*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Print scheduler statistics: per-cpu counters and histograms, then
+ * sleep time by wait channel, with the cpus' tables merged. The
+ * per-cpu numbers are read without locking, so they may be slightly
+ * inconsistent.
  */
 void
-thread_consider_migration(void)
+thread_printstats(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
+	unsigned waithist[SCHED_HISTBUCKETS], runhist[SCHED_HISTBUCKETS];
+	unsigned hist[SCHED_HISTBUCKETS];
+	struct wchanstat *merged, *mws, ws;
 	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	unsigned spins, blocks;
+	unsigned i, j, b;
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
+	for (b = 0; b < SCHED_HISTBUCKETS; b++) {
+		waithist[b] = runhist[b] = hist[b] = 0;
+	}
+
+	kprintf("cpu    busy ms    idle ms   switches   migrated"
+		"  wake:prev  wake:idle wake:waker\n");
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+		kprintf("%3u %10lu %10lu %10u %10u %10u %10u %10u\n",
+			c->c_number,
+			(unsigned long)(c->c_busytime / 1000000),
+			(unsigned long)(c->c_idletime / 1000000),
+			c->c_nswitches, c->c_nmigrations,
+			c->c_wakeups[WAKEUP_PREV],
+			c->c_wakeups[WAKEUP_IDLE],
+			c->c_wakeups[WAKEUP_WAKER]);
+		for (b = 0; b < SCHED_HISTBUCKETS; b++) {
+			waithist[b] += c->c_waithist[b];
+			runhist[b] += c->c_runhist[b];
+			hist[b] += c->c_sleephist[b];
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	kprintf("cpu  lock spins lock sleeps  spun %%\n");
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		spins = c->c_lockspins;
+		blocks = c->c_lockblocks;
+		kprintf("%3u %11u %11u %5u%%\n", c->c_number, spins, blocks,
+			spins + blocks == 0 ? 0 :
+			(unsigned)(100ULL * spins / (spins + blocks)));
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
-	}
-	spinlock_release(&curcpu->c_runqueue_lock);
+	sched_printhist("Run queue latency (all cpus)", waithist);
+	sched_printhist("Time run before switching (all cpus)", runhist);
+
+	sched_printhist("Time asleep (all wait channels)", hist);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
+	merged = kmalloc(WCHANSTATS_SIZE * sizeof(struct wchanstat));
+	if (merged == NULL) {
+		kprintf("No memory for wait channel stats\n");
+		return;
+	}
+	bzero(merged, WCHANSTATS_SIZE * sizeof(struct wchanstat));
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
 		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
+		for (j = 0; j < WCHANSTATS_SIZE; j++) {
+			/* It may be changing; take a copy. */
+			ws = c->c_wchanstats[j];
+			if (ws.ws_count == 0) {
 				continue;
 			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+			ws.ws_name[WCHANSTATS_NAMELEN - 1] = 0;
+			mws = wchanstats_lookup(merged, ws.ws_name);
+			mws->ws_count += ws.ws_count;
+			mws->ws_time += ws.ws_time;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+	kprintf("wait channel         sleeps   total ms    avg us\n");
+	for (i = 0; i < WCHANSTATS_SIZE; i++) {
+		mws = &merged[i];
+		if (mws->ws_count == 0) {
+			continue;
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+		kprintf("%-16s %10u %10lu %9lu\n", mws->ws_name,
+			mws->ws_count,
+			(unsigned long)(mws->ws_time / 1000000),
+			(unsigned long)(mws->ws_time / mws->ws_count / 1000));
 	}
-
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	kfree(merged);
 }
 
-////////////////////////////////////////////////////////////
-
 /*
  * Wait channel functions
  */
 
+static
+void
+sleepq_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<SLEEPQ_SIZE; i++) {
+		threadlist_init(&sleepqs[i].sq_threads);
+		spinlock_init(&sleepqs[i].sq_lock);
+	}
+}
+
+static
+struct sleepq *
+wchan_sq(struct wchan *wc)
+{
+	uintptr_t key = (uintptr_t)wc;
+
+	return &sleepqs[((key >> 3) ^ (key >> 9)) & (SLEEPQ_SIZE - 1)];
+}
+
 /*
- * Create a wait channel. NAME is a symbolic string name for it.
- * This is what's displayed by ps -alx in Unix.
+ * Set up a wait channel in storage provided by the caller. NAME is a
+ * symbolic string name for it. This is what's displayed by ps -alx
+ * in Unix.
  *
  * NAME should generally be a string constant. If it isn't, alternate
  * arrangements should be made to free it after the wait channel is
- * destroyed.
+ * cleaned up.
+ */
+void
+wchan_init(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
+}
+
+/*
+ * Clean up a wait channel. Must be empty and unlocked.
+ */
+void
+wchan_cleanup(struct wchan *wc)
+{
+	KASSERT(wchan_isempty(wc));
+	wc->wc_name = NULL;
+}
+
+/*
+ * Create and destroy a wait channel in its own memory.
  */
 struct wchan *
 wchan_create(const char *name)
@@ -980,21 +2209,14 @@ wchan_create(const char *name)
 	if (wc == NULL) {
 		return NULL;
 	}
-	spinlock_init(&wc->wc_lock);
-	threadlist_init(&wc->wc_threads);
-	wc->wc_name = name;
+	wchan_init(wc, name);
 	return wc;
 }
 
-/*
- * Destroy a wait channel. Must be empty and unlocked.
- * (The corresponding cleanup functions require this.)
- */
 void
 wchan_destroy(struct wchan *wc)
 {
-	spinlock_cleanup(&wc->wc_lock);
-	threadlist_cleanup(&wc->wc_threads);
+	wchan_cleanup(wc);
 	kfree(wc);
 }
 
@@ -1004,13 +2226,13 @@ wchan_destroy(struct wchan *wc)
 void
 wchan_lock(struct wchan *wc)
 {
-	spinlock_acquire(&wc->wc_lock);
+	spinlock_acquire(&wchan_sq(wc)->sq_lock);
 }
 
 void
 wchan_unlock(struct wchan *wc)
 {
-	spinlock_release(&wc->wc_lock);
+	spinlock_release(&wchan_sq(wc)->sq_lock);
 }
 
 /*
@@ -1028,6 +2250,68 @@ wchan_sleep(struct wchan *wc)
 	thread_switch(S_SLEEP, wc);
 }
 
+/*
+ * Take the thread that should be woken first off a wait channel: the
+ * one with the highest effective priority, and the one that's waited
+ * longest among those. Priorities of sleeping threads can change
+ * (through priority inheritance), so the list isn't kept sorted; it
+ * is searched instead. The channel must be locked.
+ */
+static
+struct thread *
+wchan_pick(struct wchan *wc)
+{
+	struct sleepq *sq = wchan_sq(wc);
+	struct threadlistnode *tln;
+	struct thread *t, *best;
+
+	KASSERT(spinlock_do_i_hold(&sq->sq_lock));
+
+	best = NULL;
+	for (tln = sq->sq_threads.tl_head.tln_next;
+	     tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		t = tln->tln_self;
+		if (t->t_wchan != wc) {
+			continue;
+		}
+		if (best == NULL || t->t_epriority > best->t_epriority) {
+			best = t;
+		}
+	}
+	if (best != NULL) {
+		threadlist_remove(&sq->sq_threads, best);
+	}
+	return best;
+}
+
+/*
+ * Move every thread sleeping on WC to LIST, in the order they went to
+ * sleep. The channel must be locked.
+ */
+static
+void
+wchan_takeall(struct wchan *wc, struct threadlist *list)
+{
+	struct sleepq *sq = wchan_sq(wc);
+	struct threadlistnode *tln, *next;
+	struct thread *t;
+
+	KASSERT(spinlock_do_i_hold(&sq->sq_lock));
+
+	for (tln = sq->sq_threads.tl_head.tln_next;
+	     tln->tln_next != NULL;
+	     tln = next) {
+		next = tln->tln_next;
+		t = tln->tln_self;
+		if (t->t_wchan == wc) {
+			threadlist_remove(&sq->sq_threads, t);
+			t->t_wchan = NULL;
+			threadlist_addtail(list, t);
+		}
+	}
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1037,19 +2321,62 @@ wchan_wakeone(struct wchan *wc)
 	struct thread *target;
 
 	/* Lock the channel and grab a thread from it */
-	spinlock_acquire(&wc->wc_lock);
-	target = threadlist_remhead(&wc->wc_threads);
+	wchan_lock(wc);
+	target = wchan_pick(wc);
+	if (target != NULL) {
+		target->t_wchan = NULL;
+	}
 	/*
 	 * Nobody else can wake up this thread now, so we don't need
 	 * to hang onto the lock.
 	 */
-	spinlock_release(&wc->wc_lock);
+	wchan_unlock(wc);
 
 	if (target == NULL) {
 		/* Nobody was sleeping. */
 		return;
 	}
 
+	thread_wakeup_place(target);
+	thread_wakeup_boost(target);
+	sched_account_sleep(target);
+	thread_make_runnable(target, false);
+}
+
+/*
+ * Wake up one thread sleeping on a wait channel and hand it the cpu:
+ * it is put on the current cpu and becomes our directed-yield target,
+ * so that the next time we block or yield it runs immediately instead
+ * of waiting its turn. Used by the handoff mode of semaphores and
+ * locks, for producer/consumer pairs.
+ */
+void
+wchan_handoff(struct wchan *wc)
+{
+	struct thread *target;
+
+	if (curthread->t_in_interrupt) {
+		/* There's no thread of ours to hand off from. */
+		wchan_wakeone(wc);
+		return;
+	}
+
+	wchan_lock(wc);
+	target = wchan_pick(wc);
+	if (target != NULL) {
+		target->t_wchan = NULL;
+	}
+	wchan_unlock(wc);
+
+	if (target == NULL) {
+		return;
+	}
+
+	if (thread_wakeup_move(target, curcpu->c_self)) {
+		curthread->t_yieldto = target;
+	}
+	thread_wakeup_boost(target);
+	sched_account_sleep(target);
 	thread_make_runnable(target, false);
 }
 
@@ -1059,35 +2386,162 @@ wchan_wakeone(struct wchan *wc)
 void
 wchan_wakeall(struct wchan *wc)
 {
-	struct thread *target;
-	struct threadlist list;
+	struct thread *target, *first, *last;
+	struct threadlist list, batch;
+	struct cpu *targetcpu;
+	unsigned i, n;
+	bool isidle;
 
 	threadlist_init(&list);
+	threadlist_init(&batch);
 
 	/*
 	 * Lock the channel and grab all the threads, moving them to a
 	 * private list.
 	 */
-	spinlock_acquire(&wc->wc_lock);
-	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
-		threadlist_addtail(&list, target);
-	}
+	wchan_lock(wc);
+	wchan_takeall(wc, &list);
 	/*
 	 * Nobody else can wake up these threads now, so we don't need
 	 * to hang onto the lock.
 	 */
-	spinlock_release(&wc->wc_lock);
+	wchan_unlock(wc);
+
+	/* Decide where each one goes. */
+	n = list.tl_count;
+	for (i=0; i<n; i++) {
+		target = threadlist_remhead(&list);
+		thread_wakeup_place(target);
+		thread_wakeup_boost(target);
+		sched_account_sleep(target);
+		threadlist_addtail(&list, target);
+	}
 
 	/*
-	 * We could conceivably sort by cpu first to cause fewer lock
-	 * ops and fewer IPIs, but for now at least don't bother. Just
-	 * make each thread runnable.
+	 * Hand the threads to their cpus a cpu at a time, so each cpu
+	 * is touched once and gets at most one IPI. Take the first
+	 * thread's cpu, then go once around the rest of the list
+	 * pulling out the threads for the same cpu into BATCH; the
+	 * others go back on the tail in their original order.
+	 * (Nobody else can move these threads, so t_cpu is stable.)
+	 *
+	 * Our own cpu's batch goes straight on the run queue. Other
+	 * cpus' batches are linked together and pushed on their inbox
+	 * with a single atomic operation.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+		targetcpu = target->t_cpu;
+		threadlist_addtail(&batch, target);
+
+		n = list.tl_count;
+		for (i=0; i<n; i++) {
+			target = threadlist_remhead(&list);
+			if (target->t_cpu == targetcpu) {
+				threadlist_addtail(&batch, target);
+			}
+			else {
+				threadlist_addtail(&list, target);
+			}
+		}
+
+		if (targetcpu == curcpu->c_self) {
+			spinlock_acquire(&targetcpu->c_runqueue_lock);
+			isidle = targetcpu->c_isidle;
+			while ((target = threadlist_remhead(&batch)) != NULL) {
+				runqueue_add(targetcpu, target);
+			}
+			runqueue_notify(targetcpu, isidle);
+			spinlock_release(&targetcpu->c_runqueue_lock);
+		}
+		else {
+			/* Link it backwards; inbox_drain reverses it. */
+			first = last = NULL;
+			n = batch.tl_count;
+			while ((target = threadlist_remhead(&batch)) != NULL) {
+				target->t_inboxnext = first;
+				first = target;
+				if (last == NULL) {
+					last = target;
+				}
+			}
+			inbox_push(targetcpu, first, last, n);
+			inbox_notify(targetcpu);
+		}
+	}
+
+	threadlist_cleanup(&batch);
+	threadlist_cleanup(&list);
+}
+
+/*
+ * Wake up thread T if, and only if, it is sleeping on WC. Returns
+ * true if T was awakened. Because t_wchan is only changed with the
+ * channel locked, this is O(1) and does not need to search the queue.
+ * Used by callouts and timeouts, which need to wake one particular
+ * sleeper and not whoever happens to be at the head of the queue.
+ */
+bool
+wchan_wakethread(struct wchan *wc, struct thread *t)
+{
+	wchan_lock(wc);
+	if (t->t_wchan != wc) {
+		wchan_unlock(wc);
+		return false;
+	}
+	threadlist_remove(&wchan_sq(wc)->sq_threads, t);
+	t->t_wchan = NULL;
+	wchan_unlock(wc);
+
+	thread_wakeup_place(t);
+	thread_wakeup_boost(t);
+	sched_account_sleep(t);
+	thread_make_runnable(t, false);
+	return true;
+}
+
+/*
+ * Move sleepers from FROM to TO. They're taken off FROM first, so the
+ * two channels (which might share a sleep queue) are never locked at
+ * once; in between, their t_wchan is NULL, so wchan_wakethread on
+ * either channel leaves them alone.
+ */
+unsigned
+wchan_morph(struct wchan *from, struct wchan *to, bool all,
+	    void (*func)(struct thread *, void *), void *arg)
+{
+	struct thread *t;
+	struct threadlist list;
+	unsigned n;
+
+	KASSERT(from != to);
+
+	threadlist_init(&list);
+
+	wchan_lock(from);
+	if (all) {
+		wchan_takeall(from, &list);
+	}
+	else if ((t = wchan_pick(from)) != NULL) {
+		t->t_wchan = NULL;
+		threadlist_addtail(&list, t);
+	}
+	wchan_unlock(from);
+
+	n = 0;
+	if (!threadlist_isempty(&list)) {
+		wchan_lock(to);
+		while ((t = threadlist_remhead(&list)) != NULL) {
+			t->t_wchan = to;
+			t->t_wchan_name = to->wc_name;
+			threadlist_addtail(&wchan_sq(to)->sq_threads, t);
+			func(t, arg);
+			n++;
+		}
+		wchan_unlock(to);
 	}
 
 	threadlist_cleanup(&list);
+	return n;
 }
 
 /*
@@ -1097,11 +2551,21 @@ wchan_wakeall(struct wchan *wc)
 bool
 wchan_isempty(struct wchan *wc)
 {
+	struct sleepq *sq = wchan_sq(wc);
+	struct threadlistnode *tln;
 	bool ret;
 
-	spinlock_acquire(&wc->wc_lock);
-	ret = threadlist_isempty(&wc->wc_threads);
-	spinlock_release(&wc->wc_lock);
+	ret = true;
+	spinlock_acquire(&sq->sq_lock);
+	for (tln = sq->sq_threads.tl_head.tln_next;
+	     tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		if (tln->tln_self->t_wchan == wc) {
+			ret = false;
+			break;
+		}
+	}
+	spinlock_release(&sq->sq_lock);
 
 	return ret;
 }
@@ -1206,4 +2670,21 @@ interprocessor_interrupt(void)
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	if (bits & (1U << IPI_UNIDLE)) {
+		/*
+		 * If we were running a single thread with the hardclock
+		 * deferred, there is now something else to run and we
+		 * need to start ticking again. This is done after
+		 * dropping the IPI lock, because senders hold our
+		 * runqueue lock while taking it. Remote wakeups are
+		 * waiting in the inbox; collect them now.
+		 */
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		inbox_drain(curcpu->c_self);
+		if (!curcpu->c_isidle) {
+			hardclock_resume();
+		}
+		spinlock_release(&curcpu->c_runqueue_lock);
+	}
 }
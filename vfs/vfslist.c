@@ -60,6 +60,9 @@
  * kd_fs      - Filesystem object mounted on, or associated with, this
  *              device. NULL if there is no filesystem. 
  *
+ * kd_claimed - Set if the raw device has been taken for some other
+ *              use with vfs_claimdev. It can't be mounted then.
+ *
  * A filesystem can be associated with a device without having been
  * mounted if the device was created that way. In this case,
  * kd_rawname is NULL (prohibiting mount/unmount), and, as there is
@@ -80,6 +83,7 @@ struct knowndev {
 	struct device *kd_device;
 	struct vnode *kd_vnode;
 	struct fs *kd_fs;
+	bool kd_claimed;
 };
 
 DECLARRAY(knowndev);
@@ -406,6 +410,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	kd->kd_device = dev;
 	kd->kd_vnode = vnode;
 	kd->kd_fs = fs;
+	kd->kd_claimed = false;
 
 	if (fs!=NULL) {
 		volname = FSOP_GETVOLNAME(fs);
@@ -522,7 +527,7 @@ vfs_mount(const char *devname, void *data,
 		return result;
 	}
 
-	if (kd->kd_fs != NULL) {
+	if (kd->kd_fs != NULL || kd->kd_claimed) {
 		vfs_biglock_release();
 		return EBUSY;
 	}
@@ -593,6 +598,58 @@ vfs_unmount(const char *devname)
 	return result;
 }
 
+/*
+ * Claim a mountable device for something other than a filesystem,
+ * such as swap. Nothing may be mounted on it, then or later, until
+ * it's released.
+ */
+int
+vfs_claimdev(const char *devname, struct vnode **result)
+{
+	struct knowndev *kd;
+	int err;
+
+	vfs_biglock_acquire();
+
+	err = findmount(devname, &kd);
+	if (err) {
+		vfs_biglock_release();
+		return err;
+	}
+
+	if (kd->kd_fs != NULL || kd->kd_claimed) {
+		vfs_biglock_release();
+		return EBUSY;
+	}
+	KASSERT(kd->kd_device != NULL);
+
+	kd->kd_claimed = true;
+	VOP_INCREF(kd->kd_vnode);
+	*result = kd->kd_vnode;
+
+	vfs_biglock_release();
+	return 0;
+}
+
+/*
+ * Release a device claimed with vfs_claimdev.
+ */
+void
+vfs_releasedev(const char *devname)
+{
+	struct knowndev *kd;
+	int result;
+
+	vfs_biglock_acquire();
+
+	result = findmount(devname, &kd);
+	KASSERT(result == 0);
+	KASSERT(kd->kd_claimed);
+	kd->kd_claimed = false;
+
+	vfs_biglock_release();
+}
+
 /*
  * Global unmount function.
  */